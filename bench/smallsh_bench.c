@@ -0,0 +1,364 @@
+/***********************************************************
+ * Filename:        smallsh_bench.c
+ *
+ * Overview:
+ * Load harness for smallsh. Each workload is a generated
+ * script run through the shell in batch mode a few times;
+ * the best and median wall times are written as JSON so runs
+ * from different releases can be compared. The startup
+ * workload instead starts the shell once per operation.
+ *
+ * usage: smallsh_bench [-s shell] [-o results.json] [-r runs]
+ *        [-q]
+ ************************************************************/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define TRUE 1
+#define FALSE 0
+#define MAX_RUNS 32
+
+#ifndef SMALLSH_PATH
+#define SMALLSH_PATH "./smallsh"
+#endif
+
+
+/* ************************************************************************
+	                    Global Variables
+ ************************************************************************ */
+
+struct workload {    //one generated script and what it measures
+    char *name;    //name in the JSON output
+    char *unit;    //what an operation is
+    long operations;    //operations in a full run
+    void (*write)(FILE *script, long operations, char *dir);    //writes the script
+    int launches;    //whether each operation is a separate start of the shell
+};
+
+char *shellPath = SMALLSH_PATH;    //shell being measured
+char workDir[] = "/tmp/smallsh_bench.XXXXXX";    //scratch directory for scripts and files
+
+
+/* ************************************************************************
+	                    Function Prototypes
+ ************************************************************************ */
+
+void writeTrueLoop(FILE *script, long operations, char *dir);    //builtin true, one per line
+void writeSpawnLoop(FILE *script, long operations, char *dir);    //external true, one per line
+void writeDollarLines(FILE *script, long operations, char *dir);    //long lines full of $$
+void writeFanOut(FILE *script, long operations, char *dir);    //background jobs
+void writeRedirects(FILE *script, long operations, char *dir);    //redirection on every line
+void writeStartup(FILE *script, long operations, char *dir);    //one line, for the shell to start and exit
+void writeBadPipelines(FILE *script, long operations, char *dir);    //pipelines missing their first command
+double runWorkload(char *scriptPath);    //times one run of a script
+double now();    //monotonic time in seconds
+int compareTimes(const void *a, const void *b);    //orders times for the median
+
+
+struct workload workloads[] = {    //everything the harness measures
+    { "true_loop", "commands", 200000, writeTrueLoop, FALSE },
+    { "spawn_loop", "commands", 2000, writeSpawnLoop, FALSE },
+    { "dollar_parse", "tokens", 1000000, writeDollarLines, FALSE },
+    { "background_fanout", "jobs", 10000, writeFanOut, FALSE },
+    { "redirections", "commands", 5000, writeRedirects, FALSE },
+    { "startup", "launches", 2000, writeStartup, TRUE },
+    { "bad_pipelines", "lines", 20000, writeBadPipelines, FALSE },
+    { NULL, NULL, 0, NULL, FALSE }
+};
+
+
+/* ************************************************************************
+	                         Functions
+ ************************************************************************ */
+
+/***********************************************************
+ * main: runs every workload and prints the results.
+ *
+ * parameters: argument count, arguments.
+ * returns: 0 if every run succeeded.
+ ***********************************************************/
+
+int main(int argc, char *argv[]) {
+    int i;
+    int option;
+    int runs = 3;    //runs per workload
+    int quick = FALSE;    //whether to shrink the workloads for a smoke test
+    int failed = FALSE;    //whether any run failed
+    char *outputPath = NULL;    //where the JSON goes, stdout if NULL
+
+    while ((option = getopt(argc, argv, "s:o:r:q")) != -1) {
+        switch (option) {
+            case 's': shellPath = optarg; break;
+            case 'o': outputPath = optarg; break;
+            case 'r': runs = atoi(optarg); break;
+            case 'q': quick = TRUE; break;
+            default:
+                fprintf(stderr, "usage: %s [-s shell] [-o results.json] [-r runs] [-q]\n", argv[0]);
+                return 2;
+        }
+    }
+    if (runs < 1 || runs > MAX_RUNS) {
+        fprintf(stderr, "runs must be between 1 and %d\n", MAX_RUNS);
+        return 2;
+    }
+    if (mkdtemp(workDir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (outputPath != NULL && (out = fopen(outputPath, "w")) == NULL) {
+        perror(outputPath);
+        return 1;
+    }
+    fprintf(out, "{\n  \"shell\": \"%s\",\n  \"runs\": %d,\n  \"workloads\": [\n", shellPath, runs);
+
+    for (i = 0; workloads[i].name != NULL; i++) {
+        struct workload *load = &workloads[i];
+        long operations = quick == TRUE ? load->operations / 100 + 1 : load->operations;
+        char scriptPath[256];
+        double times[MAX_RUNS];
+        int run;
+
+        snprintf(scriptPath, sizeof(scriptPath), "%s/%s.sh", workDir, load->name);
+        FILE *script = fopen(scriptPath, "w");
+        if (script == NULL) {
+            perror(scriptPath);
+            return 1;
+        }
+        load->write(script, operations, workDir);
+        fclose(script);
+
+        for (run = 0; run < runs; run++) {
+            if (load->launches == TRUE) {    //start the shell over and over, adding up the times
+                long launch;
+                times[run] = 0;
+                for (launch = 0; launch < operations && times[run] >= 0; launch++) {
+                    double time = runWorkload(scriptPath);
+                    times[run] = time < 0 ? -1 : times[run] + time;
+                }
+            } else {
+                times[run] = runWorkload(scriptPath);
+            }
+            if (times[run] < 0) {
+                fprintf(stderr, "%s: shell failed\n", load->name);
+                failed = TRUE;
+                times[run] = 0;
+            }
+        }
+        qsort(times, runs, sizeof(double), compareTimes);
+        fprintf(out, "    { \"name\": \"%s\", \"unit\": \"%s\", \"operations\": %ld, "
+                "\"best_s\": %.6f, \"median_s\": %.6f, \"per_s\": %.1f }%s\n",
+                load->name, load->unit, operations, times[0], times[runs / 2],
+                times[0] > 0 ? operations / times[0] : 0.0,
+                workloads[i + 1].name != NULL ? "," : "");
+        fflush(out);
+        unlink(scriptPath);
+    }
+    fprintf(out, "  ]\n}\n");
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    char command[512];    //clean up files the workloads left behind
+    snprintf(command, sizeof(command), "rm -rf %s", workDir);
+    if (system(command) != 0) {
+        fprintf(stderr, "could not remove %s\n", workDir);
+    }
+    return failed == TRUE ? 1 : 0;
+}
+
+
+/***********************************************************
+ * writeTrueLoop: the builtin true on every line, measuring
+ * the shell's per-line overhead.
+ *
+ * parameters: script, number of lines, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeTrueLoop(FILE *script, long operations, char *dir) {
+    long i;
+    for (i = 0; i < operations; i++) {
+        fputs("true\n", script);
+    }
+}
+
+
+/***********************************************************
+ * writeSpawnLoop: an external true on every line, measuring
+ * the cost of starting and waiting for a child.
+ *
+ * parameters: script, number of lines, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeSpawnLoop(FILE *script, long operations, char *dir) {
+    long i;
+    for (i = 0; i < operations; i++) {
+        fputs("/bin/true\n", script);
+    }
+}
+
+
+/***********************************************************
+ * writeDollarLines: long lines of $$ tokens given to a
+ * builtin, measuring tokenizing and expansion.
+ *
+ * parameters: script, number of tokens, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeDollarLines(FILE *script, long operations, char *dir) {
+    long i;
+    int perLine = 500;    //tokens on each line
+    for (i = 0; i < operations; i++) {
+        if (i % perLine == 0) {
+            fputs(i == 0 ? "true" : "\ntrue", script);
+        }
+        fputs(i % 2 == 0 ? " $$" : " a$$b$$c", script);
+    }
+    fputs("\n", script);
+}
+
+
+/***********************************************************
+ * writeFanOut: an external true in the background on every
+ * line, measuring job table and reaping overhead.
+ *
+ * parameters: script, number of jobs, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeFanOut(FILE *script, long operations, char *dir) {
+    long i;
+    for (i = 0; i < operations; i++) {
+        fputs("/bin/true &\n", script);
+    }
+}
+
+
+/***********************************************************
+ * writeRedirects: builtins with redirections on every line,
+ * measuring opening and closing files.
+ *
+ * parameters: script, number of lines, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeRedirects(FILE *script, long operations, char *dir) {
+    long i;
+    for (i = 0; i < operations; i++) {
+        switch (i % 4) {
+            case 0: fprintf(script, "echo line %ld > %s/out\n", i, dir); break;
+            case 1: fprintf(script, "echo line %ld >> %s/out\n", i, dir); break;
+            case 2: fprintf(script, "test -f %s/out 2> %s/err\n", dir, dir); break;
+            case 3: fprintf(script, "pwd > %s/out < %s/out\n", dir, dir); break;
+        }
+    }
+}
+
+
+/***********************************************************
+ * writeStartup: a single builtin, so a launch costs little
+ * more than starting the shell and exiting, the way a
+ * wrapper uses it.
+ *
+ * parameters: script, number of launches, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeStartup(FILE *script, long operations, char *dir) {
+    fputs("true\n", script);
+}
+
+
+/***********************************************************
+ * writeBadPipelines: pipelines whose first stage has no
+ * command, alone, from an empty variable and inside a loop,
+ * measuring the error path. each one has to be reported,
+ * not crash the shell, so the run fails if it does.
+ *
+ * parameters: script, number of lines, scratch directory.
+ * returns: none.
+ ***********************************************************/
+
+void writeBadPipelines(FILE *script, long operations, char *dir) {
+    long i;
+    for (i = 0; i < operations; i++) {
+        switch (i % 3) {
+            case 0: fputs("| echo hi\n", script); break;
+            case 1: fputs("$EMPTY | echo hi\n", script); break;
+            case 2: fputs("for i in 1; do | echo hi; done\n", script); break;
+        }
+    }
+    fputs("true\n", script);    //the run passes if the shell gets this far
+}
+
+
+/***********************************************************
+ * runWorkload: runs the shell on a script with its output
+ * thrown away.
+ *
+ * parameters: script path.
+ * returns: elapsed seconds, or -1 if the shell failed.
+ ***********************************************************/
+
+double runWorkload(char *scriptPath) {
+    int status;
+    double started = now();
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {    //child runs the shell with nothing attached
+        int nullFD = open("/dev/null", O_RDWR);
+        dup2(nullFD, STDIN_FILENO);
+        dup2(nullFD, STDOUT_FILENO);
+        dup2(nullFD, STDERR_FILENO);
+        execl(shellPath, shellPath, scriptPath, (char *)NULL);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        return -1;
+    }
+    return now() - started;
+}
+
+
+/***********************************************************
+ * now: reads the monotonic clock.
+ *
+ * parameters: none.
+ * returns: time in seconds.
+ ***********************************************************/
+
+double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+
+/***********************************************************
+ * compareTimes: orders two times for qsort.
+ *
+ * parameters: two doubles.
+ * returns: negative, zero or positive.
+ ***********************************************************/
+
+int compareTimes(const void *a, const void *b) {
+    double left = *(const double *)a;
+    double right = *(const double *)b;
+    return (left > right) - (left < right);
+}
@@ -5,62 +5,721 @@
  *
  * Overview:
  * This program implements a small shell that with exit,
- * cd, and status commands built in.
+ * cd, and status commands built in. Commands are read from
+ * the terminal, or from a script file or pipe in batch mode.
+ * for, while and if are parsed once into a tree and run in
+ * the shell, and ; separates commands on a line.
+ * --profile times the shell's own work and writes the
+ * results as JSON on exit.
  ************************************************************/
 
+#define _GNU_SOURCE
+
 #include <assert.h>
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
-#include <regex.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <spawn.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/signalfd.h>
+#include <termios.h>
+#include <dirent.h>
+#include <sched.h>
 
-#define CHILD 0
 #define TRUE 1
 #define FALSE 0
-#define MAX_PROCS 50
+#define JOBS_START 64
 #define MAX_LENGTH 2048
+#define ARENA_BLOCK 8192
+#define ARENA_ALIGN sizeof(void *)
+#define ARGS_START 16
+#define INPUT_BLOCK 65536
+#define HASH_BUCKETS 64
+#define DEFAULT_PATH "/bin:/usr/bin"
+#define COPY_CHUNK 1048576
+#define ERROR_TO_OUTPUT -2
+#define BUILTIN_SLOTS 64
+#define BUILTIN_LONGEST 15
+#define KEEP_STATUS -1
+#define PROFILE_BUCKETS 256
+#define LINE_CACHE_BUCKETS 1024
+#define LINE_CACHE_MAX 4096
+#define LINE_SEEN_SLOTS 4096
+#define VARIABLE_BUCKETS 64
+#define ZYGOTE_FDS 4
+#define ZYGOTE_MAX 65536
+#define HISTORY_ENTRIES 8192
+#define HISTORY_BYTES 1048576
+#define HISTORY_GRAMS 4096
+#define DIR_CACHE_BUCKETS 64
+#define DIR_CACHE_MAX 256
+#define DIRENT_BUFFER 65536
+#define SUBSTITUTION_DEPTH 8
+#define KEY_REFRESH 2000
+#define REMOTE_MAX 1048576
+#define REMOTE_ID_BASE 4194304
+#define REMOTE_APPEND 1
+#define REMOTE_ERROR_TO_OUTPUT 2
+#define DEFAULT_TRANSPORT "ssh -T"
+#define DEFAULT_AGENT "smallsh --agent"
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CPU_PERIOD 100000
+#define MPOL_DEFAULT 0
+#define MPOL_BIND 2
+#define TRACE_BUFFER 65536
+#define FINISHED_KEPT 1024
 
 
 /* ************************************************************************
 	                    Global Variables
  ************************************************************************ */
 
-pid_t forePID = -1;    //keeps track of PID in the foreground
-struct backProcess *backProcs[MAX_PROCS];    //array of structs of background PIDs
+pid_t foreGroup = -1;    //keeps track of the process group of the foreground job
 int exitStatus = 0;    //keeps track of exit status of most recently terminated process
+int exitSignal = 0;    //signal that terminated the most recent process, 0 if it exited
 int backgroundDisabled = FALSE;    //keeps track of if background is disabled.
+int ownsTerminal = FALSE;    //stdin is a terminal with the shell in the foreground, so jobs get handed it
+int errorFD = STDERR_FILENO;    //where builtins write errors, their 2> file while one runs
+volatile sig_atomic_t interrupted = FALSE;    //set by the SIGINT handler for builtins that wait
+volatile sig_atomic_t childExited = FALSE;    //set by the SIGCHLD handler, cleared once children are reaped
+int childPipe[2] = { -1, -1 };    //self-pipe the SIGCHLD handler writes to
+char pidString[16];    //shell PID as a string for $$ expansion
+size_t pidLength = 0;    //length of the shell PID string
 
 struct command {    //keeps track of commands
     char **args;    //array of commands entered
+    int argCount;    //number of commands entered
     char *inputFile;    //input file name
     char *outputFile;    //output file name
+    int appendOutput;    //whether output is added to the end of the file
+    char *errorFile;    //error output file name
+    int errorToOutput;    //whether error output goes wherever output goes
     int background;    //background process indicator
+    int timed;    //whether the line started with time
+    struct command *next;    //next stage of a pipeline
 };
 
-struct backProcess {    //keeps track of PIDs in background
-    pid_t backPID;    //background PID
+struct backProcess {    //keeps track of jobs in background
+    pid_t backPID;    //background PID, the last stage of a pipeline
+    pid_t group;    //process group of the job
+    int members;    //processes of the job still running
+    int lastStatus;    //wait status of the background PID once it's done
+    struct rusage usage;    //resources used by the processes done so far
     int active;    //keeps tracks of whether or not the process is running
+    int nextFree;    //next unused slot while on the free list
+    int timed;    //whether to print its resource use when it's done
+    struct timespec started;    //when it was started, its wall time runs until it's reaped
+    char *text;    //command line, for jobs
+    struct remoteHost *host;    //host running it with @host, NULL for a local job
+    char *cgroup;    //cgroup made for it by place, NULL if none
+    char *trace;    //its stages for the trace, NULL when not tracing
+};
+
+struct jobEntry {    //index entry mapping a PID to its job
+    pid_t pid;    //process, -1 if the entry is empty
+    int slot;    //job table slot
+};
+
+struct jobTable {    //background processes stored inline and looked up by PID
+    struct backProcess *slots;    //array of background processes
+    int capacity;    //number of slots
+    int count;    //number of slots in use
+    int freeList;    //first unused slot, or -1 if full
+    struct jobEntry *index;    //open addressed map from every job process's PID to its slot
+    int indexMask;    //index size minus one, size is a power of two
+    int indexCount;    //number of PIDs in the index
+};
+
+struct jobTable backProcs = { NULL, 0, 0, -1, NULL, 0, 0 };    //table of background PIDs
+
+struct notice {    //finished background job waiting to be reported
+    int slot;    //job table slot it had, for its job number
+    int timed;    //whether to print its resource use
+    char *text;    //command line
+};
+
+struct noticeQueue {    //filled by the reaper, emptied before the prompt
+    struct notice *items;    //finished jobs, oldest first
+    struct jobUsage *usage;    //how each one ended and what it used
+    int count;    //number waiting
+    int capacity;    //room in the arrays
+};
+
+struct noticeQueue notices = { NULL, NULL, 0, 0 };    //background jobs done but not reported yet
+
+struct finishedJob {    //background job that ended before wait asked for it
+    pid_t pid;    //its background PID, 0 for an empty entry
+    int status;    //raw wait status
+};
+
+struct finishedJob finished[FINISHED_KEPT];    //statuses kept for wait, the oldest is overwritten first
+int finishedNext = 0;    //entry the next finished job goes in
+int notifyNow = FALSE;    //set -b, report jobs while a line is being typed
+
+struct arenaBlock {    //chunk of memory owned by an arena
+    struct arenaBlock *next;    //previously filled block
+    size_t size;    //bytes of data in block
+    size_t used;    //bytes handed out from block
+    char data[];    //block memory
+};
+
+struct arena {    //per-line storage for parsed commands
+    struct arenaBlock *block;    //block currently being filled
+    size_t wordStart;    //offset of the string being built in current block
+};
+
+struct input {    //source of command lines
+    int fd;    //file descriptor being read
+    char *data;    //input bytes
+    size_t length;    //number of valid bytes in data
+    size_t position;    //start of the next unread line
+    size_t capacity;    //size of the data buffer
+    int mapped;    //whether data is the whole file mapped into memory
+    int interactive;    //whether to prompt for each line
+    int eof;    //whether the end of input has been reached
+};
+
+struct hashEntry {    //remembers where a command was found on the PATH
+    char *name;    //command name as typed
+    char *path;    //absolute path of the command
+    int hits;    //number of times the command has been run
+    struct hashEntry *next;    //next entry in the same bucket
+};
+
+struct hashEntry *commandHash[HASH_BUCKETS];    //table of command locations
+char *hashedPath = NULL;    //PATH the command table was built from
+
+struct builtin {    //command the shell runs itself
+    char *name;    //command name
+    int (*run)(struct command *curCommand, int outputFD);    //function that runs it, returns exit status
+    int standalone;    //whether it's also a program, so a background use runs the program
+    int ownRedirects;    //whether it handles its own redirections
+};
+
+struct jobUsage {    //resources a finished job used
+    pid_t pid;    //process waited for, 0 if the shell did the work itself
+    int status;    //raw wait status
+    double wall;    //elapsed seconds
+    struct rusage usage;    //CPU time, memory and page faults, summed over a pipeline
+    int valid;    //whether anything has been recorded
+};
+
+struct jobUsage waitedUsage;    //filled in by the foreground wait for the current line
+struct jobUsage foreUsage;    //most recent foreground job
+struct jobUsage backUsage;    //most recent background job
+
+enum profilePhase {    //parts of the shell's own work that --profile times
+    PHASE_READ,    //reading a command line
+    PHASE_PARSE,    //splitting a line into commands, including expansion
+    PHASE_EXPAND,    //copying one token and expanding $$
+    PHASE_REDIRECT,    //opening redirection files
+    PHASE_SPAWN,    //starting a child
+    PHASE_WAIT,    //waiting for a foreground child
+    PHASE_COUNT
+};
+
+struct phaseStats {    //latency histogram of one phase
+    char *name;    //name in the JSON output
+    unsigned long count;    //number of times the phase ran
+    unsigned long long total;    //nanoseconds spent in the phase
+    unsigned long long max;    //longest single time
+    unsigned long buckets[PROFILE_BUCKETS];    //counts by time, four buckets per power of two
+};
+
+struct shellProfile {    //everything --profile collects
+    int enabled;    //whether profiling is on
+    char *file;    //where the JSON goes, NULL for stderr
+    struct phaseStats phases[PHASE_COUNT];    //phase timings
+    unsigned long lines;    //command lines read
+    unsigned long builtins;    //builtins run in the shell
+    unsigned long spawns;    //children started
+    unsigned long pipelines;    //pipelines run
+    unsigned long background;    //background jobs started
+    unsigned long cacheHits;    //lines taken from the line cache
+};
+
+struct shellProfile profile = { FALSE, NULL, {
+    { "read" }, { "parse" }, { "expand" }, { "redirect" }, { "spawn" }, { "wait" }
+} };    //shell self-profiling state
+
+struct traceLog {    //--trace, one line of JSON per job
+    int enabled;    //whether tracing is on
+    char *file;    //where the lines go
+    int fd;    //the file, -1 until it's opened
+    unsigned long saved;    //background jobs saved, to tell if a line left one running
+    char *scratch;    //stages of the job being described
+    size_t used;    //bytes of it
+    size_t size;    //room for it
+    size_t length;    //bytes waiting to be written
+    char buffer[TRACE_BUFFER];    //entries written together
+};
+
+struct traceLog trace = { FALSE, NULL, -1, 0, NULL, 0, 0, 0 };    //command trace
+
+struct builtin *builtinSlots[BUILTIN_SLOTS];    //perfect hash table of builtins, filled in at startup
+
+enum tokenKind {    //what a token on the command line means
+    TOKEN_WORD,    //argument or file name
+    TOKEN_INPUT,    //<
+    TOKEN_OUTPUT,    //>
+    TOKEN_APPEND,    //>>
+    TOKEN_ERROR,    //2>
+    TOKEN_BOTH,    //&>
+    TOKEN_BACKGROUND,    //&
+    TOKEN_PIPE,    //|
+    TOKEN_COMMENT    //# and the rest of the line
+};
+
+struct lineTemplate {    //parsed form of a line that keeps coming back
+    unsigned int hash;    //hash of the line
+    size_t length;    //length of the line
+    char *line;    //copy of the line
+    int stages;    //number of commands in the pipeline
+    size_t size;    //bytes in the blob
+    char *blob;    //commands, argument arrays and strings, with pointers stored as offsets
+    struct lineTemplate *next;    //next template in the same bucket
+};
+
+struct lineTemplate *lineCache[LINE_CACHE_BUCKETS];    //templates of repeated lines
+int lineCacheCount = 0;    //number of templates
+unsigned int lineSeen[LINE_SEEN_SLOTS];    //hashes of lines parsed once, to spot repeats
+
+struct zygoteRequest {    //header of a spawn request sent to the zygote
+    pid_t group;    //process group, as for spawnCommand
+    int argCount;    //arguments after the path
+    int environmentCount;    //environment strings after the arguments, 0 to keep the last ones
+    int length;    //bytes of path, arguments and environment that follow
+};
+
+struct zygoteReply {    //answer to a spawn request
+    pid_t pid;    //PID of the new child, -1 if it couldn't be started
+    int error;    //errno if it couldn't be started
+};
+
+struct zygoteState {    //helper process that starts children from a small address space
+    int enabled;    //whether --zygote asked for one
+    int fd;    //shell's end of the socketpair, -1 if there's no zygote
+    int cwdFD;    //shell's working directory, handed to every child
+    unsigned int environmentSent;    //environment generation the zygote has
+    char **environment;    //in the zygote, the environment children get
+    char *environmentText;    //in the zygote, the strings it points to
+    char buffer[ZYGOTE_MAX];    //request being sent or received
+};
+
+struct zygoteState zygote = { FALSE, -1, -1, 0, NULL, NULL };    //spawn helper
+
+struct remoteRequest {    //header of a job sent to an agent, both ends are the same smallsh
+    int32_t id;    //job number the shell reports it under
+    int32_t argCount;    //arguments after the three redirection names
+    int32_t environmentCount;    //environment strings after the arguments, 0 to keep the last ones
+    int32_t flags;    //REMOTE_APPEND, REMOTE_ERROR_TO_OUTPUT
+    uint32_t length;    //bytes of redirections, arguments and environment that follow
+};
+
+struct remoteReply {    //sent by an agent when one of its jobs is done
+    int32_t id;    //job number from the request
+    int32_t status;    //wait status
+    int64_t userMicros;    //user CPU time
+    int64_t systemMicros;    //system CPU time
+    int64_t maxResident;    //peak resident set in kilobytes
+};
+
+struct remoteHost {    //connection to the agent on one host, kept for every job sent there
+    char *name;    //host as written after @
+    int fd;    //shell's end of the transport's socket
+    pid_t pid;    //transport process, ssh by default
+    unsigned int environmentSent;    //environment generation the agent has
+    char reply[sizeof(struct remoteReply)];    //reply being received
+    size_t received;    //bytes of it so far
+    struct remoteHost *next;    //next connection
+};
+
+struct remoteHost *remoteHosts = NULL;    //open connections
+pid_t nextRemoteID = REMOTE_ID_BASE;    //job number for the next remote job, past any PID
+int agentMode = FALSE;    //--agent, serve jobs on stdin instead of being a shell
+
+struct placement {    //where place puts the children of one command line
+    int active;    //whether the line started with place
+    int hasCPUs;    //whether -c or -n limited the CPUs
+    cpu_set_t cpus;    //CPUs the children may run on
+    int spread;    //-s, each child gets the next one of them to itself
+    int nextCPU;    //CPU the next child gets with -s
+    int node;    //-n, NUMA node memory comes from, -1 for any
+    long long memoryMax;    //-m, memory.max in bytes, 0 for no limit
+    int cpuQuota;    //-q, percent of one CPU for cpu.max, 0 for no limit
+    int cpuWeight;    //-w, cpu.weight, 0 to leave it alone
+    char *leaf;    //cgroup directory made for the line, NULL if none
+    int joinFailed;    //whether placeSpawn's child couldn't join it, already reported
+    cpu_set_t saved;    //shell's own CPUs while it's stepped in
+};
+
+struct placement placement;    //placement of the current line
+char *homeCgroup = NULL;    //cgroup directory the shell belongs to
+int leafCount = 0;    //cgroups made so far, to name the next one
+
+struct gramList {    //history entries containing one pair of bytes, oldest first
+    unsigned int *entries;    //entry numbers
+    unsigned int count;    //entries in the list
+    unsigned int capacity;    //room in the list
+    unsigned int skip;    //leading entries that have left the ring
+};
+
+struct historyRing {    //recent command lines, the oldest overwritten first
+    char text[HISTORY_BYTES];    //entry text laid end to end
+    unsigned int start[HISTORY_ENTRIES];    //offset of each entry's text, by entry number
+    unsigned short length[HISTORY_ENTRIES];    //length of each entry
+    unsigned int first;    //number of the oldest entry kept
+    unsigned int next;    //number the next entry gets
+    size_t end;    //where the next entry's text goes
+    struct gramList grams[HISTORY_GRAMS];    //reverse search index by pairs of bytes
+    int fd;    //history file, only ever appended to, -1 if there isn't one
+};
+
+struct historyRing history = { .fd = -1 };    //interactive command history
+
+struct lineEditor {    //interactive line editing state
+    struct termios cooked;    //terminal settings to put back after each line
+    unsigned int browse;    //history entry being shown, history.next for the line being typed
+    char *saved;    //line being typed, kept while moving through history
+    size_t savedLength;    //its length
+    size_t savedCapacity;    //size of the saved buffer
+};
+
+struct lineEditor editor;    //line editor for the interactive shell
+
+struct input shellInput;    //where the shell gets its commands
+struct arena lineArena = { NULL, 0 };    //holds the current command line's struct, arguments, and strings
+
+
+struct variable {    //shell variable, set by for loops, assignments and export, or taken from the environment
+    char *name;    //variable name
+    char *entry;    //name=value, as it goes in the environment
+    char *value;    //current value, inside entry
+    int exported;    //whether children get it in their environment
+    struct variable *next;    //next variable in the same bucket
+};
+
+struct variable *variables[VARIABLE_BUCKETS];    //table of shell variables
+int variableCount = 0;    //number of variables
+int variablesImported = FALSE;    //whether the environment has been copied into variables yet
+char **environment = NULL;    //environment handed to children, shared by every spawn until a variable changes
+int environmentDirty = TRUE;    //whether an exported variable changed since the environment was built
+unsigned int environmentGeneration = 0;    //bumped each time the environment is rebuilt
+pid_t lastBackground = -1;    //most recent background job, for $!
+int tokenSplit = FALSE;    //set by expandToken when a token's expansion gets split into fields
+
+struct substitution {    //what one level of $(...) nesting runs with
+    int fd;    //memfd the command's output is captured in
+    struct arena arena;    //line arena for the command, the outer line keeps its own
+};
+
+struct substitution substitutions[SUBSTITUTION_DEPTH];    //by nesting depth, kept for reuse
+int substitutionDepth = 0;    //number of $(...) being run right now
+int inSubshell = FALSE;    //whether this is the child running a $(...), which exit leaves alone
+int lineUncacheable = FALSE;    //set while parsing a line whose words depend on variables or files
+
+struct linuxDirent {    //directory entry as getdents64 returns it
+    uint64_t d_ino;    //inode number
+    int64_t d_off;    //offset of the next entry
+    unsigned short d_reclen;    //size of this entry
+    unsigned char d_type;    //file type, DT_UNKNOWN if the file system doesn't say
+    char d_name[];    //name
+};
+
+struct dirListing {    //cached names in a directory, for globbing
+    char *path;    //directory as the pattern spelled it
+    dev_t device;    //device and inode it was read from
+    ino_t inode;
+    struct timespec modified;    //its mtime when it was read
+    int racy;    //whether it was read so soon after a change that the mtime can't be trusted
+    unsigned int checked;    //glob generation it was last checked in
+    char *names;    //entry names, each ending in a NUL
+    unsigned int *offsets;    //where each name starts
+    unsigned char *types;    //type of each entry
+    int count;    //number of entries
+    struct dirListing *next;    //next listing in the same bucket
+};
+
+struct globState {    //pattern being expanded
+    char *path;    //path built so far
+    size_t capacity;    //size of the path buffer
+    char **matches;    //matching paths, in the line arena
+    int count;    //number of matches
+    int room;    //size of the matches array
+};
+
+struct dirListing *dirCache[DIR_CACHE_BUCKETS];    //directory listings by path
+int dirCacheCount = 0;    //number of cached listings
+unsigned int globGeneration = 0;    //bumped for each pattern so every directory is checked once per glob
+struct globState glob = { NULL, 0, NULL, 0, 0 };    //pattern expansion state, the path buffer is reused
+
+enum keyword {    //words that shape for, while and if
+    KEY_NONE,    //not a keyword, an ordinary command
+    KEY_FOR,
+    KEY_WHILE,
+    KEY_IF,
+    KEY_THEN,
+    KEY_ELIF,
+    KEY_ELSE,
+    KEY_FI,
+    KEY_DO,
+    KEY_DONE,
+    KEY_END    //no more input
+};
+
+enum nodeKind {    //kinds of node in a compound command's tree
+    NODE_COMMAND,    //a plain command line, run like any other line
+    NODE_FOR,    //for name in words; do body; done
+    NODE_WHILE,    //while condition; do body; done
+    NODE_IF    //if condition; then body; else orElse; fi
 };
 
+struct leafToken {    //word of a plain command in a compound one, split off when the tree is parsed
+    char *text;    //the word as written
+    size_t length;    //length of the word
+    enum tokenKind kind;    //what the word means
+};
+
+struct node {    //piece of a compound command, parsed once and run as often as needed
+    enum nodeKind kind;    //what the node does
+    char *text;    //command line, or the words of a for loop
+    size_t length;    //length of text
+    struct leafToken *tokens;    //a command's words, so running it only expands them
+    int tokenCount;    //number of words
+    char *name;    //variable a for loop sets
+    struct node *condition;    //commands whose status decides a while or if
+    struct node *body;    //loop body, or the commands if the condition succeeds
+    struct node *orElse;    //commands if the condition fails, elif is a nested if
+    struct node *next;    //next node in the same list
+};
+
+struct scanner {    //position in a compound command's text
+    char *pos;    //next unread character
+    char *end;    //end of the text
+    int failed;    //whether a syntax error has been reported
+};
+
+struct arena treeArena = { NULL, 0 };    //holds the tree of the compound command being run
+
 
 /* ************************************************************************
 	                    Function Prototypes
  ************************************************************************ */
 
 void initializeShell();    //initializes shell with signal handlers
+char *parseOptions(int argc, char *argv[]);    //handles command line options
+void openInput(struct input *in, char *script);    //sets up where commands are read from
+void attachInput(struct input *in, int fd, off_t offset);    //sets up batch reading from a file descriptor
+void closeInput(struct input *in);    //releases a batch input's buffer
+char *readLine(struct input *in, size_t *length);    //gets the next command line
+void fillInput(struct input *in);    //reads another block of batch input
+char *editLine(struct input *in, size_t *length);    //reads a line from the terminal with editing and history
+int reverseSearch(char *buffer, size_t *length, size_t *cursor);    //searches history as the user types
+void refreshLine(char *prompt, size_t promptLength, char *text, size_t length, size_t cursor);    //redraws the line being edited
+int readKey();    //reads a byte from the terminal
+void loadHistory();    //loads the end of the history file into the ring
+void addHistory(char *line, size_t length, int save);    //adds a line to the history ring
+char *historyEntry(unsigned int entry, size_t *length);    //text of a history entry
+long searchHistory(char *query, size_t length, unsigned int before);    //finds the newest entry containing a string
+void indexHistory(unsigned int entry);    //adds an entry to the reverse search index
+int historyBuiltin(struct command *curCommand, int outputFD);    //prints the command history
 void runShell();    //runs the shell
-void getCommand(char *command, struct command *curCommand); //parses the user input command
-void exitShell();    //exits the shell
-void changeDir(char *path);    //changes the current directory
-void printStatus();    //prints the exit status of the most recently terminated process
+void runLine(char *line, size_t length);    //parses and runs one command line
+void runLeaf(struct node *node);    //runs a plain command of a compound command from its words
+void runParsedLine(struct command *curCommand);    //runs a parsed command line
+int isCompound(char *line, size_t length);    //checks if a line needs the compound parser
+void runCompound(char *line, size_t length);    //reads, parses and runs a compound command
+int compoundDepth(char *text, size_t length);    //counts unclosed for, while and if
+enum keyword peekKeyword(struct scanner *scan, char **wordEnd);    //looks at the next command's first word
+enum keyword keywordOf(const char *word, size_t length);    //recognizes a keyword
+void takePiece(struct scanner *scan, char **start, size_t *length);    //takes the rest of a command
+struct node *parseList(struct scanner *scan, int stops, enum keyword *stopped);    //parses commands up to a keyword
+struct node *parseFor(struct scanner *scan);    //parses a for loop
+struct node *parseWhile(struct scanner *scan);    //parses a while loop
+struct node *parseIf(struct scanner *scan);    //parses an if, or an elif
+int expectKeyword(struct scanner *scan, enum keyword wanted, char *word);    //consumes a required keyword
+struct node *newNode(enum nodeKind kind);    //allocates a tree node
+void syntaxError(struct scanner *scan, char *message);    //reports a syntax error once
+void runNodes(struct node *list);    //runs a list of tree nodes
+char **expandWords(char *text, size_t length, int *count);    //expands the words of a for loop
+struct variable *setVariable(char *name, char *value);    //sets a shell variable
+char *findVariable(const char *name, size_t length);    //looks up a shell variable's value
+struct variable *lookupVariable(const char *name, size_t length);    //looks up a shell variable
+void unsetVariable(char *name);    //removes a shell variable
+int isName(const char *name, size_t length);    //checks that a word can name a variable
+int isAssignment(struct command *curCommand);    //checks if a command only assigns variables
+void importEnvironment();    //turns the shell's environment into exported variables
+char **currentEnvironment();    //environment for children, rebuilt only after a change
+int exportBuiltin(struct command *curCommand, int outputFD);    //exports variables
+int unsetBuiltin(struct command *curCommand, int outputFD);    //removes variables
+struct command *newCommand();    //allocates an empty command in the line arena
+void getCommand(char *command, size_t length, struct leafToken *tokens, int tokenCount, struct command *curCommand); //parses the user input command
+struct leafToken *splitTokens(char *text, size_t length, int *count);    //splits a compound command's plain command into words
+char *expandToken(char *token, size_t length);    //copies a token into the line arena expanding $$
+char *tokenEnd(char *pos, char *end, int tabs);    //finds the end of a token, keeping $(...) whole
+char *substitutionEnd(char *dollar, char *end);    //finds the end of a $(...)
+void captureOutput(char *command, size_t length);    //runs a $(...) and adds its output to the word being built
+int isHarmless(char *command, size_t length);    //checks if a $(...) can't change the shell, so it needn't fork
+void runSubshell(char *command, size_t length);    //runs a $(...) in a child of the shell
+char **splitFields(char *token, size_t length, char *word, int *count);    //splits and globs an expanded word
+char **globWord(char *word, int *count);    //expands a pattern into the paths it matches
+void globWalk(size_t pathLength, const char *rest);    //matches the rest of a pattern below the path so far
+void globAdd(size_t pathLength);    //adds the path so far to the matches
+void globPath(size_t length, const char *chars, size_t count);    //appends to the path being built
+int isPattern(const char *word, size_t length);    //checks for *, ? or a bracket expression
+int globMatch(const char *pattern, const char *patternEnd, const char *name);    //matches a name against one pattern component
+const char *bracketEnd(const char *pattern, const char *patternEnd);    //finds the end of a bracket expression
+int bracketMatch(const char *pattern, const char *end, unsigned char c);    //checks a character against a bracket expression
+int compareMatches(const void *a, const void *b);    //orders matches for qsort
+struct dirListing *listDirectory(const char *path);    //reads a directory, or takes it from the cache
+int readListing(struct dirListing *listing, int fd);    //reads a directory's names with getdents64
+void clearDirCache();    //forgets every cached directory
+enum tokenKind classifyToken(const char *token, size_t length);    //tells operators apart from words
+struct command *parseLine(char *line, size_t length);    //parses a line, using the line cache when it can
+unsigned int hashLine(const char *line, size_t length);    //hashes a command line
+void saveTemplate(unsigned int hash, char *line, size_t length, struct command *parsed);    //caches a parsed line
+size_t copyToBlob(char *blob, size_t *used, char *string);    //copies a string into a template blob
+struct command *cloneTemplate(struct lineTemplate *template);    //copies a template into the line arena
+void *relocate(char *base, void *offset);    //turns a template offset back into a pointer
+void clearLineCache();    //empties the line cache
+void indexBuiltins();    //builds the builtin hash table
+unsigned builtinHash(const char *name, size_t length);    //hashes a builtin name
+struct builtin *findBuiltin(char *name);    //finds a builtin command by name
+int runBuiltin(struct builtin *builtin, struct command *curCommand);    //runs a builtin with its redirections
+int writeOutput(int fd, const char *data, size_t length);    //writes all of a buffer
+void exitShell(int status);    //exits the shell
+int exitBuiltin(struct command *curCommand, int outputFD);    //exits the shell
+int changeDir(struct command *curCommand, int outputFD);    //changes the current directory
+int printStatus(struct command *curCommand, int outputFD);    //prints the exit status of the most recently terminated process
+int echoBuiltin(struct command *curCommand, int outputFD);    //prints its arguments
+int trueBuiltin(struct command *curCommand, int outputFD);    //succeeds
+int falseBuiltin(struct command *curCommand, int outputFD);    //fails
+int testBuiltin(struct command *curCommand, int outputFD);    //evaluates a file or comparison test
+int testFile(char op, char *path);    //evaluates a single file test
+int printfBuiltin(struct command *curCommand, int outputFD);    //prints its arguments under a format
+size_t readEscape(const char *text, char *escaped, int argument);    //decodes one printf backslash escape
+int pwdBuiltin(struct command *curCommand, int outputFD);    //prints the current directory
+int sleepBuiltin(struct command *curCommand, int outputFD);    //waits for a number of seconds
+int hashBuiltin(struct command *curCommand, int outputFD);    //lists, adds to, or clears the command table
+int decodeStatus(int status);    //turns a wait status into an exit value
+void printUsage(int fd, struct jobUsage *job);    //prints the resources a job used
+void addUsage(struct rusage *total, struct rusage *usage);    //adds one process's resources to a total
+double elapsedSince(struct timespec *started);    //seconds since a moment
+char *lookupCommand(char *name);    //finds a command on the PATH using the command table
+void forgetCommand(char *name);    //removes a command from the command table
+void clearHash();    //empties the command table
+unsigned int hashString(const char *string);    //hashes a string for table lookup
 int runCommand(struct command *curCommand);    //runs the user command
+int openRedirections(struct command *curCommand, int fds[3]);    //opens a command's redirection files
+void closeRedirections(int fds[3]);    //closes the shell's copies of a child's descriptors
+int canCatThrough(struct command *curCommand, int inputFD);    //checks if the shell can do a cat itself
+int catThrough(struct command *curCommand, int inputFD, int outputFD);    //does a cat inside the shell
+int copyThrough(int inputFD, int outputFD);    //copies between descriptors in the kernel where possible
+pid_t spawnCommand(char **args, int fds[3], pid_t group);    //starts a child without waiting for it
+int launchCommand(pid_t *spawnpid, char *path, char **args, int fds[3], pid_t group,
+                  posix_spawn_file_actions_t *actions, posix_spawnattr_t *attributes);    //starts a child from the shell or the zygote
+int startPlacement(struct command *curCommand);    //takes place and its options off a line
+void endPlacement();    //removes the line's cgroup once nothing needs it
+void enterPlacement();    //moves the shell where the next child should start
+void leavePlacement();    //moves the shell back
+int placeSpawn(pid_t *spawnpid, char *path, char **args, int fds[3], pid_t group);    //starts a child that joins the placement's cgroup
+int parseCPUList(char *text, cpu_set_t *cpus);    //reads a list like 0-3,8
+int writeCgroup(char *dir, char *file, char *value);    //writes one cgroup control file
+void startZygote();    //forks the spawn helper
+void runZygote(int socketFD);    //serves spawn requests, never returns
+void zygoteChild(struct zygoteRequest *request, char **args, int *fds, int errorFD);    //sets up and runs a child of the zygote
+int zygoteSpawn(pid_t *spawnpid, char *path, char **args, int fds[3], pid_t group);    //asks the zygote to start a child
+void stopZygote();    //shuts the spawn helper down
+int runRemote(struct command *curCommand);    //sends a background job to another host
+struct remoteHost *connectRemote(char *name);    //finds or opens the connection to a host
+void readRemote(struct remoteHost *host);    //handles the replies that have arrived from a host
+void dropRemote(struct remoteHost *host);    //closes a connection, failing its jobs
+void runAgent();    //serves jobs sent by a shell, never returns
+pid_t agentSpawn(struct remoteRequest *request, char *payload);    //starts one job in the agent
+int runPipeline(struct command *pipeline);    //runs the stages of a pipeline connected by pipes
+int waitGroup(pid_t group, pid_t lastPID, struct rusage *usage);    //waits for every process in a pipeline's group
+int waitForeground(pid_t group, pid_t lastPID);    //waits for a foreground job with the terminal handed to it
+int waitBuiltin(struct command *curCommand, int outputFD);    //waits for background jobs
+void keepStatus(pid_t pid, int status);    //keeps a finished job's status for wait
+int findStatus(pid_t pid);    //finds a kept status
+int takeStatus(pid_t pid, int *status);    //hands over and forgets a kept status
+int parallelBuiltin(struct command *curCommand, int outputFD);    //runs a command over many items, N at a time
+int waitParallel(pid_t *running, int inFlight, int *result);    //waits for a parallel job to finish
 void interruptSignal(int sigNum);    //catches SIGINT signals sent to foreground processes
 void childTerminates(int sigNum);    //catches SIGCHLD signals sent by background processes
+void reapChildren();    //reaps finished background processes and reports them
+void reportChild(pid_t pid, int status, struct rusage *usage);    //reports a reaped background process
 void disableBackground(int sigNum);   //catches SIGTSTP signals to prevent background processes
-void saveProcess(int spawnpid);    //saves information about a background process
+void saveProcess(pid_t *pids, int count, struct command *pipeline);    //saves information about a background job
+char *commandText(struct command *pipeline);    //spells out a command line for jobs
+void drainNotices();    //reports the background jobs that have finished
+int jobsBuiltin(struct command *curCommand, int outputFD);    //lists background jobs
+int setBuiltin(struct command *curCommand, int outputFD);    //sets shell options
+int findProcess(pid_t pid);    //finds the job table slot of a background process
+void removeProcess(int slot);    //removes a finished background job from the job table
+void indexProcess(pid_t pid, int slot);    //adds a PID to the job index
+void forgetProcess(pid_t pid);    //removes a PID from the job index
+void growJobs();    //doubles the size of the job table
+void growJobIndex();    //doubles the size of the job index
+int jobIndexStart(pid_t pid);    //index position where a PID's search begins
+struct arenaBlock *arenaNewBlock(size_t size);    //allocates an empty arena block
+void arenaReset(struct arena *arena);    //releases everything in an arena for reuse
+void *arenaAlloc(struct arena *arena, size_t size);    //hands out memory from an arena
+void arenaBeginWord(struct arena *arena);    //starts building a string in an arena
+void arenaPutWord(struct arena *arena, const char *chars, size_t count);    //appends to the string being built
+char *arenaEndWord(struct arena *arena);    //terminates the string being built
+unsigned long long profileStart();    //starts timing a phase
+void profileEnd(enum profilePhase phase, unsigned long long started);    //records a phase's time
+int profileBucket(unsigned long long nanoseconds);    //histogram bucket for a time
+unsigned long long profilePercentile(struct phaseStats *stats, double fraction);    //estimates a percentile
+void profileDump();    //writes the profile as JSON
+char *traceCommand(struct command *pipeline);    //describes a line's stages as JSON for the trace
+void traceString(char *text);    //adds a JSON string or null to the scratch buffer
+void traceText(const char *text, size_t length);    //adds bytes to the scratch buffer
+void traceEntry(char *stages, pid_t pid, int background, int exitValue, int signal, struct jobUsage *done);    //adds a job to the trace
+void traceAppend(const char *format, ...);    //adds text to the trace buffer
+void traceFlush();    //writes out the trace buffer
+
+
+struct builtin builtins[] = {    //commands the shell runs itself
+    { "exit", exitBuiltin, FALSE, FALSE },
+    { "cd", changeDir, FALSE, FALSE },
+    { "status", printStatus, FALSE, FALSE },
+    { "hash", hashBuiltin, FALSE, FALSE },
+    { "parallel", parallelBuiltin, FALSE, TRUE },
+    { "echo", echoBuiltin, TRUE, FALSE },
+    { "true", trueBuiltin, TRUE, FALSE },
+    { "false", falseBuiltin, TRUE, FALSE },
+    { "test", testBuiltin, TRUE, FALSE },
+    { "[", testBuiltin, TRUE, FALSE },
+    { "printf", printfBuiltin, TRUE, FALSE },
+    { "pwd", pwdBuiltin, TRUE, FALSE },
+    { "sleep", sleepBuiltin, TRUE, FALSE },
+    { "wait", waitBuiltin, FALSE, FALSE },
+    { "history", historyBuiltin, FALSE, FALSE },
+    { "export", exportBuiltin, FALSE, FALSE },
+    { "unset", unsetBuiltin, FALSE, FALSE },
+    { "jobs", jobsBuiltin, FALSE, FALSE },
+    { "set", setBuiltin, FALSE, FALSE },
+    { NULL, NULL, FALSE, FALSE }
+};
 
 
 /* ************************************************************************
@@ -70,417 +729,6957 @@ void saveProcess(int spawnpid);    //saves information about a background proces
 /***********************************************************
  * main: calls functions to run shell.
  *
- * parameters: none.
+ * parameters: argument count, arguments (options, then an
+ * optional script).
  * returns: none.
  ***********************************************************/
 
-int main() {
+int main(int argc, char *argv[]) {
+    char *script = parseOptions(argc, argv);    //handle options first
+    if (agentMode == TRUE) {    //started by another shell's @host command
+        runAgent();
+    }
     initializeShell();    //initialize shell
+    openInput(&shellInput, script);    //decide where commands come from
     runShell();    //run shell
     return 0;
 }
 
 
 /***********************************************************
- * initializeShell: initializes the shell.
+ * parseOptions: handles command line options. --profile, or
+ * --profile=FILE, turns on self-profiling with the JSON
+ * written to stderr or FILE on exit. SMALLSH_PROFILE=FILE in
+ * the environment does the same. --zygote, or SMALLSH_ZYGOTE
+ * set, starts children from a helper process forked at
+ * startup. --agent serves jobs for @host commands.
+ * --trace=FILE, or SMALLSH_TRACE=FILE, appends a line of
+ * JSON to FILE for every job the shell runs.
+ *
+ * parameters: argument count, arguments.
+ * returns: script path, or NULL if there isn't one.
+ ***********************************************************/
+
+char *parseOptions(int argc, char *argv[]) {
+    int i;
+    char *file = getenv("SMALLSH_PROFILE");    //profile requested by the environment
+
+    if (file != NULL && file[0] != '\0') {
+        profile.enabled = TRUE;
+        profile.file = file;
+    }
+    if (getenv("SMALLSH_ZYGOTE") != NULL) {
+        zygote.enabled = TRUE;
+    }
+    file = getenv("SMALLSH_TRACE");    //trace requested by the environment
+    if (file != NULL && file[0] != '\0') {
+        trace.enabled = TRUE;
+        trace.file = file;
+    }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--zygote") == 0) {
+            zygote.enabled = TRUE;
+        } else if (strcmp(argv[i], "--agent") == 0) {
+            agentMode = TRUE;
+        } else if (strncmp(argv[i], "--trace=", 8) == 0) {
+            trace.enabled = TRUE;
+            trace.file = argv[i] + 8;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile.enabled = TRUE;
+            profile.file = NULL;
+        } else if (strncmp(argv[i], "--profile=", 10) == 0) {
+            profile.enabled = TRUE;
+            profile.file = argv[i] + 10;
+        } else {    //first argument that isn't an option is the script
+            return argv[i];
+        }
+    }
+    return NULL;
+}
+
+
+/***********************************************************
+ * initializeShell: initializes the shell. nothing is allocated
+ * here, so a shell that runs a short script starts about as
+ * fast as the process itself.
  *
  * parameters: none.
  * returns: none.
  ***********************************************************/
 
 void initializeShell() {
+    if (zygote.enabled == TRUE) {    //fork the helper while the shell is still small
+        startZygote();
+    }
+
     struct sigaction sigint_action;    //SIGINT struct
     sigint_action.sa_handler = interruptSignal;    //SIGINT handler function
     sigint_action.sa_flags = SA_RESTART;    //make sure call can restart
     sigfillset(&(sigint_action.sa_mask));    //block other signals
     sigaction(SIGINT, &sigint_action, NULL);    //identify SIGINT as signal
 
+    if (pipe2(childPipe, O_NONBLOCK | O_CLOEXEC) == -1) {    //self-pipe for child exit events
+        perror("Error");
+        exit(EXIT_FAILURE);
+    }
+
     struct sigaction sigchld_action;    //SIGCHLD struct
     sigchld_action.sa_handler = childTerminates;    //SIGCHLD handler function
     sigchld_action.sa_flags = SA_RESTART;    //make sure call can restart
     sigfillset(&(sigchld_action.sa_mask));    //block other signals
     sigaction(SIGCHLD, &sigchld_action, NULL);    //identify SIGCHLD as signal
+    sigaction(SIGIO, &sigchld_action, NULL);    //replies from remote agents wake the same pipe
 
     struct sigaction sigtstp_action;    //SIGTSTP struct
     sigtstp_action.sa_handler = disableBackground;    //SIGTSTP handler function
     sigtstp_action.sa_flags = SA_RESTART;    //make sure call can restart
     sigfillset(&(sigtstp_action.sa_mask));    //block other signals
     sigaction(SIGTSTP, &sigtstp_action, NULL);    //identify SIGTSTP as signal
+
+    signal(SIGTTOU, SIG_IGN);    //let the shell hand the terminal to pipelines
+    signal(SIGPIPE, SIG_IGN);    //a closed pipe shows up as EPIPE when the shell copies into it
+
+    ownsTerminal = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == getpgrp();    //jobs in groups of their own need it handed over
+    pidLength = sprintf(pidString, "%d", getpid());    //cache PID for $$ expansion
+    indexBuiltins();    //set up builtin lookup, the arenas and variables are set up when they're first used
 }
 
 
 /***********************************************************
- * runShell: runs the shell and acts as manager of shell
- * operations.
+ * openInput: sets up where commands are read from. the shell
+ * is interactive only when there is no script and stdin is a
+ * terminal.
  *
- * parameters: none.
+ * parameters: input struct, script path or NULL.
  * returns: none.
  ***********************************************************/
 
-void runShell() {
-    int i;
-    for (i = 0; i < MAX_PROCS; i++) {
-        backProcs[i] = NULL;    //make sure array of baground PIDs is not full of garbage
-    }
-
-    while (1) {    //run always until exited manually through user command
-        struct command *curCommand = malloc(sizeof(struct command));
-        assert(curCommand != NULL);    //make sure struct exists
-        curCommand->args = NULL;    //reset argument array
-        curCommand->inputFile = NULL;    //reset input file
-        curCommand->outputFile = NULL;    //reset output file
-        curCommand->background = FALSE;    //reset background process indicator
-
-        char buffer[MAX_LENGTH];    //char array to get command
-
-        fprintf(stdout, ": ");    //print command prompt
-        fflush(stdout);    //flush output
+void openInput(struct input *in, char *script) {
+    off_t offset = 0;    //where reading starts in a regular file
 
-        memset(buffer, '\0', sizeof(buffer));    //make sure buffer isn't full of garbage before using for fgets
-        fgets(buffer, sizeof(buffer), stdin);    //get user command
-
-        curCommand->args = malloc(strlen(buffer) * sizeof(char *));    //allocate enough memory for arguments
-        assert(curCommand->args != NULL);    //make sure array exists
-        for (i = 0; i < strlen(buffer); i++) {
-            curCommand->args[i] = NULL;    //make sure array isn't full of garbage before using to store commands
-        }
-        getCommand(buffer, curCommand);    //get information from command
-
-        if (curCommand->args[0] == '\0') {    //if command was empty, restart loop
-            continue;
-        } else if (strcmp("exit", curCommand->args[0]) == 0) {    //if exit command, free argument and exit shell
-            free(curCommand->args);
-            curCommand->args = NULL;
-            exitShell();    //call to exit shell
-        } else if (strcmp("cd", curCommand->args[0]) == 0) {    //if cd command, change to indicated directory
-            changeDir(curCommand->args[1]);
-        } else if (strcmp("status", curCommand->args[0]) == 0) {    //if status command, call print function
-            printStatus();
-        } else {    //deal with any commands not built-in
-            exitStatus = runCommand(curCommand);    //run the user command
-            //although exitStatus is global, log status here so forced exits [exit(1)] can be utilized and saved
-        }
+    in->fd = STDIN_FILENO;    //default to reading stdin
+    in->length = 0;
+    in->position = 0;
+    in->mapped = FALSE;
+    in->eof = FALSE;
+    in->interactive = FALSE;
 
-        if (curCommand->args != NULL) {    //free the argument array for next iteration of while loop
-            free(curCommand->args);
-            curCommand->args = NULL;
+    if (script != NULL) {    //if a script was given, run it
+        in->fd = open(script, O_RDONLY | O_CLOEXEC);
+        if (in->fd == -1) {    //make sure the script can be read
+            perror(script);
+            exit(EXIT_FAILURE);
         }
+    } else if (isatty(STDIN_FILENO)) {    //if a person is typing, prompt for each line
+        in->interactive = TRUE;
+        in->capacity = MAX_LENGTH;
+        in->data = malloc(in->capacity);
+        assert(in->data != NULL);    //make sure buffer exists
+        loadHistory();    //pick up where the last session left off
+        return;
+    } else {
+        offset = lseek(STDIN_FILENO, 0, SEEK_CUR);    //stdin may already be partly read
     }
+
+    attachInput(in, in->fd, offset);    //read commands from the chosen file descriptor
 }
 
 
 /***********************************************************
- * getCommand: parses input to get command.
+ * attachInput: sets up batch reading from a file descriptor.
+ * regular files are mapped into memory whole, and anything
+ * else is read in large blocks.
  *
- * parameters: user command, command struct.
+ * parameters: input struct, file descriptor, starting offset.
  * returns: none.
  ***********************************************************/
 
-void getCommand(char *command, struct command *curCommand) {
-    int i = 0;    //argument i
-    char *delimiter = " \n";    //command string delimiters
-    int outRedirect = FALSE;    //indicates whether output redirection is necessary
-    int inRedirect = FALSE;    //indicates whether input redirection is necessary
-
-    char *token = strtok(command, delimiter);    //get the first token in the command string
+void attachInput(struct input *in, int fd, off_t offset) {
+    struct stat info;    //file information for the input
 
-    while (token != NULL) {        //while there are still tokens in the command
-        regex_t regex;        //set up regular expression
-        regcomp(&regex, "^#", 0);        //check if there is a comment symbol
-        int isComment = regexec(&regex, token, 0, NULL, 0);        //save if command is a comment
+    in->fd = fd;
+    in->length = 0;
+    in->position = 0;
+    in->mapped = FALSE;
+    in->eof = FALSE;
+    in->interactive = FALSE;
 
-        if (outRedirect == TRUE) {        //if it's previously been determined there is output redirection
-            outRedirect = FALSE;             //reset output redirection indicator
-            curCommand->outputFile = token;        //current token is now name of output file
-        } else if (inRedirect == TRUE) {        //if it's previously been determined there is input redirection
-            inRedirect = FALSE;             //reset input redirection indicator
-            curCommand->inputFile = token;        //current token is now name of input file
-        } else if (isComment == 0) {        //if there's a comment in the command
-            curCommand->args[i] = '\0';    //ignore all characters in the command and leave
-            break;
-        } else if (strcmp(token, "<") == 0) {    //if there's an input redirection symbol
-            inRedirect = TRUE;             //set the input redirection indicator
-        } else if (strcmp(token, ">") == 0) {    //if there's an output redirection indicator
-            outRedirect = TRUE;             //set the output redirection indicator
-        } else if (strcmp(token, "&") == 0) {   //if there's a background symbol
-            if (backgroundDisabled == FALSE) {    //and if the background isn't disabled
-                curCommand->background = TRUE;    //set the background process indicator
-            }
-        } else if (strstr(token, "$$")) {    //if there's a PID symbol
-            int pid = getpid();    //get PID
-            char pre[MAX_LENGTH];    //chars before the $$
-            char res[MAX_LENGTH];    //end result
-            char post[MAX_LENGTH];    //chars after the $$
-            memset(pre, '\0', MAX_LENGTH);    //make sure all arrays aren't full of garbage
-            memset(res, '\0', MAX_LENGTH);
-            memset(post, '\0', MAX_LENGTH);
-            int replace = strstr(token, "$$") - token;    //find placement of $$ in string
-            strncpy(pre, token, replace);    //copy chars before $$ to pre array
-            strncpy(post, &token[replace + 2], strlen(token) - (replace + 2));    //copy chars after $$ to post array
-            if (pre == NULL && post == NULL) {    //if only $$, just use PID
-                sprintf(res, "%d", pid);
-            } else if (pre == NULL) {    //if chars after $$, use PID and post
-                sprintf(res, "%d%s", pid, post);
-            } else if (post == NULL) {    //if chars before $$, use pre and PID
-                sprintf(res, "%s%d", pre, pid);
-            } else {    //otherwise use all three for resulting string
-                sprintf(res, "%s%d%s", pre, pid, post);
-            }
-            curCommand->args[i++] = res;    //add resulting string to argument array
-        } else {    //if argument isn't redirection, filename, comment, or background process
-            curCommand->args[i++] = token;    //save command in argument array
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && offset >= 0 && info.st_size > offset) {
+        in->data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);    //map the whole file
+        if (in->data != MAP_FAILED) {
+            madvise(in->data, info.st_size, MADV_SEQUENTIAL);    //it will be read front to back
+            in->mapped = TRUE;
+            in->length = info.st_size;
+            in->position = offset;
+            return;
         }
-
-        token = strtok(NULL, delimiter);    //get the next token
     }
+
+    in->capacity = INPUT_BLOCK;    //fall back to reading in blocks
+    in->data = malloc(in->capacity);
+    assert(in->data != NULL);    //make sure buffer exists
 }
 
 
 /***********************************************************
- * exitShell: kills all processes runningand exits shell
+ * closeInput: releases the buffer or mapping of a batch
+ * input. the file descriptor is left to the caller.
  *
- * parameters: none.
+ * parameters: input struct.
  * returns: none.
  ***********************************************************/
 
-void exitShell() {
-    int i;
-    for (i = 0; i < MAX_PROCS; i++) {    //loop through background PIDs
-        if (backProcs[i] != NULL) {    //if any aren't null
-            kill(backProcs[i]->backPID, SIGKILL);    //kill the process
-            free(backProcs[i]);    //free the memory
-            backProcs[i] = NULL;   //and make it null
-        }
+void closeInput(struct input *in) {
+    if (in->mapped == TRUE) {
+        munmap(in->data, in->length);
+    } else {
+        free(in->data);
     }
-    exit(EXIT_SUCCESS);    //then exit the shell
+    in->data = NULL;
 }
 
 
 /***********************************************************
- * changeDir: changes current directory.
+ * readLine: gets the next command line. interactive input
+ * goes through the line editor. batch lines point straight
+ * into the input buffer. the newline is left off either way.
  *
- * parameters: directory path.
- * returns: none.
+ * parameters: input struct, place to store line length.
+ * returns: command line, or NULL at end of input.
  ***********************************************************/
 
-void changeDir(char *path) {
-    int dir;    //check if successful
+char *readLine(struct input *in, size_t *length) {
+    if (in->interactive == TRUE) {    //if a person is typing
+        traceFlush();    //the trace is written while the shell would be waiting anyway
+        return editLine(in, length);
+    }
 
-    if (path == NULL) {    //if path is null, command was just cd
-        dir = chdir(getenv("HOME"));    //cd goes to home directory
+    while (1) {    //until a whole line is available
+        char *start = in->data + in->position;    //start of unread input
+        size_t left = in->length - in->position;    //bytes of unread input
+        char *newline = memchr(start, '\n', left);    //look for the end of the line
 
-        if (dir == -1) {     //make sure chdir was successful
-            perror("Error:");    //if not, print error
-            return;
+        if (newline != NULL) {    //if there's a whole line, hand it back
+            in->position += newline + 1 - start;
+            *length = newline - start;
+            return start;
         }
-    } else {    //if path wasn't null
-        dir = chdir(path);    //change directory to path indicated
-
-        if (dir == -1) {    //make sure chdir was successful
-            perror("Error:");    //if not, print error
-            return;
+        if (in->mapped == TRUE || in->eof == TRUE) {    //if no more is coming
+            if (left == 0) {    //nothing left at all
+                return NULL;
+            }
+            in->position = in->length;    //last line has no newline
+            *length = left;
+            return start;
         }
+        fillInput(in);    //otherwise read more
     }
 }
 
 
 /***********************************************************
- * printStatus: prints exit status of most recent process.
+ * fillInput: reads another block of batch input, keeping any
+ * partial line and growing the buffer if that line fills it.
  *
- * parameters: none.
+ * parameters: input struct.
  * returns: none.
  ***********************************************************/
 
-void printStatus() {
-    fprintf(stdout, "exit value %d\n", exitStatus);    //print exit status from most recently terminated process
-    fflush(stdout);    //flush output
+void fillInput(struct input *in) {
+    size_t left = in->length - in->position;    //partial line still unread
+
+    memmove(in->data, in->data + in->position, left);    //move partial line to the front
+    in->length = left;
+    in->position = 0;
+
+    if (in->length == in->capacity) {    //if a single line fills the buffer, grow it
+        in->capacity *= 2;
+        in->data = realloc(in->data, in->capacity);
+        assert(in->data != NULL);    //make sure buffer exists
+    }
+
+    traceFlush();    //the read may block, write the trace first
+    while (1) {
+        ssize_t count = read(in->fd, in->data + in->length, in->capacity - in->length);
+        if (count > 0) {    //got more input
+            in->length += count;
+            return;
+        }
+        if (count == -1 && errno == EINTR) {    //interrupted by a signal, try again
+            continue;
+        }
+        if (count == -1) {    //if the read failed, print error
+            perror("Error");
+        }
+        in->eof = TRUE;    //no more input
+        return;
+    }
 }
 
 
 /***********************************************************
- * runCommand: creates child processes to run commands.
+ * editLine: prints the prompt and reads a line from the
+ * terminal a key at a time, with the terminal in raw mode
+ * only while the line is being typed. supports moving and
+ * deleting within the line, up and down through history,
+ * and ^R reverse search. ^C throws the line away and ^Z
+ * toggles foreground-only mode as it would at a prompt.
+ * finished lines go into the history.
  *
- * parameters: command struct.
- * returns: exit status int.
+ * parameters: input struct, place to store line length.
+ * returns: command line, or NULL at end of input.
  ***********************************************************/
 
-int runCommand(struct command *curCommand) {
-    int stdOut = dup(STDOUT_FILENO);    //saves a copy of the stdout file descriptor
-    int stdIn = dup(STDIN_FILENO);    //saves a copy of the stdin file descriptor
-
-    if (stdOut == -1 || stdIn == -1) {    //make sure the dup function worked
-        perror("Error");    //if not, print error
-        exit(EXIT_FAILURE);
-    }
-
-    pid_t spawnpid = fork();    //fork the process
+char *editLine(struct input *in, size_t *length) {
+    char *buffer = in->data;    //line being edited
+    size_t used = 0;    //bytes in the line
+    size_t cursor = 0;    //position of the cursor in the line
+    char *line = NULL;    //line handed back
 
-    if (spawnpid == CHILD) {    //if in the child process
-        int inputFD = -1;    //set input and output file descriptors
-        int outputFD = -1;
+    fprintf(stdout, ": ");    //print command prompt
+    fflush(stdout);    //flush output
 
-        if (curCommand->background == TRUE) {    //if process is in the background
-            if (curCommand->outputFile == NULL) {    //if there is no output redirection
-                outputFD = open("/dev/null", O_WRONLY);    //write output to null device
-                if (outputFD == -1) {    //if it can't open
-                    printf("error: cannot complete command\n");    //print error message
-                    exit(1);    //exit with status 1
-                }
-                dup2(outputFD, STDOUT_FILENO);    //copy file descriptor to stdout
-                close(outputFD);    //close output file descriptor
-            }
-            if (curCommand->inputFile == NULL) {    //if there is no input redirection
-                inputFD = open("/dev/null", O_RDONLY);    //read input to null device
-                if (inputFD == -1) {    //if it can't open
-                    printf("error: cannot complete command\n");    //print error message
-                    exit(1);    //exit with status 1
-                }
-                dup2(inputFD, STDIN_FILENO);    //copy file descriptor to stdin
-                close(inputFD);    //close input file descriptor
-            }
-        } else {    //if process is in the foreground
-            if (curCommand->outputFile != NULL) { //if there's output redirection
-                //open an existing file,truncate it, or create a new one to serve as a temporary stdout
-                outputFD = open(curCommand->outputFile, O_WRONLY | O_TRUNC | O_CREAT, 0777);
-                if (outputFD == -1) {    //if it can't open
-                    printf("cannot open %s for output\n", curCommand->outputFile);    //print error message
-                    exit(1);    //exit with status 1
-                }
-                dup2(outputFD, STDOUT_FILENO);    //copy file descriptor to stdout
-                close(outputFD);    //close output file descriptor
-            }
-            if (curCommand->inputFile != NULL) {    //if there's input redirection
-                inputFD = open(curCommand->inputFile, O_RDONLY, 0777);    //open an existing file to serve as a temporary stdin stream
-                if (inputFD == -1) {    //if it can't open
-                    printf("cannot open %s for input\n", curCommand->inputFile);    //print error message
-                    exit(1);    //exit status 1
-                }
-                dup2(inputFD, STDIN_FILENO);    //copy file descriptor to stdin
-                close(inputFD);    //exit with status 1
-            }
+    if (tcgetattr(STDIN_FILENO, &editor.cooked) == -1) {    //not a terminal after all, read it plainly
+        ssize_t count = getline(&in->data, &in->capacity, stdin);    //grows the buffer to fit the line
+        if (count == -1) {
+            return NULL;
         }
-        execvp(curCommand->args[0], curCommand->args);    //execute the command
-
-        printf("%s: no such file or directory\n", curCommand->args[0]);    //print error message if not a file
-        exit(1);    //exit with status 1
-
-    } else if (spawnpid > CHILD) {    //if in the parent process
-        pid_t exitpid;
+        if (count > 0 && in->data[count - 1] == '\n') {
+            count--;
+        }
+        *length = count;
+        return in->data;
+    }
+    struct termios raw = editor.cooked;    //settings for reading keys one at a time
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+    editor.browse = history.next;
 
-        if (curCommand->background == TRUE) {    //if child is a background process
-            saveProcess(spawnpid);    //save the child's PID to array of background PIDs
-            fprintf(stdout, "background pid is %d\n", spawnpid);    //print that the process has begun executing and PID
-            fflush(stdout);   //flush output
-        } else {    //if child is a foreground process
-            forePID = spawnpid;    //save the child's PID
-            exitpid = waitpid(spawnpid, &exitStatus, 0);    //wait for child to end before the parent resumes
+    while (line == NULL) {
+        int key = readKey();
+        if (key == 18) {    //^R searches, and Enter there runs what it found
+            key = reverseSearch(buffer, &used, &cursor);
         }
 
-        if (curCommand->inputFile != NULL) {
-            dup2(stdIn, STDIN_FILENO);    //reset stdin to default
+        if (key == -1 || (key == 4 && used == 0)) {    //end of input, or ^D on an empty line
+            write(STDOUT_FILENO, "\r\n", 2);
+            break;
+        } else if (key == '\r' || key == '\n') {    //line is done
+            write(STDOUT_FILENO, "\r\n", 2);
+            buffer[used] = '\0';
+            line = buffer;
+        } else if (key == 3) {    //^C throws the line away
+            write(STDOUT_FILENO, "^C\r\n", 4);
+            used = 0;
+            cursor = 0;
+            editor.browse = history.next;
+        } else if (key == 26) {    //^Z toggles foreground-only mode
+            write(STDOUT_FILENO, "\r\n", 2);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.cooked);
+            disableBackground(SIGTSTP);
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+        } else if ((key == 127 || key == 8) && cursor > 0) {    //backspace
+            memmove(buffer + cursor - 1, buffer + cursor, used - cursor);
+            cursor--;
+            used--;
+        } else if ((key == 4 || key == 1003) && cursor < used) {    //delete
+            memmove(buffer + cursor, buffer + cursor + 1, used - cursor - 1);
+            used--;
+        } else if (key == 23) {    //^W deletes the word before the cursor
+            size_t from = cursor;
+            while (from > 0 && buffer[from - 1] == ' ') {
+                from--;
+            }
+            while (from > 0 && buffer[from - 1] != ' ') {
+                from--;
+            }
+            memmove(buffer + from, buffer + cursor, used - cursor);
+            used -= cursor - from;
+            cursor = from;
+        } else if (key == 11) {    //^K deletes to the end
+            used = cursor;
+        } else if (key == 21) {    //^U deletes to the start
+            memmove(buffer, buffer + cursor, used - cursor);
+            used -= cursor;
+            cursor = 0;
+        } else if (key == 1 || key == 'H' + 1000) {    //^A or Home
+            cursor = 0;
+        } else if (key == 5 || key == 'F' + 1000) {    //^E or End
+            cursor = used;
+        } else if ((key == 2 || key == 'D' + 1000) && cursor > 0) {    //^B or left
+            cursor--;
+        } else if ((key == 6 || key == 'C' + 1000) && cursor < used) {    //^F or right
+            cursor++;
+        } else if (key == 12) {    //^L clears the screen
+            write(STDOUT_FILENO, "\x1b[H\x1b[2J", 7);
+        } else if ((key == 16 || key == 'A' + 1000) && editor.browse > history.first) {    //^P or up, older entry
+            if (editor.browse == history.next) {    //keep what was being typed
+                if (used > editor.savedCapacity) {
+                    editor.savedCapacity = in->capacity;
+                    editor.saved = realloc(editor.saved, editor.savedCapacity);
+                    assert(editor.saved != NULL);
+                }
+                memcpy(editor.saved, buffer, used);
+                editor.savedLength = used;
+            }
+            editor.browse--;
+            char *text = historyEntry(editor.browse, &used);
+            memcpy(buffer, text, used);
+            cursor = used;
+        } else if ((key == 14 || key == 'B' + 1000) && editor.browse < history.next) {    //^N or down, newer entry
+            editor.browse++;
+            if (editor.browse == history.next) {    //back to what was being typed
+                used = editor.savedLength;
+                memcpy(buffer, editor.saved, used);
+            } else {
+                char *text = historyEntry(editor.browse, &used);
+                memcpy(buffer, text, used);
+            }
+            cursor = used;
+        } else if (key >= 32 && key < 256 && key != 127) {    //typed a character
+            if (used + 1 == in->capacity) {    //long lines grow the buffer, which is kept for later lines
+                in->capacity *= 2;
+                in->data = realloc(in->data, in->capacity);
+                assert(in->data != NULL);
+                buffer = in->data;
+            }
+            memmove(buffer + cursor + 1, buffer + cursor, used - cursor);
+            buffer[cursor++] = key;
+            used++;
         }
-        if (curCommand->outputFile != NULL) {
-            dup2(stdOut, STDOUT_FILENO);    //reset stdout to default
+        if (line == NULL && key != -1) {
+            refreshLine(": ", 2, buffer, used, cursor);
         }
-        fflush(stdout);    //flush output
-        return WEXITSTATUS(exitStatus);     //return the child's exit status
+    }
 
-    } else {    //if not in child or parent, something went wrong!
-        perror("Error");    //print error message
-        exit(EXIT_FAILURE);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &editor.cooked);    //children get the terminal as it was
+    if (line != NULL) {
+        addHistory(line, used, TRUE);
+        *length = used;
     }
+    return line;
 }
 
 
 /***********************************************************
- * interruptSignal: kills foreground process and outputs signal
- * that interrupted.
+ * reverseSearch: ^R, searches history for what's been typed
+ * so far, newest first. ^R again moves to the next older
+ * match. Enter runs the match, ^G or ^C goes back to the
+ * line as it was, and any other key keeps the match for
+ * editing.
  *
- * parameters: signal number int.
- * returns: none.
+ * parameters: line buffer, line length, cursor position.
+ * returns: key that ended the search, 0 if there's nothing
+ * more to do with it.
  ***********************************************************/
 
-void interruptSignal(int sigNum) {
-    kill(forePID, SIGKILL);    //kill process
-    fprintf(stdout, "terminated by signal %d\n", sigNum);    //print what signal terminated process
-    fflush(stdout);    //flush output
-}
-
+int reverseSearch(char *buffer, size_t *length, size_t *cursor) {
+    char query[MAX_LENGTH];    //what's being searched for
+    size_t queryLength = 0;
+    long match = -1;    //entry found, -1 if none
+    unsigned int from = history.next;    //search entries before this one
+    int failed = FALSE;    //whether the last search came up empty
 
-/***********************************************************
- * childTerminates: executes when child process terminates.
- * prints what child exit status was and frees the memory.
- *
- * parameters: signal number int.
- * returns: none.
- ***********************************************************/
+    while (1) {
+        char prompt[MAX_LENGTH + 32];    //search prompt with the query in it
+        size_t matchLength = 0;
+        char *text = match == -1 ? "" : historyEntry(match, &matchLength);
+        char *found = match == -1 ? text : memmem(text, matchLength, query, queryLength);
+        int promptLength = snprintf(prompt, sizeof(prompt), "(%sreverse-i-search)`%.*s': ",
+                                    failed == TRUE ? "failed " : "", (int)queryLength, query);
+        refreshLine(prompt, promptLength, text, matchLength, found == NULL ? 0 : found - text);
 
-void childTerminates(int sigNum) {
-    int i;
-    for (i = 0; i < MAX_PROCS; i++) {   //look through all PIDs in background array
-        if (backProcs[i] != NULL) {    //if not null
-            pid_t pid = waitpid(backProcs[i]->backPID, &exitStatus, WNOHANG);    //get the child's PID
-
-            if (pid > 0) {    //if PID is valid, then child just terminated
-                backProcs[i]->active = FALSE;    //indicate that the process is no longer running
-                kill(backProcs[i]->backPID, SIGKILL);    //kill the zombie
-                if (exitStatus != 0  && exitStatus != 1) {    //if exit status was a signal, print signal
-                    fprintf(stdout, "background pid %d is done: terminated by signal %d\n", pid, exitStatus);
-                } else {    //if exit status wasn't signal, print exit status
-                    fprintf(stdout, "background pid %d is done: exit value %d\n", pid, exitStatus);
+        int key = readKey();
+        if (key == KEY_REFRESH) {    //jobs were reported, just draw it again
+            continue;
+        }
+        if (key == 7 || key == 3) {    //^G or ^C, leave the line alone
+            refreshLine(": ", 2, buffer, *length, *cursor);
+            return 0;
+        }
+        if (key == 18 || (key >= 32 && key < 256)) {    //look again
+            if (key == 127) {    //shorter query, start over from the newest
+                if (queryLength > 0) {
+                    queryLength--;
                 }
-                fflush(stdout);    //flush output
-                free(backProcs[i]);    //free the memory
-                backProcs[i] = NULL;    //set to null for use by another
+                from = history.next;
+            } else if (key == 18) {    //older match for the same query
+                from = match == -1 ? history.next : match;
+            } else if (queryLength + 1 < sizeof(query)) {    //longer query, the current match may still do
+                query[queryLength++] = key;
+                from = match == -1 ? history.next : match + 1;
+            }
+            long next = queryLength == 0 ? -1 : searchHistory(query, queryLength, from);
+            failed = next == -1 && queryLength > 0;
+            if (next != -1 || queryLength == 0) {
+                match = next;
             }
+            continue;
+        }
+        if (match != -1) {    //any other key keeps the match
+            memcpy(buffer, text, matchLength);
+            *length = matchLength;
+            *cursor = found == NULL ? 0 : found - text;
         }
+        return key == '\r' || key == '\n' ? key : 0;
     }
-
 }
 
 
 /***********************************************************
- * disableBackground: keeps track of whether background
- * processes are enabled or not
+ * refreshLine: redraws the prompt and line, scrolling the
+ * line sideways when it's wider than the terminal so the
+ * cursor stays in view.
  *
- * parameters: signal number int.
+ * parameters: prompt, prompt length, line, line length,
+ * cursor position.
  * returns: none.
  ***********************************************************/
 
-void disableBackground(int sigNum) {
-    if (backgroundDisabled) {    //if background is disabled
-        fprintf(stdout, "Exiting foreground-only mode\n");    //let user know background is enabled
-        fflush(stdout);    //flush output
-        backgroundDisabled = FALSE;    //set background as enabled
-    } else {    //if background is enabled
-        fprintf(stdout, "Entering foreground-only mode (& is now ignored)\n");    //let user know background is disabled
-        fflush(stdout);    //flush output
-        backgroundDisabled = TRUE;    //set background as disabled
+void refreshLine(char *prompt, size_t promptLength, char *text, size_t length, size_t cursor) {
+    struct winsize window;    //terminal size
+    size_t columns = 80;    //terminal width, if it can't be found
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window) == 0 && window.ws_col > 0) {
+        columns = window.ws_col;
     }
+    size_t room = columns > promptLength + 1 ? columns - promptLength - 1 : 1;    //columns left for the line
+    size_t offset = cursor > room ? cursor - room : 0;    //first byte of the line shown
+    size_t shown = length - offset < room ? length - offset : room;
+
+    char move[32];    //puts the cursor back where it belongs
+    int moveLength = snprintf(move, sizeof(move), "\x1b[K\r\x1b[%zuC", promptLength + cursor - offset);
+    struct iovec parts[4] = {
+        { "\r", 1 },
+        { prompt, promptLength },
+        { text + offset, shown },
+        { move, moveLength }
+    };
+    writev(STDOUT_FILENO, parts, 4);
 }
 
 
 /***********************************************************
- * saveProcess: saves background process in array to keep
- * track of what has completed.
+ * readKey: reads a key from the terminal. escape sequences
+ * for the arrows, Home, End and Delete come back as one key.
+ * with set -b, background jobs that finish while it waits
+ * are reported right away.
  *
- * parameters: background process pid.
- * returns: none.
+ * parameters: none.
+ * returns: the byte read, 1000 plus the final letter of an
+ * arrow, Home or End sequence, 1003 for Delete, KEY_REFRESH
+ * after reporting jobs with set -b, or -1 at end of input.
  ***********************************************************/
 
-void saveProcess(pid_t spawnpid) {
-    int saved = FALSE;    //indicator to make sure process was saved
-    int i = 0;
+int readKey() {
+    unsigned char bytes[3];    //key, and the rest of an escape sequence
+    ssize_t count;
 
-    struct backProcess *proc = malloc(sizeof(struct backProcess));    //malloc background process struct
-    proc->backPID = spawnpid;    //set PID to process' PID
-    proc->active = TRUE;    //set process as active
-
-    while (saved == FALSE) {    //while the process still hasn't been saved
-        if (backProcs[i] == NULL) {    //if an empty spot is found
-            backProcs[i] = proc;    //save the process
-            saved = TRUE;    //indicate process has been saved
+    while (notifyNow == TRUE) {    //watch for finished jobs while waiting for the key
+        struct pollfd watched[2] = { { STDIN_FILENO, POLLIN, 0 }, { childPipe[0], POLLIN, 0 } };
+        if (poll(watched, 2, -1) == -1) {
+            if (errno == EINTR) {    //SIGCHLD, the pipe has it now
+                continue;
+            }
+            break;
+        }
+        if ((watched[1].revents & POLLIN) != 0) {
+            reapChildren();
+            if (notices.count > 0) {    //report them above the line being typed
+                write(STDOUT_FILENO, "\r\x1b[K", 4);
+                drainNotices();
+                return KEY_REFRESH;
+            }
+        }
+        if ((watched[0].revents & (POLLERR | POLLNVAL)) != 0) {    //the terminal is broken, same as end of input
+            return -1;
+        }
+        if ((watched[0].revents & (POLLIN | POLLHUP)) != 0) {
+            break;
         }
-        i++;    //iterate through array
     }
-}
\ No newline at end of file
+    while ((count = read(STDIN_FILENO, bytes, 1)) == -1 && errno == EINTR) {
+    }
+    if (count <= 0) {
+        return -1;
+    }
+    if (bytes[0] != 27) {    //not an escape sequence
+        return bytes[0];
+    }
+    if (read(STDIN_FILENO, bytes + 1, 1) != 1 || (bytes[1] != '[' && bytes[1] != 'O')
+        || read(STDIN_FILENO, bytes + 2, 1) != 1) {
+        return 0;
+    }
+    if (bytes[2] >= '0' && bytes[2] <= '9') {    //numbered key, ends with ~
+        unsigned char tilde;
+        if (read(STDIN_FILENO, &tilde, 1) != 1 || tilde != '~') {
+            return 0;
+        }
+        switch (bytes[2]) {
+            case '1': case '7': return 'H' + 1000;
+            case '4': case '8': return 'F' + 1000;
+            case '3': return 1003;
+        }
+        return 0;
+    }
+    return bytes[2] + 1000;
+}
+
+
+/***********************************************************
+ * loadHistory: opens the history file, $SMALLSH_HISTORY or
+ * ~/.smallsh_history, and loads its last lines into the
+ * ring. the file is mapped rather than read, and only its
+ * end is looked at, so a long history costs no more to load
+ * than a short one. the file stays open to append each new
+ * line to.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void loadHistory() {
+    char path[4096];    //history file path
+    char *file = getenv("SMALLSH_HISTORY");
+    struct stat info;
+
+    if (file == NULL) {    //default to the home directory
+        char *home = getenv("HOME");
+        if (home == NULL) {
+            return;
+        }
+        snprintf(path, sizeof(path), "%s/.smallsh_history", home);
+        file = path;
+    }
+    if (file[0] == '\0') {    //history file turned off
+        return;
+    }
+    history.fd = open(file, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (history.fd == -1 || fstat(history.fd, &info) == -1 || info.st_size == 0) {
+        return;
+    }
+
+    char *data = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+    if (data == MAP_FAILED) {
+        return;
+    }
+    char *end = data + info.st_size;    //end of the file
+    char *start = end;    //start of the oldest line loaded
+    if (end[-1] != '\n') {    //an interrupted write left half a line
+        write(history.fd, "\n", 1);
+    } else {
+        start--;
+    }
+    int lines = 0;
+    while (start > data && lines < HISTORY_ENTRIES && end - start < HISTORY_BYTES / 2) {    //back up over the last lines
+        char *newline = memrchr(data, '\n', start - data);
+        start = newline == NULL ? data : newline;
+        lines++;
+    }
+    if (start > data || *start == '\n') {    //start was left on a newline
+        start++;
+    }
+
+    while (start < end) {    //add them oldest first
+        char *newline = memchr(start, '\n', end - start);
+        char *next = newline == NULL ? end : newline;
+        addHistory(start, next - start, FALSE);
+        start = next + 1;
+    }
+    munmap(data, info.st_size);
+}
+
+
+/***********************************************************
+ * addHistory: adds a line to the history ring, dropping the
+ * oldest entries to make room, and to the history file.
+ * blank lines, lines of MAX_LENGTH or more, and repeats of
+ * the previous line are skipped.
+ *
+ * parameters: line, line length, whether to write it to the
+ * history file.
+ * returns: none.
+ ***********************************************************/
+
+void addHistory(char *line, size_t length, int save) {
+    size_t previous = 0;
+    char *last = history.next > history.first ? historyEntry(history.next - 1, &previous) : NULL;
+
+    if (length == 0 || length >= MAX_LENGTH || strspn(line, " \t") >= length) {
+        return;
+    }
+    if (last != NULL && previous == length && memcmp(last, line, length) == 0) {
+        return;
+    }
+
+    size_t at = history.end;    //where the text goes
+    int wraps = at + length > HISTORY_BYTES;    //entries never wrap, they start over at the front
+    if (wraps == TRUE) {
+        at = 0;
+    }
+    while (history.first < history.next) {    //drop entries whose text is about to be overwritten
+        size_t oldest = history.start[history.first % HISTORY_ENTRIES];
+        int overwritten = wraps == TRUE ? oldest >= history.end || oldest < length
+                                        : oldest >= at && oldest < at + length;
+        if (overwritten == FALSE && history.next - history.first < HISTORY_ENTRIES) {
+            break;
+        }
+        history.first++;
+    }
+
+    memcpy(history.text + at, line, length);
+    history.start[history.next % HISTORY_ENTRIES] = at;
+    history.length[history.next % HISTORY_ENTRIES] = length;
+    history.end = at + length;
+    indexHistory(history.next);
+    history.next++;
+
+    if (save == TRUE && history.fd != -1) {    //keep it for the next session
+        struct iovec parts[2] = { { line, length }, { "\n", 1 } };
+        if (writev(history.fd, parts, 2) == -1) {
+            perror("history");
+            close(history.fd);
+            history.fd = -1;
+        }
+    }
+}
+
+
+/***********************************************************
+ * historyEntry: finds the text of a history entry.
+ *
+ * parameters: entry number, place to store its length.
+ * returns: entry text, not null terminated.
+ ***********************************************************/
+
+char *historyEntry(unsigned int entry, size_t *length) {
+    *length = history.length[entry % HISTORY_ENTRIES];
+    return history.text + history.start[entry % HISTORY_ENTRIES];
+}
+
+
+/***********************************************************
+ * indexHistory: adds an entry to the reverse search index,
+ * which lists for each pair of bytes the entries containing
+ * it. pairs are hashed into HISTORY_GRAMS lists, so a list
+ * can also hold entries with other pairs. entries that have
+ * left the ring are trimmed off the front of a list as it
+ * grows.
+ *
+ * parameters: entry number.
+ * returns: none.
+ ***********************************************************/
+
+void indexHistory(unsigned int entry) {
+    size_t i;
+    size_t length;
+    unsigned char *text = (unsigned char *)historyEntry(entry, &length);
+
+    for (i = 0; i + 1 < length; i++) {
+        struct gramList *list = &history.grams[(text[i] * 67 + text[i + 1]) & (HISTORY_GRAMS - 1)];
+        if (list->count > list->skip && list->entries[list->count - 1] == entry) {    //already listed
+            continue;
+        }
+        while (list->skip < list->count && list->entries[list->skip] < history.first) {
+            list->skip++;
+        }
+        if (list->skip > 0 && list->skip >= list->count / 2) {    //mostly gone, close the gap
+            memmove(list->entries, list->entries + list->skip, (list->count - list->skip) * sizeof(unsigned int));
+            list->count -= list->skip;
+            list->skip = 0;
+        }
+        if (list->count == list->capacity) {
+            list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+            list->entries = realloc(list->entries, list->capacity * sizeof(unsigned int));
+            assert(list->entries != NULL);
+        }
+        list->entries[list->count++] = entry;
+    }
+}
+
+
+/***********************************************************
+ * searchHistory: finds the newest history entry before the
+ * one given that contains a string. the index list of the
+ * string's least common pair of bytes gives the entries
+ * worth checking, so a search doesn't look at every entry.
+ *
+ * parameters: string, string length, entry to search before.
+ * returns: entry number, or -1 if nothing matched.
+ ***********************************************************/
+
+long searchHistory(char *query, size_t length, unsigned int before) {
+    size_t i;
+    size_t entryLength;
+    unsigned char *bytes = (unsigned char *)query;
+
+    if (length < 2) {    //a single byte has no pair, check every entry
+        while (before > history.first) {
+            before--;
+            char *text = historyEntry(before, &entryLength);
+            if (memchr(text, query[0], entryLength) != NULL) {
+                return before;
+            }
+        }
+        return -1;
+    }
+
+    struct gramList *rarest = NULL;    //shortest list among the string's pairs
+    for (i = 0; i + 1 < length; i++) {
+        struct gramList *list = &history.grams[(bytes[i] * 67 + bytes[i + 1]) & (HISTORY_GRAMS - 1)];
+        if (rarest == NULL || list->count - list->skip < rarest->count - rarest->skip) {
+            rarest = list;
+        }
+    }
+
+    unsigned int low = rarest->skip;    //binary search for the first entry at or after before
+    unsigned int high = rarest->count;
+    while (low < high) {
+        unsigned int middle = low + (high - low) / 2;
+        if (rarest->entries[middle] < before) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    while (low > rarest->skip) {    //then check candidates newest first
+        unsigned int entry = rarest->entries[--low];
+        if (entry < history.first) {    //the rest have left the ring
+            break;
+        }
+        char *text = historyEntry(entry, &entryLength);
+        if (memmem(text, entryLength, query, length) != NULL) {
+            return entry;
+        }
+    }
+    return -1;
+}
+
+
+/***********************************************************
+ * historyBuiltin: prints the command history, or its last
+ * N entries.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int historyBuiltin(struct command *curCommand, int outputFD) {
+    unsigned int entry = history.first;    //first entry printed
+
+    if (curCommand->argCount > 1) {
+        char *end;
+        long count = strtol(curCommand->args[1], &end, 10);
+        if (*end != '\0' || count < 0) {
+            dprintf(errorFD, "history: %s: numeric argument required\n", curCommand->args[1]);
+            return 2;
+        }
+        if (count < history.next - history.first) {
+            entry = history.next - count;
+        }
+    }
+    for (; entry < history.next; entry++) {
+        size_t length;
+        char *text = historyEntry(entry, &length);
+        dprintf(outputFD, "%5u  %.*s\n", entry + 1, (int)length, text);
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * runShell: runs the shell and acts as manager of shell
+ * operations.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void runShell() {
+    while (1) {    //run always until exited manually through user command
+        reapChildren();    //collect finished background processes
+        drainNotices();    //and report them before the prompt
+
+        size_t length;    //length of the command line
+        unsigned long long phaseStart = profileStart();
+        char *line = readLine(&shellInput, &length);    //get user command
+        profileEnd(PHASE_READ, phaseStart);
+
+        if (line == NULL) {    //if input has ended, leave with the last status, as sh does
+            exitShell(exitStatus);
+        }
+
+        if (isCompound(line, length) == TRUE) {    //for, while, if, or several commands
+            runCompound(line, length);
+        } else {
+            runLine(line, length);
+        }
+    }
+}
+
+
+/***********************************************************
+ * runLine: parses one command line and runs it.
+ *
+ * parameters: command line, line length.
+ * returns: none.
+ ***********************************************************/
+
+void runLine(char *line, size_t length) {
+    arenaReset(&lineArena);    //reuse the arena for this line
+    unsigned long long phaseStart = profileStart();
+    struct command *curCommand = parseLine(line, length);    //get information from command
+    profileEnd(PHASE_PARSE, phaseStart);
+    runParsedLine(curCommand);
+}
+
+
+/***********************************************************
+ * runLeaf: runs a plain command of a compound command. its
+ * words were split off when the tree was parsed, so each run
+ * only expands them, even when they use variables and can't
+ * come from the line cache.
+ *
+ * parameters: command node.
+ * returns: none.
+ ***********************************************************/
+
+void runLeaf(struct node *node) {
+    arenaReset(&lineArena);
+    unsigned long long phaseStart = profileStart();
+    struct command *curCommand = newCommand();
+    getCommand(node->text, node->length, node->tokens, node->tokenCount, curCommand);
+    if (backgroundDisabled == TRUE) {    //& is ignored in foreground-only mode
+        curCommand->background = FALSE;
+    }
+    profileEnd(PHASE_PARSE, phaseStart);
+    runParsedLine(curCommand);
+}
+
+
+/***********************************************************
+ * runParsedLine: runs a parsed command line, keeping track
+ * of its status and what it used.
+ *
+ * parameters: command struct.
+ * returns: none.
+ ***********************************************************/
+
+void runParsedLine(struct command *curCommand) {
+    profile.lines++;
+
+    if (curCommand->next == NULL && curCommand->args[0] == NULL) {    //if command was empty, there's nothing to do
+        return;
+    }
+
+    int result;    //exit value of the line
+    struct timespec started;    //when the line started
+    struct rusage shellBefore;    //shell's own resource use before a timed line
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    if (curCommand->timed == TRUE) {
+        getrusage(RUSAGE_SELF, &shellBefore);
+    }
+    memset(&waitedUsage, 0, sizeof(waitedUsage));    //nothing waited for yet
+    unsigned long savedBefore = trace.saved;    //to tell if the line left a job running
+
+    if (curCommand->args[0] != NULL && strcmp(curCommand->args[0], "place") == 0
+            && startPlacement(curCommand) == FALSE) {    //bad placement, a pipeline may start with no command
+        result = 2;
+    } else if (curCommand->next != NULL) {    //if there's a pipeline, run all stages together
+        result = runPipeline(curCommand);
+    } else if (isAssignment(curCommand) == TRUE) {    //NAME=value sets shell variables
+        int i;
+        for (i = 0; i < curCommand->argCount; i++) {
+            char *equals = strchr(curCommand->args[i], '=');
+            *equals = '\0';
+            setVariable(curCommand->args[i], equals + 1);
+        }
+        result = 0;
+    } else if (curCommand->args[0][0] == '@' && curCommand->args[0][1] != '\0') {    //@host runs it over there
+        result = runRemote(curCommand);
+    } else {
+        struct builtin *builtin = findBuiltin(curCommand->args[0]);    //check for a built-in command
+        if (builtin != NULL && (builtin->standalone == FALSE || curCommand->background == FALSE)) {
+            result = runBuiltin(builtin, curCommand);    //run it inside the shell
+        } else {    //deal with any commands not built-in
+            result = runCommand(curCommand);    //run the user command
+        }
+    }
+    if (placement.active == TRUE) {
+        endPlacement();
+    }
+
+    waitedUsage.wall = elapsedSince(&started);
+    waitedUsage.valid = TRUE;
+    if (waitedUsage.pid == 0 && curCommand->timed == TRUE) {    //the shell did the work, charge the shell
+        struct rusage shellAfter;
+        getrusage(RUSAGE_SELF, &shellAfter);
+        timersub(&shellAfter.ru_utime, &shellBefore.ru_utime, &waitedUsage.usage.ru_utime);
+        timersub(&shellAfter.ru_stime, &shellBefore.ru_stime, &waitedUsage.usage.ru_stime);
+        waitedUsage.usage.ru_maxrss = shellAfter.ru_maxrss;
+        waitedUsage.usage.ru_minflt = shellAfter.ru_minflt - shellBefore.ru_minflt;
+        waitedUsage.usage.ru_majflt = shellAfter.ru_majflt - shellBefore.ru_majflt;
+    }
+    if (trace.enabled == TRUE && trace.saved == savedBefore) {    //background jobs are traced when they're done
+        traceEntry(traceCommand(curCommand), waitedUsage.pid, curCommand->background,
+                   result != KEEP_STATUS ? result : exitStatus,
+                   WIFSIGNALED(waitedUsage.status) ? WTERMSIG(waitedUsage.status) : 0, &waitedUsage);
+    }
+    if (result != KEEP_STATUS) {    //status builtin doesn't change the status
+        exitStatus = result;    //although exitStatus is global, log status here so forced exits [exit(1)] can be utilized and saved
+        exitSignal = WIFSIGNALED(waitedUsage.status) ? WTERMSIG(waitedUsage.status) : 0;
+        if (curCommand->background == FALSE) {
+            foreUsage = waitedUsage;
+        }
+    }
+    if (curCommand->timed == TRUE && curCommand->background == FALSE) {    //time prefix, report what it used
+        fflush(stdout);
+        printUsage(STDERR_FILENO, &waitedUsage);
+    }
+}
+
+
+/***********************************************************
+ * isCompound: checks if a line needs the compound parser,
+ * because it starts with a keyword or has a ; in it. a ;
+ * inside a $(...) or a comment doesn't count. anything else
+ * goes straight to runLine.
+ *
+ * parameters: command line, line length.
+ * returns: TRUE or FALSE.
+ ***********************************************************/
+
+int isCompound(char *line, size_t length) {
+    char *pos = line;
+    char *end = line + length;
+
+    while (pos < end) {    //look for a ; that separates commands
+        char *close = NULL;
+        if (*pos == ';') {
+            return TRUE;
+        }
+        if (*pos == '#' && (pos == line || pos[-1] == ' ' || pos[-1] == '\t')) {    //the rest is a comment
+            break;
+        }
+        if (*pos == '$' && pos + 1 < end && pos[1] == '(') {
+            close = substitutionEnd(pos, end);
+        }
+        pos = close != NULL ? close : pos + 1;
+    }
+    pos = line;
+    while (pos < end && (*pos == ' ' || *pos == '\t')) {    //find the first word
+        pos++;
+    }
+    char *word = pos;
+    while (pos < end && *pos != ' ' && *pos != '\t' && *pos != '\n') {
+        pos++;
+    }
+    return keywordOf(word, pos - word) != KEY_NONE;
+}
+
+
+/***********************************************************
+ * runCompound: reads lines until every for, while and if is
+ * closed, parses the whole thing into a tree once, then runs
+ * the tree. the commands in it are split into words along
+ * with the tree, so running one again only expands them.
+ *
+ * parameters: first line, line length.
+ * returns: none.
+ ***********************************************************/
+
+void runCompound(char *line, size_t length) {
+    size_t capacity = length + MAX_LENGTH;    //size of the text buffer
+    size_t used = length;    //bytes of text so far
+    char *text = malloc(capacity);    //the compound command's lines joined together
+    assert(text != NULL);
+    memcpy(text, line, length);
+    int depth = compoundDepth(text, length);    //number of unclosed for, while and if
+
+    while (depth > 0) {    //keep reading until everything is closed
+        size_t moreLength;
+        char *more = readLine(&shellInput, &moreLength);
+        if (more == NULL) {    //input ended in the middle
+            printf("syntax error: unexpected end of input\n");
+            fflush(stdout);
+            free(text);
+            exitShell(2);
+        }
+        if (used + moreLength + 1 > capacity) {    //make room, with a newline between lines
+            capacity = (used + moreLength + 1) * 2;
+            text = realloc(text, capacity);
+            assert(text != NULL);
+        }
+        text[used++] = '\n';
+        memcpy(text + used, more, moreLength);
+        depth += compoundDepth(text + used, moreLength);
+        used += moreLength;
+    }
+
+    struct scanner scan = { text, text + used, FALSE };
+    enum keyword stopped;
+    arenaReset(&treeArena);
+    struct node *tree = parseList(&scan, 0, &stopped);    //parse everything once
+    if (scan.failed == FALSE && stopped != KEY_END) {    //a keyword with nothing open
+        syntaxError(&scan, "unexpected keyword");
+    }
+    if (scan.failed == TRUE) {
+        exitStatus = 2;
+    } else {
+        interrupted = FALSE;    //SIGINT from here on stops the loops
+        runNodes(tree);
+    }
+    free(text);
+}
+
+
+/***********************************************************
+ * compoundDepth: counts how many for, while and if a piece of
+ * text opens, less how many it closes.
+ *
+ * parameters: text, text length.
+ * returns: change in depth.
+ ***********************************************************/
+
+int compoundDepth(char *text, size_t length) {
+    struct scanner scan = { text, text + length, FALSE };
+    int depth = 0;
+    char *wordEnd;
+    char *start;
+    size_t pieceLength;
+
+    while (1) {
+        enum keyword key = peekKeyword(&scan, &wordEnd);
+        if (key == KEY_END) {
+            return depth;
+        }
+        if (key == KEY_NONE || key == KEY_FOR) {    //take the whole command, a for's words aren't keywords
+            depth += key == KEY_FOR;
+            takePiece(&scan, &start, &pieceLength);
+            continue;
+        }
+        if (key == KEY_WHILE || key == KEY_IF) {
+            depth++;
+        } else if (key == KEY_DONE || key == KEY_FI) {
+            depth--;
+        }
+        scan.pos = wordEnd;    //the rest is another command
+    }
+}
+
+
+/***********************************************************
+ * peekKeyword: skips separators and comments and looks at the
+ * first word of the next command without taking it.
+ *
+ * parameters: scanner, where to store the end of the word.
+ * returns: keyword, KEY_NONE for a plain command, or KEY_END.
+ ***********************************************************/
+
+enum keyword peekKeyword(struct scanner *scan, char **wordEnd) {
+    while (scan->pos < scan->end) {    //skip spaces, newlines, semicolons and comments
+        char c = *scan->pos;
+        if (c == '#') {
+            while (scan->pos < scan->end && *scan->pos != '\n') {
+                scan->pos++;
+            }
+        } else if (c == ' ' || c == '\t' || c == '\n' || c == ';') {
+            scan->pos++;
+        } else {
+            break;
+        }
+    }
+    if (scan->pos == scan->end) {
+        return KEY_END;
+    }
+
+    char *pos = scan->pos;
+    while (pos < scan->end && *pos != ' ' && *pos != '\t' && *pos != '\n' && *pos != ';') {
+        pos++;
+    }
+    *wordEnd = pos;
+    return keywordOf(scan->pos, pos - scan->pos);
+}
+
+
+/***********************************************************
+ * keywordOf: recognizes a keyword, deciding on the length and
+ * first byte before comparing.
+ *
+ * parameters: word, word length.
+ * returns: keyword, or KEY_NONE.
+ ***********************************************************/
+
+enum keyword keywordOf(const char *word, size_t length) {
+    switch (length) {
+        case 2:
+            if (word[0] == 'i' && word[1] == 'f') return KEY_IF;
+            if (word[0] == 'f' && word[1] == 'i') return KEY_FI;
+            if (word[0] == 'd' && word[1] == 'o') return KEY_DO;
+            break;
+        case 3:
+            if (memcmp(word, "for", 3) == 0) return KEY_FOR;
+            break;
+        case 4:
+            if (word[0] == 't' && memcmp(word, "then", 4) == 0) return KEY_THEN;
+            if (word[0] == 'e' && memcmp(word, "elif", 4) == 0) return KEY_ELIF;
+            if (word[0] == 'e' && memcmp(word, "else", 4) == 0) return KEY_ELSE;
+            if (word[0] == 'd' && memcmp(word, "done", 4) == 0) return KEY_DONE;
+            break;
+        case 5:
+            if (memcmp(word, "while", 5) == 0) return KEY_WHILE;
+            break;
+    }
+    return KEY_NONE;
+}
+
+
+/***********************************************************
+ * takePiece: takes the rest of the current command, up to a
+ * newline, a semicolon, or a comment. a $(...) is taken
+ * whole, whatever is inside it.
+ *
+ * parameters: scanner, where to store the start and length.
+ * returns: none.
+ ***********************************************************/
+
+void takePiece(struct scanner *scan, char **start, size_t *length) {
+    char *pos = scan->pos;
+
+    *start = pos;
+    while (pos < scan->end && *pos != '\n' && *pos != ';'
+           && !(*pos == '#' && (pos == *start || pos[-1] == ' ' || pos[-1] == '\t'))) {
+        char *close = NULL;
+        if (*pos == '$' && pos + 1 < scan->end && pos[1] == '(') {
+            close = substitutionEnd(pos, scan->end);
+        }
+        pos = close != NULL ? close : pos + 1;
+    }
+    *length = pos - *start;
+    scan->pos = pos;
+}
+
+
+/***********************************************************
+ * parseList: parses commands until one starts with a keyword
+ * in stops, which is left for the caller.
+ *
+ * parameters: scanner, bit mask of stopping keywords, where to
+ * store the keyword that stopped it.
+ * returns: first node of the list, or NULL if empty.
+ ***********************************************************/
+
+struct node *parseList(struct scanner *scan, int stops, enum keyword *stopped) {
+    struct node *head = NULL;    //first node in the list
+    struct node **tail = &head;    //where the next node goes
+    char *wordEnd;
+
+    while (scan->failed == FALSE) {
+        enum keyword key = peekKeyword(scan, &wordEnd);
+        struct node *node = NULL;
+
+        if (key == KEY_END || (stops & (1 << key)) != 0) {
+            *stopped = key;
+            return head;
+        }
+        if (key == KEY_FOR) {
+            node = parseFor(scan);
+        } else if (key == KEY_WHILE) {
+            node = parseWhile(scan);
+        } else if (key == KEY_IF) {
+            node = parseIf(scan);
+        } else if (key == KEY_NONE) {    //a plain command
+            node = newNode(NODE_COMMAND);
+            takePiece(scan, &node->text, &node->length);
+            node->tokens = splitTokens(node->text, node->length, &node->tokenCount);
+        } else {    //a keyword that doesn't belong here
+            syntaxError(scan, "unexpected keyword");
+        }
+        if (node != NULL) {
+            *tail = node;
+            tail = &node->next;
+        }
+    }
+    *stopped = KEY_END;
+    return head;
+}
+
+
+/***********************************************************
+ * parseFor: parses for name in words; do body; done.
+ *
+ * parameters: scanner at the for.
+ * returns: for node, or NULL after a syntax error.
+ ***********************************************************/
+
+struct node *parseFor(struct scanner *scan) {
+    struct node *node = newNode(NODE_FOR);
+    char *start;
+    size_t length;
+    enum keyword stopped;
+
+    scan->pos += 3;    //skip the for
+    takePiece(scan, &start, &length);
+    char *end = start + length;
+    while (start < end && (*start == ' ' || *start == '\t')) {    //find the name
+        start++;
+    }
+    char *name = start;
+    while (start < end && (*start == '_' || (*start >= 'a' && *start <= 'z') || (*start >= 'A' && *start <= 'Z')
+                           || (start > name && *start >= '0' && *start <= '9'))) {
+        start++;
+    }
+    if (start == name || (start < end && *start != ' ' && *start != '\t')) {
+        scan->pos = name;    //point the error at the name
+        syntaxError(scan, "bad for loop variable");
+        return NULL;
+    }
+    node->name = arenaAlloc(&treeArena, start - name + 1);
+    memcpy(node->name, name, start - name);
+    node->name[start - name] = '\0';
+
+    while (start < end && (*start == ' ' || *start == '\t')) {    //then in
+        start++;
+    }
+    if (end - start < 2 || start[0] != 'i' || start[1] != 'n' || (end - start > 2 && start[2] != ' ' && start[2] != '\t')) {
+        scan->pos = start;
+        syntaxError(scan, "for loop needs in");
+        return NULL;
+    }
+    node->text = start + 2;    //the words, expanded each time the loop starts
+    node->length = end - node->text;
+
+    if (expectKeyword(scan, KEY_DO, "do") == FALSE) {
+        return NULL;
+    }
+    node->body = parseList(scan, 1 << KEY_DONE, &stopped);
+    if (expectKeyword(scan, KEY_DONE, "done") == FALSE) {
+        return NULL;
+    }
+    return node;
+}
+
+
+/***********************************************************
+ * parseWhile: parses while condition; do body; done.
+ *
+ * parameters: scanner at the while.
+ * returns: while node, or NULL after a syntax error.
+ ***********************************************************/
+
+struct node *parseWhile(struct scanner *scan) {
+    struct node *node = newNode(NODE_WHILE);
+    enum keyword stopped;
+
+    scan->pos += 5;    //skip the while
+    node->condition = parseList(scan, 1 << KEY_DO, &stopped);
+    if (node->condition == NULL && scan->failed == FALSE) {
+        syntaxError(scan, "while needs a condition");
+    }
+    if (expectKeyword(scan, KEY_DO, "do") == FALSE) {
+        return NULL;
+    }
+    node->body = parseList(scan, 1 << KEY_DONE, &stopped);
+    if (expectKeyword(scan, KEY_DONE, "done") == FALSE) {
+        return NULL;
+    }
+    return node;
+}
+
+
+/***********************************************************
+ * parseIf: parses if condition; then body; [elif ...;]
+ * [else body;] fi. an elif is parsed as an if of its own in
+ * the else branch, and it takes the fi.
+ *
+ * parameters: scanner at the if or elif.
+ * returns: if node, or NULL after a syntax error.
+ ***********************************************************/
+
+struct node *parseIf(struct scanner *scan) {
+    struct node *node = newNode(NODE_IF);
+    enum keyword stopped;
+    char *wordEnd;
+
+    peekKeyword(scan, &wordEnd);
+    scan->pos = wordEnd;    //skip the if or elif
+    node->condition = parseList(scan, 1 << KEY_THEN, &stopped);
+    if (node->condition == NULL && scan->failed == FALSE) {
+        syntaxError(scan, "if needs a condition");
+    }
+    if (expectKeyword(scan, KEY_THEN, "then") == FALSE) {
+        return NULL;
+    }
+    node->body = parseList(scan, (1 << KEY_ELIF) | (1 << KEY_ELSE) | (1 << KEY_FI), &stopped);
+    if (scan->failed == TRUE) {
+        return NULL;
+    }
+    if (stopped == KEY_ELIF) {    //the elif closes everything with its fi
+        node->orElse = parseIf(scan);
+        return node;
+    }
+    if (stopped == KEY_ELSE) {
+        expectKeyword(scan, KEY_ELSE, "else");
+        node->orElse = parseList(scan, 1 << KEY_FI, &stopped);
+    }
+    if (expectKeyword(scan, KEY_FI, "fi") == FALSE) {
+        return NULL;
+    }
+    return node;
+}
+
+
+/***********************************************************
+ * expectKeyword: consumes a keyword that has to come next,
+ * reporting a syntax error if it doesn't.
+ *
+ * parameters: scanner, keyword, its spelling for the error.
+ * returns: TRUE if it was there, FALSE otherwise.
+ ***********************************************************/
+
+int expectKeyword(struct scanner *scan, enum keyword wanted, char *word) {
+    char *wordEnd;
+
+    if (scan->failed == TRUE) {
+        return FALSE;
+    }
+    if (peekKeyword(scan, &wordEnd) != wanted) {
+        printf("syntax error: expected %s\n", word);
+        fflush(stdout);
+        scan->failed = TRUE;
+        return FALSE;
+    }
+    scan->pos = wordEnd;    //anything after it on the line is the next command
+    return TRUE;
+}
+
+
+/***********************************************************
+ * newNode: allocates an empty tree node in the tree arena.
+ *
+ * parameters: kind of node.
+ * returns: node.
+ ***********************************************************/
+
+struct node *newNode(enum nodeKind kind) {
+    struct node *node = arenaAlloc(&treeArena, sizeof(struct node));
+    memset(node, 0, sizeof(struct node));
+    node->kind = kind;
+    return node;
+}
+
+
+/***********************************************************
+ * syntaxError: reports a syntax error at the scanner, once.
+ *
+ * parameters: scanner, message.
+ * returns: none.
+ ***********************************************************/
+
+void syntaxError(struct scanner *scan, char *message) {
+    if (scan->failed == TRUE) {
+        return;
+    }
+    char *end = scan->pos;
+    while (end < scan->end && *end != '\n' && *end != ';') {
+        end++;
+    }
+    printf("syntax error: %s near '%.*s'\n", message, (int)(end - scan->pos), scan->pos);
+    fflush(stdout);
+    scan->failed = TRUE;
+}
+
+
+/***********************************************************
+ * runNodes: runs a list of tree nodes. a condition succeeds
+ * when its last command's exit value is 0. SIGINT stops
+ * everything that's left.
+ *
+ * parameters: first node.
+ * returns: none.
+ ***********************************************************/
+
+void runNodes(struct node *list) {
+    struct node *node;
+    int i;
+
+    for (node = list; node != NULL && interrupted == FALSE; node = node->next) {
+        switch (node->kind) {
+            case NODE_COMMAND:
+                reapChildren();    //keep up with background jobs between commands
+                drainNotices();
+                runLeaf(node);
+                break;
+
+            case NODE_FOR: {
+                int count;
+                char **words = expandWords(node->text, node->length, &count);
+                exitStatus = 0;
+                for (i = 0; i < count && interrupted == FALSE; i++) {
+                    setVariable(node->name, words[i]);
+                    runNodes(node->body);
+                }
+                for (i = 0; i < count; i++) {
+                    free(words[i]);
+                }
+                free(words);
+                break;
+            }
+
+            case NODE_WHILE: {
+                int bodyStatus = 0;    //status of the last time through the body
+                while (interrupted == FALSE) {
+                    runNodes(node->condition);
+                    if (exitStatus != 0) {
+                        break;
+                    }
+                    runNodes(node->body);
+                    bodyStatus = exitStatus;
+                }
+                exitStatus = bodyStatus;
+                break;
+            }
+
+            case NODE_IF:
+                runNodes(node->condition);
+                if (exitStatus == 0) {
+                    runNodes(node->body);
+                } else if (node->orElse != NULL) {
+                    runNodes(node->orElse);
+                } else {
+                    exitStatus = 0;
+                }
+                break;
+        }
+    }
+}
+
+
+/***********************************************************
+ * expandWords: splits the words of a for loop and expands,
+ * splits and globs each one like a command argument. the
+ * copies outlive the line arena, which the loop body reuses.
+ *
+ * parameters: words, their length, where to store the count.
+ * returns: malloced array of malloced words.
+ ***********************************************************/
+
+char **expandWords(char *text, size_t length, int *count) {
+    int i;
+    char *pos = text;
+    char *end = text + length;
+    int capacity = ARGS_START;    //size of the array
+    char **words = malloc(capacity * sizeof(char *));
+    assert(words != NULL);
+
+    *count = 0;
+    arenaReset(&lineArena);    //expansions go in the line arena before being copied
+    while (pos < end) {
+        while (pos < end && (*pos == ' ' || *pos == '\t')) {
+            pos++;
+        }
+        if (pos == end) {
+            break;
+        }
+        char *word = pos;
+        pos = tokenEnd(pos, end, TRUE);
+        char *expanded = expandToken(word, pos - word);
+        int matches = 1;    //number of words it becomes
+        char **found = splitFields(word, pos - word, expanded, &matches);
+        if (found == NULL) {
+            found = &expanded;
+        }
+        while (*count + matches > capacity) {
+            capacity *= 2;
+            words = realloc(words, capacity * sizeof(char *));
+            assert(words != NULL);
+        }
+        for (i = 0; i < matches; i++) {
+            words[(*count)++] = strdup(found[i]);
+        }
+    }
+    return words;
+}
+
+
+/***********************************************************
+ * setVariable: sets a shell variable, adding it if it's new.
+ * an exported variable changing means the environment has to
+ * be rebuilt before the next child starts.
+ *
+ * parameters: name, value.
+ * returns: the variable.
+ ***********************************************************/
+
+struct variable *setVariable(char *name, char *value) {
+    importEnvironment();    //the environment's variables come first
+    size_t length = strlen(name);
+    size_t valueLength = strlen(value);
+    struct variable **bucket = &variables[hashLine(name, length) % VARIABLE_BUCKETS];
+    struct variable *variable;
+
+    for (variable = *bucket; variable != NULL; variable = variable->next) {
+        if (strcmp(variable->name, name) == 0) {    //already set, replace the value
+            break;
+        }
+    }
+    if (variable == NULL) {
+        variable = malloc(sizeof(struct variable));
+        assert(variable != NULL);
+        variable->name = strdup(name);
+        variable->entry = NULL;
+        variable->exported = FALSE;
+        variable->next = *bucket;
+        *bucket = variable;
+        variableCount++;
+    }
+    free(variable->entry);    //the old environment, if any, is rebuilt before it's used again
+    variable->entry = malloc(length + valueLength + 2);
+    assert(variable->entry != NULL);
+    memcpy(variable->entry, name, length);
+    variable->entry[length] = '=';
+    memcpy(variable->entry + length + 1, value, valueLength + 1);
+    variable->value = variable->entry + length + 1;
+    if (variable->exported == TRUE) {
+        environmentDirty = TRUE;
+    }
+    return variable;
+}
+
+
+/***********************************************************
+ * findVariable: looks up a shell variable's value, straight
+ * from the environment until a variable has been set.
+ *
+ * parameters: name, name length (it needn't end in a NUL).
+ * returns: value, or NULL if it isn't set.
+ ***********************************************************/
+
+char *findVariable(const char *name, size_t length) {
+    if (variablesImported == FALSE) {    //nothing has been set, the environment is all there is
+        char **entry;
+        for (entry = environ; *entry != NULL; entry++) {
+            if (strncmp(*entry, name, length) == 0 && (*entry)[length] == '=') {
+                return *entry + length + 1;
+            }
+        }
+        return NULL;
+    }
+    struct variable *variable = lookupVariable(name, length);
+    return variable == NULL ? NULL : variable->value;
+}
+
+
+/***********************************************************
+ * lookupVariable: looks up a shell variable.
+ *
+ * parameters: name, name length (it needn't end in a NUL).
+ * returns: variable, or NULL if it isn't set.
+ ***********************************************************/
+
+struct variable *lookupVariable(const char *name, size_t length) {
+    importEnvironment();    //the variable is about to be changed
+    struct variable *variable = variables[hashLine(name, length) % VARIABLE_BUCKETS];
+
+    for (; variable != NULL; variable = variable->next) {
+        if (strncmp(variable->name, name, length) == 0 && variable->name[length] == '\0') {
+            return variable;
+        }
+    }
+    return NULL;
+}
+
+
+/***********************************************************
+ * unsetVariable: removes a shell variable, and takes it out
+ * of the environment if it was exported.
+ *
+ * parameters: name.
+ * returns: none.
+ ***********************************************************/
+
+void unsetVariable(char *name) {
+    importEnvironment();
+    struct variable **link = &variables[hashLine(name, strlen(name)) % VARIABLE_BUCKETS];
+
+    for (; *link != NULL; link = &(*link)->next) {
+        struct variable *variable = *link;
+        if (strcmp(variable->name, name) == 0) {
+            *link = variable->next;
+            if (variable->exported == TRUE) {
+                environmentDirty = TRUE;
+            }
+            free(variable->name);
+            free(variable->entry);
+            free(variable);
+            variableCount--;
+            return;
+        }
+    }
+}
+
+
+/***********************************************************
+ * isName: checks that a word can name a variable: a letter
+ * or underscore, then letters, digits and underscores.
+ *
+ * parameters: word, word length.
+ * returns: TRUE or FALSE.
+ ***********************************************************/
+
+int isName(const char *name, size_t length) {
+    size_t i;
+
+    if (length == 0 || (name[0] >= '0' && name[0] <= '9')) {
+        return FALSE;
+    }
+    for (i = 0; i < length; i++) {
+        char c = name[i];
+        if (c != '_' && !(c >= 'a' && c <= 'z') && !(c >= 'A' && c <= 'Z') && !(c >= '0' && c <= '9')) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+
+/***********************************************************
+ * isAssignment: checks if every word of a command is
+ * NAME=value, with nothing run and nothing redirected.
+ *
+ * parameters: command struct.
+ * returns: TRUE or FALSE.
+ ***********************************************************/
+
+int isAssignment(struct command *curCommand) {
+    int i;
+
+    if (curCommand->inputFile != NULL || curCommand->outputFile != NULL || curCommand->errorFile != NULL
+        || curCommand->background == TRUE) {
+        return FALSE;
+    }
+    for (i = 0; i < curCommand->argCount; i++) {
+        char *equals = strchr(curCommand->args[i], '=');
+        if (equals == NULL || isName(curCommand->args[i], equals - curCommand->args[i]) == FALSE) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+
+/***********************************************************
+ * importEnvironment: makes a shell variable of everything in
+ * the environment the shell started with, all exported. it's
+ * done the first time a variable is set, unset, exported or
+ * listed, so a shell that only runs commands never copies it.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void importEnvironment() {
+    char **entry;
+
+    if (variablesImported == TRUE) {
+        return;
+    }
+    variablesImported = TRUE;
+    for (entry = environ; *entry != NULL; entry++) {
+        char *equals = strchr(*entry, '=');
+        if (equals == NULL || isName(*entry, equals - *entry) == FALSE) {    //nothing a variable could hold
+            continue;
+        }
+        char *name = strndup(*entry, equals - *entry);
+        assert(name != NULL);
+        setVariable(name, equals + 1)->exported = TRUE;
+        free(name);
+    }
+    environmentDirty = TRUE;
+}
+
+
+/***********************************************************
+ * currentEnvironment: gets the environment for a child. the
+ * array points at the exported variables' own name=value
+ * strings and is shared by every spawn; it's only rebuilt
+ * when an exported variable has been set, exported or unset
+ * since, so running commands in a loop costs nothing extra.
+ *
+ * parameters: none.
+ * returns: NULL terminated environment array.
+ ***********************************************************/
+
+char **currentEnvironment() {
+    int i;
+    int count = 0;
+
+    if (variablesImported == FALSE) {    //nothing has changed, children get what the shell got
+        return environ;
+    }
+    if (environmentDirty == FALSE) {
+        return environment;
+    }
+    free(environment);
+    environment = malloc((variableCount + 1) * sizeof(char *));
+    assert(environment != NULL);
+    for (i = 0; i < VARIABLE_BUCKETS; i++) {
+        struct variable *variable;
+        for (variable = variables[i]; variable != NULL; variable = variable->next) {
+            if (variable->exported == TRUE) {
+                environment[count++] = variable->entry;
+            }
+        }
+    }
+    environment[count] = NULL;
+    environmentDirty = FALSE;
+    environmentGeneration++;
+    return environment;
+}
+
+
+/***********************************************************
+ * exportBuiltin: exports variables, setting them first for
+ * NAME=value. with no names it prints every exported
+ * variable, sorted.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int exportBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+    int status = 0;
+
+    if (curCommand->argCount == 1) {    //list them
+        importEnvironment();    //only what could be a variable
+        char **current = currentEnvironment();
+        int count = 0;
+        while (current[count] != NULL) {
+            count++;
+        }
+        char **sorted = arenaAlloc(&lineArena, (count + 1) * sizeof(char *));
+        memcpy(sorted, current, count * sizeof(char *));
+        qsort(sorted, count, sizeof(char *), compareMatches);
+        for (i = 0; i < count; i++) {
+            dprintf(outputFD, "export %s\n", sorted[i]);
+        }
+        return 0;
+    }
+    for (i = 1; i < curCommand->argCount; i++) {
+        char *name = curCommand->args[i];
+        char *equals = strchr(name, '=');
+        size_t length = equals == NULL ? strlen(name) : (size_t)(equals - name);
+        if (isName(name, length) == FALSE) {
+            dprintf(errorFD, "export: `%s': not a valid identifier\n", name);
+            status = 1;
+            continue;
+        }
+        struct variable *variable = lookupVariable(name, length);
+        if (equals != NULL) {    //NAME=value sets it as well
+            *equals = '\0';
+            variable = setVariable(name, equals + 1);
+        } else if (variable == NULL) {    //exporting an unset name exports it empty
+            variable = setVariable(name, "");
+        }
+        variable->exported = TRUE;
+        environmentDirty = TRUE;
+    }
+    return status;
+}
+
+
+/***********************************************************
+ * unsetBuiltin: removes variables.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int unsetBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+
+    for (i = 1; i < curCommand->argCount; i++) {
+        unsetVariable(curCommand->args[i]);
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * newCommand: allocates an empty command in the line arena.
+ *
+ * parameters: none.
+ * returns: command struct.
+ ***********************************************************/
+
+struct command *newCommand() {
+    struct command *curCommand = arenaAlloc(&lineArena, sizeof(struct command));
+    curCommand->args = arenaAlloc(&lineArena, ARGS_START * sizeof(char *));    //argument array lives in the arena
+    curCommand->args[0] = NULL;    //reset argument array
+    curCommand->argCount = 0;    //reset argument count
+    curCommand->inputFile = NULL;    //reset input file
+    curCommand->outputFile = NULL;    //reset output file
+    curCommand->appendOutput = FALSE;    //reset append indicator
+    curCommand->errorFile = NULL;    //reset error output file
+    curCommand->errorToOutput = FALSE;    //reset error to output indicator
+    curCommand->background = FALSE;    //reset background process indicator
+    curCommand->timed = FALSE;    //reset time indicator
+    curCommand->next = NULL;    //not part of a pipeline yet
+    return curCommand;
+}
+
+
+/***********************************************************
+ * getCommand: parses input to get command. scans the line
+ * once, copying each argument into the line arena, expanding
+ * $$, variables and $(...), splitting what they expand to,
+ * and globbing patterns as it goes. words already split off
+ * by splitTokens are taken as they are instead of scanning.
+ *
+ * parameters: user command, command length, its words or
+ * NULL, number of words, command struct.
+ * returns: none.
+ ***********************************************************/
+
+void getCommand(char *command, size_t length, struct leafToken *tokens, int tokenCount, struct command *curCommand) {
+    int i = 0;    //argument i
+    int outRedirect = FALSE;    //indicates whether output redirection is necessary
+    int inRedirect = FALSE;    //indicates whether input redirection is necessary
+    int errRedirect = FALSE;    //indicates whether error output redirection is necessary
+    char *pos = command;    //current scan position
+    char *end = command + length;    //end of the command string
+    int capacity = ARGS_START;    //number of arguments that fit in the argument array
+    struct command *stage = curCommand;    //pipeline stage being filled in
+    int next = 0;    //next of the words already split off
+
+    while (tokens != NULL ? next < tokenCount : pos < end) {    //while there are still characters in the command
+        char *token;    //start of the current token
+        size_t tokenLength;    //length of the current token
+        enum tokenKind kind;    //what the token means
+
+        if (tokens != NULL) {    //split off before, nothing to scan
+            token = tokens[next].text;
+            tokenLength = tokens[next].length;
+            kind = tokens[next].kind;
+            next++;
+        } else {
+            while (pos < end && (*pos == ' ' || *pos == '\n')) {    //skip over delimiters
+                pos++;
+            }
+            if (pos == end) {    //nothing left but delimiters
+                break;
+            }
+            token = pos;
+            pos = tokenEnd(pos, end, FALSE);    //find the end of the token
+            tokenLength = pos - token;
+            kind = classifyToken(token, tokenLength);
+        }
+
+        if (outRedirect == TRUE) {        //if it's previously been determined there is output redirection
+            outRedirect = FALSE;             //reset output redirection indicator
+            stage->outputFile = expandToken(token, tokenLength);        //current token is now name of output file
+        } else if (inRedirect == TRUE) {        //if it's previously been determined there is input redirection
+            inRedirect = FALSE;             //reset input redirection indicator
+            stage->inputFile = expandToken(token, tokenLength);        //current token is now name of input file
+        } else if (errRedirect == TRUE) {    //if it's previously been determined there is error redirection
+            errRedirect = FALSE;    //reset error redirection indicator
+            stage->errorFile = expandToken(token, tokenLength);    //current token is now name of error file
+        } else if (kind == TOKEN_COMMENT) {        //if there's a comment in the command
+            break;    //ignore all characters in the command and leave
+        } else if (kind == TOKEN_INPUT) {    //if there's an input redirection symbol
+            inRedirect = TRUE;             //set the input redirection indicator
+        } else if (kind == TOKEN_OUTPUT) {    //if there's an output redirection indicator
+            outRedirect = TRUE;             //set the output redirection indicator
+        } else if (kind == TOKEN_APPEND) {    //if output is appended
+            outRedirect = TRUE;
+            stage->appendOutput = TRUE;
+        } else if (kind == TOKEN_ERROR) {    //if error output is redirected
+            errRedirect = TRUE;
+        } else if (kind == TOKEN_BOTH) {    //if both outputs are redirected
+            outRedirect = TRUE;
+            stage->errorToOutput = TRUE;
+        } else if (kind == TOKEN_BACKGROUND) {   //if there's a background symbol
+            curCommand->background = TRUE;    //set the background process indicator for the whole line, parseLine checks if it's allowed
+        } else if (kind == TOKEN_PIPE) {    //if there's a pipe, start the next stage
+            stage->args[i] = NULL;    //terminate this stage's argument array
+            stage->argCount = i;
+            stage->next = newCommand();
+            stage = stage->next;
+            i = 0;
+            capacity = ARGS_START;
+        } else if (i == 0 && stage == curCommand && curCommand->timed == FALSE
+                   && tokenLength == 4 && memcmp(token, "time", 4) == 0) {    //time prefix on the line
+            curCommand->timed = TRUE;
+        } else {    //if argument isn't redirection, filename, comment, or background process
+            char *arg = expandToken(token, tokenLength);    //expand the argument into the arena
+            int count = 1;    //number of arguments it becomes
+            char **words = splitFields(token, tokenLength, arg, &count);    //fields and matched paths
+            if (words == NULL) {
+                words = &arg;
+            }
+            if (i + count >= capacity) {    //keep room for the terminator, grow array if full
+                while (i + count >= capacity) {
+                    capacity *= 2;
+                }
+                char **bigger = arenaAlloc(&lineArena, capacity * sizeof(char *));
+                memcpy(bigger, stage->args, i * sizeof(char *));    //move arguments so far
+                stage->args = bigger;
+            }
+            memcpy(stage->args + i, words, count * sizeof(char *));    //save command in argument array
+            i += count;
+        }
+    }
+    stage->args[i] = NULL;    //terminate the argument array
+    stage->argCount = i;    //save number of arguments
+}
+
+
+/***********************************************************
+ * splitTokens: splits a plain command of a compound command
+ * into words in the tree arena, the way getCommand would,
+ * so it's done once however often the command runs.
+ *
+ * parameters: command, command length, where to store the
+ * number of words.
+ * returns: array of words.
+ ***********************************************************/
+
+struct leafToken *splitTokens(char *text, size_t length, int *count) {
+    char *pos = text;
+    char *end = text + length;
+    int used = 0;    //words so far
+
+    while (pos < end) {    //count them first
+        while (pos < end && (*pos == ' ' || *pos == '\n')) {
+            pos++;
+        }
+        if (pos == end) {
+            break;
+        }
+        pos = tokenEnd(pos, end, FALSE);
+        used++;
+    }
+
+    struct leafToken *tokens = arenaAlloc(&treeArena, (used + 1) * sizeof(struct leafToken));
+    *count = 0;
+    for (pos = text; *count < used; (*count)++) {    //then fill them in
+        struct leafToken *token = &tokens[*count];
+        while (*pos == ' ' || *pos == '\n') {
+            pos++;
+        }
+        token->text = pos;
+        pos = tokenEnd(pos, end, FALSE);
+        token->length = pos - token->text;
+        token->kind = classifyToken(token->text, token->length);
+    }
+    return tokens;
+}
+
+
+/***********************************************************
+ * parseLine: parses a command line. a line seen before comes
+ * from the line cache as a copy of its parsed template; a
+ * line seen a second time is parsed and saved as a template.
+ *
+ * parameters: command line, line length.
+ * returns: command struct in the line arena.
+ ***********************************************************/
+
+struct command *parseLine(char *line, size_t length) {
+    struct command *curCommand;
+    unsigned int hash = hashLine(line, length);
+    struct lineTemplate *template = lineCache[hash % LINE_CACHE_BUCKETS];
+
+    while (template != NULL && (template->hash != hash || template->length != length
+                                || memcmp(template->line, line, length) != 0)) {
+        template = template->next;
+    }
+    if (template != NULL) {    //parsed before, just copy it
+        curCommand = cloneTemplate(template);
+        profile.cacheHits++;
+    } else {
+        curCommand = newCommand();
+        lineUncacheable = FALSE;
+        getCommand(line, length, NULL, 0, curCommand);
+        unsigned int *seen = &lineSeen[hash % LINE_SEEN_SLOTS];
+        if (lineUncacheable == FALSE) {    //lines that depend on variables are parsed every time
+            if (*seen == hash) {    //second time this line has come up, keep it
+                saveTemplate(hash, line, length, curCommand);
+            } else {
+                *seen = hash;
+            }
+        }
+    }
+
+    if (backgroundDisabled == TRUE) {    //& is ignored in foreground-only mode
+        curCommand->background = FALSE;
+    }
+    return curCommand;
+}
+
+
+/***********************************************************
+ * hashLine: FNV-1a hash of a command line.
+ *
+ * parameters: line, line length.
+ * returns: hash value.
+ ***********************************************************/
+
+unsigned int hashLine(const char *line, size_t length) {
+    unsigned int hash = 2166136261u;    //FNV offset basis
+    const char *end = line + length;
+    while (line < end) {
+        hash ^= (unsigned char)*line++;
+        hash *= 16777619u;    //FNV prime
+    }
+    return hash;
+}
+
+
+/***********************************************************
+ * saveTemplate: packs a parsed line into one blob for the
+ * line cache. the commands come first, then their argument
+ * arrays, then every string, and each pointer is stored as
+ * an offset from the start of the blob. the cache is emptied
+ * when it's full.
+ *
+ * parameters: line hash, line, line length, parsed commands.
+ * returns: none.
+ ***********************************************************/
+
+void saveTemplate(unsigned int hash, char *line, size_t length, struct command *parsed) {
+    struct command *stage;
+    int i;
+    int stages = 0;    //commands in the pipeline
+    size_t arrays = 0;    //bytes of argument arrays
+    size_t strings = 0;    //bytes of strings
+
+    for (stage = parsed; stage != NULL; stage = stage->next) {    //size everything up
+        stages++;
+        arrays += (stage->argCount + 1) * sizeof(char *);
+        for (i = 0; i < stage->argCount; i++) {
+            strings += strlen(stage->args[i]) + 1;
+        }
+        strings += stage->inputFile != NULL ? strlen(stage->inputFile) + 1 : 0;
+        strings += stage->outputFile != NULL ? strlen(stage->outputFile) + 1 : 0;
+        strings += stage->errorFile != NULL ? strlen(stage->errorFile) + 1 : 0;
+    }
+
+    if (lineCacheCount >= LINE_CACHE_MAX) {    //make room
+        clearLineCache();
+    }
+    struct lineTemplate *template = malloc(sizeof(struct lineTemplate));
+    assert(template != NULL);
+    template->size = stages * sizeof(struct command) + arrays + strings;
+    template->blob = malloc(template->size);
+    template->line = malloc(length);
+    assert(template->blob != NULL && template->line != NULL);
+    memcpy(template->line, line, length);
+    template->hash = hash;
+    template->length = length;
+    template->stages = stages;
+
+    struct command *packed = (struct command *)template->blob;    //commands in the blob
+    size_t arrayUsed = stages * sizeof(struct command);    //where the next argument array goes
+    size_t stringUsed = arrayUsed + arrays;    //where the next string goes
+    for (stage = parsed, i = 0; stage != NULL; stage = stage->next, i++) {
+        struct command *copy = &packed[i];
+        int j;
+
+        *copy = *stage;
+        copy->args = (char **)(uintptr_t)arrayUsed;
+        char **args = (char **)(template->blob + arrayUsed);
+        for (j = 0; j < stage->argCount; j++) {
+            args[j] = (char *)(uintptr_t)copyToBlob(template->blob, &stringUsed, stage->args[j]);
+        }
+        args[j] = NULL;
+        arrayUsed += (stage->argCount + 1) * sizeof(char *);
+        copy->inputFile = (char *)(uintptr_t)copyToBlob(template->blob, &stringUsed, stage->inputFile);
+        copy->outputFile = (char *)(uintptr_t)copyToBlob(template->blob, &stringUsed, stage->outputFile);
+        copy->errorFile = (char *)(uintptr_t)copyToBlob(template->blob, &stringUsed, stage->errorFile);
+        copy->next = stage->next != NULL ? (struct command *)(uintptr_t)((i + 1) * sizeof(struct command)) : NULL;
+    }
+
+    struct lineTemplate **bucket = &lineCache[hash % LINE_CACHE_BUCKETS];
+    template->next = *bucket;
+    *bucket = template;
+    lineCacheCount++;
+}
+
+
+/***********************************************************
+ * copyToBlob: copies a string to the end of a template blob.
+ *
+ * parameters: blob, bytes used so far, string or NULL.
+ * returns: offset of the copy, or 0 for NULL.
+ ***********************************************************/
+
+size_t copyToBlob(char *blob, size_t *used, char *string) {
+    if (string == NULL) {    //offset 0 is the first command, never a string
+        return 0;
+    }
+    size_t offset = *used;
+    size_t size = strlen(string) + 1;
+    memcpy(blob + offset, string, size);
+    *used += size;
+    return offset;
+}
+
+
+/***********************************************************
+ * cloneTemplate: copies a template into the line arena with
+ * one memcpy and turns its offsets back into pointers.
+ *
+ * parameters: template.
+ * returns: first command struct of the copy.
+ ***********************************************************/
+
+struct command *cloneTemplate(struct lineTemplate *template) {
+    char *base = arenaAlloc(&lineArena, template->size);
+    struct command *commands = (struct command *)base;
+    int i;
+
+    memcpy(base, template->blob, template->size);
+    for (i = 0; i < template->stages; i++) {
+        struct command *stage = &commands[i];
+        int j;
+
+        stage->args = relocate(base, stage->args);
+        for (j = 0; j < stage->argCount; j++) {
+            stage->args[j] = relocate(base, stage->args[j]);
+        }
+        stage->inputFile = relocate(base, stage->inputFile);
+        stage->outputFile = relocate(base, stage->outputFile);
+        stage->errorFile = relocate(base, stage->errorFile);
+        stage->next = relocate(base, stage->next);
+    }
+    return commands;
+}
+
+
+/***********************************************************
+ * relocate: turns an offset stored in a template into a
+ * pointer into a copy of it.
+ *
+ * parameters: start of the copy, offset.
+ * returns: pointer, or NULL for offset 0.
+ ***********************************************************/
+
+void *relocate(char *base, void *offset) {
+    if (offset == NULL) {
+        return NULL;
+    }
+    return base + (uintptr_t)offset;
+}
+
+
+/***********************************************************
+ * clearLineCache: frees every template in the line cache.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void clearLineCache() {
+    int i;
+    for (i = 0; i < LINE_CACHE_BUCKETS; i++) {
+        struct lineTemplate *template = lineCache[i];
+        while (template != NULL) {
+            struct lineTemplate *next = template->next;
+            free(template->blob);
+            free(template->line);
+            free(template);
+            template = next;
+        }
+        lineCache[i] = NULL;
+    }
+    lineCacheCount = 0;
+}
+
+
+/***********************************************************
+ * classifyToken: tells operators apart from words. every
+ * operator is one or two bytes, so the length and first byte
+ * decide it without comparing strings.
+ *
+ * parameters: token start, token length.
+ * returns: kind of token.
+ ***********************************************************/
+
+enum tokenKind classifyToken(const char *token, size_t length) {
+    if (token[0] == '#') {    //a comment can start any word
+        return TOKEN_COMMENT;
+    }
+    switch (length) {
+        case 1:
+            switch (token[0]) {
+                case '<': return TOKEN_INPUT;
+                case '>': return TOKEN_OUTPUT;
+                case '&': return TOKEN_BACKGROUND;
+                case '|': return TOKEN_PIPE;
+            }
+            break;
+        case 2:
+            if (token[1] != '>') {    //every two byte operator ends in >
+                break;
+            }
+            switch (token[0]) {
+                case '>': return TOKEN_APPEND;
+                case '2': return TOKEN_ERROR;
+                case '&': return TOKEN_BOTH;
+            }
+            break;
+    }
+    return TOKEN_WORD;
+}
+
+
+/***********************************************************
+ * expandToken: copies a token into the line arena, replacing
+ * every $$ with the shell's PID, $? with the last exit value,
+ * $! with the last background PID, $name or ${name} with
+ * the variable's value, or nothing if it isn't set, and
+ * $(command) with the command's output.
+ *
+ * parameters: token start, token length.
+ * returns: expanded token string.
+ ***********************************************************/
+
+char *expandToken(char *token, size_t length) {
+    char *end = token + length;    //end of the token
+    unsigned long long started = profileStart();
+
+    tokenSplit = FALSE;
+    arenaBeginWord(&lineArena);    //start a new string in the arena
+    while (token < end) {
+        char *dollar = memchr(token, '$', end - token);    //find the next possible PID symbol
+        if (dollar == NULL || dollar + 1 == end) {    //no PID symbol left
+            break;
+        }
+        if (dollar[1] == '$') {    //if there's a PID symbol
+            arenaPutWord(&lineArena, token, dollar - token);    //copy chars before the $$
+            arenaPutWord(&lineArena, pidString, pidLength);    //copy the cached PID
+            token = dollar + 2;    //continue after the $$
+        } else if (dollar[1] == '(' && substitutionEnd(dollar, end) != NULL) {    //command substitution
+            char *close = substitutionEnd(dollar, end);
+            arenaPutWord(&lineArena, token, dollar - token);
+            captureOutput(dollar + 2, close - 1 - (dollar + 2));
+            lineUncacheable = TRUE;    //the command may say something different next time
+            tokenSplit = TRUE;
+            token = close;
+        } else if (dollar[1] == '?' || dollar[1] == '!') {    //last exit value, last background PID
+            char number[16];
+            int numberLength = 0;
+            if (dollar[1] == '?') {
+                numberLength = sprintf(number, "%d", exitStatus);
+            } else if (lastBackground != -1) {
+                numberLength = sprintf(number, "%d", lastBackground);
+            }
+            arenaPutWord(&lineArena, token, dollar - token);
+            arenaPutWord(&lineArena, number, numberLength);
+            lineUncacheable = TRUE;
+            token = dollar + 2;
+        } else if (dollar[1] == '_' || (dollar[1] >= 'a' && dollar[1] <= 'z') || (dollar[1] >= 'A' && dollar[1] <= 'Z')
+                   || dollar[1] == '{') {
+            char *name = dollar + 1;    //shell variable, $name or ${name}
+            char *nameEnd;
+            char *after;    //where the rest of the token starts
+            if (*name == '{') {
+                name++;
+                nameEnd = memchr(name, '}', end - name);
+                if (nameEnd == NULL || isName(name, nameEnd - name) == FALSE) {    //not a variable, keep the $ and look on
+                    arenaPutWord(&lineArena, token, dollar + 1 - token);
+                    token = dollar + 1;
+                    continue;
+                }
+                after = nameEnd + 1;
+            } else {
+                nameEnd = name + 1;
+                while (nameEnd < end && (*nameEnd == '_' || (*nameEnd >= 'a' && *nameEnd <= 'z')
+                                         || (*nameEnd >= 'A' && *nameEnd <= 'Z') || (*nameEnd >= '0' && *nameEnd <= '9'))) {
+                    nameEnd++;
+                }
+                after = nameEnd;
+            }
+            char *value = findVariable(name, nameEnd - name);
+            arenaPutWord(&lineArena, token, dollar - token);    //copy chars before the variable
+            if (value != NULL) {    //an unset variable expands to nothing
+                arenaPutWord(&lineArena, value, strlen(value));
+            }
+            lineUncacheable = TRUE;    //the line means something different once the variable changes
+            tokenSplit = TRUE;
+            token = after;
+        } else {    //lone $, keep it and keep looking
+            arenaPutWord(&lineArena, token, dollar + 1 - token);
+            token = dollar + 1;
+        }
+    }
+    arenaPutWord(&lineArena, token, end - token);    //copy whatever is left
+    profileEnd(PHASE_EXPAND, started);
+    return arenaEndWord(&lineArena);    //terminate and hand back the string
+}
+
+
+/***********************************************************
+ * tokenEnd: finds the end of a token. a $(...) is part of
+ * the token however many spaces are inside it.
+ *
+ * parameters: token start, end of the text, whether tabs
+ * also end a token.
+ * returns: position just after the token.
+ ***********************************************************/
+
+char *tokenEnd(char *pos, char *end, int tabs) {
+    while (pos < end && *pos != ' ' && *pos != '\n' && (tabs == FALSE || *pos != '\t')) {
+        char *close = NULL;
+        if (*pos == '$' && pos + 1 < end && pos[1] == '(') {
+            close = substitutionEnd(pos, end);
+        }
+        pos = close != NULL ? close : pos + 1;
+    }
+    return pos;
+}
+
+
+/***********************************************************
+ * substitutionEnd: finds the ) closing a $(, counting the
+ * parentheses nested inside.
+ *
+ * parameters: position of the $, end of the text.
+ * returns: position after the ), or NULL if it isn't closed.
+ ***********************************************************/
+
+char *substitutionEnd(char *dollar, char *end) {
+    char *pos = dollar + 2;
+    int depth = 1;    //parentheses still open
+
+    for (; pos < end; pos++) {
+        if (*pos == '(') {
+            depth++;
+        } else if (*pos == ')' && --depth == 0) {
+            return pos + 1;
+        }
+    }
+    return NULL;
+}
+
+
+/***********************************************************
+ * captureOutput: runs the command of a $(...) with its output
+ * captured, and adds the output, without trailing newlines,
+ * to the word being built. the command runs as a line of its
+ * own, with the line arena swapped for one of its own so the
+ * outer line and its half built word are left alone. a
+ * builtin that can't change the shell runs right in it, with
+ * no fork; anything else runs in a subshell. output goes
+ * to a memfd instead of a pipe, so nothing has to drain it
+ * while the shell waits for the command; the file grows in
+ * the kernel instead of through realloc, and is mapped to be
+ * copied into the word.
+ *
+ * parameters: command, command length.
+ * returns: none.
+ ***********************************************************/
+
+void captureOutput(char *command, size_t length) {
+    if (substitutionDepth == SUBSTITUTION_DEPTH) {
+        fprintf(stderr, "command substitution nested too deeply\n");
+        return;
+    }
+    struct substitution *level = &substitutions[substitutionDepth];
+    if (level->arena.block == NULL) {    //first time at this depth
+        level->fd = memfd_create("smallsh-substitution", MFD_CLOEXEC);
+        if (level->fd == -1) {
+            perror("memfd_create");
+            return;
+        }
+        level->arena.block = arenaNewBlock(ARENA_BLOCK);
+    }
+
+    fflush(stdout);    //the shell's own output so far isn't part of it
+    int savedOutput = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);    //stdout to put back
+    dup2(level->fd, STDOUT_FILENO);
+    struct arena outer = lineArena;    //outer line keeps its arena, word in progress and all
+    int outerUncacheable = lineUncacheable;
+    int outerSplit = tokenSplit;
+    lineArena = level->arena;
+    substitutionDepth++;
+
+    if (isHarmless(command, length) == TRUE) {
+        runLine(command, length);
+    } else {    //cd, exit, assignments and the like only change the child
+        runSubshell(command, length);
+    }
+
+    substitutionDepth--;
+    level->arena = lineArena;
+    lineArena = outer;
+    lineUncacheable = outerUncacheable;
+    tokenSplit = outerSplit;
+    fflush(stdout);
+    dup2(savedOutput, STDOUT_FILENO);
+    close(savedOutput);
+
+    off_t size = lseek(level->fd, 0, SEEK_END);    //how much the command wrote
+    if (size > 0) {
+        char *output = mmap(NULL, size, PROT_READ, MAP_SHARED, level->fd, 0);
+        if (output != MAP_FAILED) {
+            off_t used = size;
+            while (used > 0 && output[used - 1] == '\n') {    //trailing newlines are dropped
+                used--;
+            }
+            arenaPutWord(&lineArena, output, used);
+            munmap(output, size);
+        }
+    }
+    if (ftruncate(level->fd, 0) == -1) {    //empty it for next time
+        perror("ftruncate");
+    }
+    lseek(level->fd, 0, SEEK_SET);
+}
+
+
+/***********************************************************
+ * isHarmless: checks if a $(...) is one simple command
+ * running a builtin that's also a program, like echo or
+ * test, which can't change the shell's variables, directory
+ * or jobs, so it can run in the shell itself.
+ *
+ * parameters: command, command length.
+ * returns: TRUE or FALSE.
+ ***********************************************************/
+
+int isHarmless(char *command, size_t length) {
+    char name[BUILTIN_LONGEST + 1];    //first word, if it'd fit a builtin's name
+    char *pos = command;
+    char *end = command + length;
+
+    if (memchr(command, ';', length) != NULL || memchr(command, '|', length) != NULL
+            || memchr(command, '&', length) != NULL || memchr(command, '\n', length) != NULL) {    //more than one command
+        return FALSE;
+    }
+    while (pos < end && (*pos == ' ' || *pos == '\t')) {
+        pos++;
+    }
+    size_t wordLength = 0;
+    while (pos + wordLength < end && pos[wordLength] != ' ' && pos[wordLength] != '\t') {
+        wordLength++;
+    }
+    if (wordLength == 0 || wordLength > BUILTIN_LONGEST) {
+        return FALSE;
+    }
+    memcpy(name, pos, wordLength);
+    name[wordLength] = '\0';
+    struct builtin *builtin = findBuiltin(name);
+    return builtin != NULL && builtin->standalone == TRUE;
+}
+
+
+/***********************************************************
+ * runSubshell: runs a $(...) in a child of the shell, with
+ * stdout already on the memfd, so whatever it does to the
+ * shell's state goes when the child exits. the child leaves
+ * the zygote, agent connections and the trace entries still
+ * buffered to the shell, and exit in it only ends the child.
+ *
+ * parameters: command, command length.
+ * returns: none.
+ ***********************************************************/
+
+void runSubshell(char *command, size_t length) {
+    int status;    //how the child finished
+
+    traceFlush();    //the child's entries come after the shell's
+    pid_t child = fork();
+    if (child == -1) {
+        perror("fork");
+        exitStatus = 1;
+        exitSignal = 0;
+        return;
+    }
+    if (child == 0) {
+        inSubshell = TRUE;
+        zygote.fd = -1;    //the shell's helper and connections stay the shell's
+        remoteHosts = NULL;
+        if (isCompound(command, length) == TRUE && compoundDepth(command, length) == 0) {
+            runCompound(command, length);
+        } else {
+            runLine(command, length);
+        }
+        exitShell(exitStatus);
+    }
+    while (waitpid(child, &status, 0) == -1 && errno == EINTR) {
+    }
+    exitSignal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+    exitStatus = WIFSIGNALED(status) ? 128 + exitSignal : WEXITSTATUS(status);
+}
+
+
+/***********************************************************
+ * splitFields: splits an expanded word into fields at
+ * spaces, tabs and newlines if a variable or $(...) went
+ * into it, then globs each field. an assignment is never
+ * split or globbed. the fields are the word's own bytes,
+ * split in place.
+ *
+ * parameters: token as written, token length, expanded word,
+ * where to store the number of fields.
+ * returns: array of fields in the line arena, or NULL if the
+ * word stays as it is.
+ ***********************************************************/
+
+char **splitFields(char *token, size_t length, char *word, int *count) {
+    char *equals = memchr(token, '=', length);
+    if (equals != NULL && isName(token, equals - token) == TRUE) {    //NAME=value keeps its value whole
+        tokenSplit = FALSE;
+        return NULL;
+    }
+    if (tokenSplit == FALSE) {    //nothing expanded, so only a pattern can change it
+        return globWord(word, count);
+    }
+    tokenSplit = FALSE;
+
+    char **fields = NULL;    //fields so far
+    int used = 0;
+    int room = 0;
+    char *pos = word;
+    while (*pos != '\0') {
+        pos += strspn(pos, " \t\n");
+        if (*pos == '\0') {
+            break;
+        }
+        char *field = pos;
+        pos += strcspn(pos, " \t\n");
+        if (*pos != '\0') {
+            *pos++ = '\0';
+        }
+
+        int matches = 1;
+        char **found = globWord(field, &matches);
+        if (found == NULL) {
+            found = &field;
+        }
+        if (used + matches > room) {
+            while (used + matches > room) {
+                room = room == 0 ? ARGS_START : room * 2;
+            }
+            char **bigger = arenaAlloc(&lineArena, room * sizeof(char *));
+            memcpy(bigger, fields, used * sizeof(char *));
+            fields = bigger;
+        }
+        memcpy(fields + used, found, matches * sizeof(char *));
+        used += matches;
+    }
+    *count = used;
+    return fields == NULL ? arenaAlloc(&lineArena, sizeof(char *)) : fields;
+}
+
+
+/***********************************************************
+ * globWord: expands a word with *, ? or [...] in it into the
+ * paths it matches, sorted. the pattern is matched a path
+ * component at a time against directory listings, which are
+ * cached; a word that matches nothing is left as it is. the
+ * matches and their array are in the line arena.
+ *
+ * parameters: expanded word, where to store the number of
+ * matches.
+ * returns: array of matches, or NULL if the word isn't a
+ * pattern or matched nothing.
+ ***********************************************************/
+
+char **globWord(char *word, int *count) {
+    if (isPattern(word, strlen(word)) == FALSE) {
+        return NULL;
+    }
+    lineUncacheable = TRUE;    //the line means something different once the files change
+
+    if (dirCacheCount > DIR_CACHE_MAX) {    //only between globs, nothing is using a listing now
+        clearDirCache();
+    }
+    globGeneration++;
+    glob.count = 0;
+    glob.room = 0;
+    glob.matches = NULL;
+    globWalk(0, word);
+    if (glob.count == 0) {
+        return NULL;
+    }
+    qsort(glob.matches, glob.count, sizeof(char *), compareMatches);
+    *count = glob.count;
+    return glob.matches;
+}
+
+
+/***********************************************************
+ * globWalk: matches the rest of a pattern below the path
+ * built so far. literal components are added to the path
+ * as they are; a component that is a pattern is matched
+ * against every name in the directory, and anything after
+ * it only against names that are directories. names
+ * starting with a dot only match a component that does.
+ *
+ * parameters: length of the path so far, rest of the
+ * pattern.
+ * returns: none.
+ ***********************************************************/
+
+void globWalk(size_t pathLength, const char *rest) {
+    int i;
+    struct stat info;
+
+    while (*rest == '/') {    //slashes go straight into the path
+        globPath(pathLength++, "/", 1);
+        rest++;
+    }
+    if (*rest == '\0') {    //whole pattern matched
+        globAdd(pathLength);
+        return;
+    }
+
+    const char *end = strchrnul(rest, '/');    //end of this component
+    if (isPattern(rest, end - rest) == FALSE) {    //literal component, no listing needed
+        globPath(pathLength, rest, end - rest);
+        if (*end != '\0') {
+            globWalk(pathLength + (end - rest), end);
+        } else if (lstat(glob.path, &info) == 0) {    //a literal last component has to exist
+            globAdd(pathLength + (end - rest));
+        }
+        return;
+    }
+
+    globPath(pathLength, "", 0);
+    struct dirListing *listing = listDirectory(pathLength == 0 ? "." : glob.path);
+    if (listing == NULL) {    //not a directory, or unreadable
+        return;
+    }
+    for (i = 0; i < listing->count; i++) {
+        char *name = listing->names + listing->offsets[i];
+        if (name[0] == '.' && (rest[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;    //hidden names need a dot in the pattern, and . and .. never match
+        }
+        if (globMatch(rest, end, name) == FALSE) {
+            continue;
+        }
+        size_t nameLength = strlen(name);
+        globPath(pathLength, name, nameLength);
+        if (*end == '\0') {
+            globAdd(pathLength + nameLength);
+        } else if (listing->types[i] == DT_DIR
+                   || ((listing->types[i] == DT_LNK || listing->types[i] == DT_UNKNOWN)
+                       && stat(glob.path, &info) == 0 && S_ISDIR(info.st_mode))) {    //only directories go deeper
+            globWalk(pathLength + nameLength, end);
+        }
+    }
+}
+
+
+/***********************************************************
+ * globAdd: copies the path built so far into the line arena
+ * as a match.
+ *
+ * parameters: path length.
+ * returns: none.
+ ***********************************************************/
+
+void globAdd(size_t pathLength) {
+    if (glob.count == glob.room) {    //grow the array of matches
+        glob.room = glob.room == 0 ? ARGS_START : glob.room * 2;
+        char **bigger = arenaAlloc(&lineArena, glob.room * sizeof(char *));
+        memcpy(bigger, glob.matches, glob.count * sizeof(char *));
+        glob.matches = bigger;
+    }
+    char *match = arenaAlloc(&lineArena, pathLength + 1);
+    memcpy(match, glob.path, pathLength + 1);
+    glob.matches[glob.count++] = match;
+}
+
+
+/***********************************************************
+ * globPath: puts characters into the path being built,
+ * growing its buffer, and terminates it after them.
+ *
+ * parameters: where they go, characters, number of them.
+ * returns: none.
+ ***********************************************************/
+
+void globPath(size_t length, const char *chars, size_t count) {
+    if (length + count + 1 > glob.capacity) {
+        glob.capacity = (length + count + 1) * 2;
+        glob.path = realloc(glob.path, glob.capacity);
+        assert(glob.path != NULL);
+    }
+    memcpy(glob.path + length, chars, count);
+    glob.path[length + count] = '\0';
+}
+
+
+/***********************************************************
+ * isPattern: checks whether a word needs globbing. a [ only
+ * counts if its bracket expression is closed, so [ and
+ * test's ] aren't patterns.
+ *
+ * parameters: word, word length.
+ * returns: TRUE if it has *, ? or a bracket expression.
+ ***********************************************************/
+
+int isPattern(const char *word, size_t length) {
+    const char *end = word + length;
+
+    for (; word < end; word++) {
+        if (*word == '*' || *word == '?' || (*word == '[' && bracketEnd(word, end) != NULL)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+
+/***********************************************************
+ * globMatch: matches a name against one component of a
+ * pattern. a * backs up to the last star when the rest
+ * fails, so matching takes linear time for each star.
+ *
+ * parameters: component start, component end, name.
+ * returns: TRUE if the name matches.
+ ***********************************************************/
+
+int globMatch(const char *pattern, const char *patternEnd, const char *name) {
+    const char *star = NULL;    //just after the last * seen
+    const char *starName = NULL;    //name position that star is matching up to
+
+    while (*name != '\0') {
+        if (pattern < patternEnd && *pattern == '*') {
+            star = ++pattern;
+            starName = name;
+            continue;
+        }
+        if (pattern < patternEnd) {
+            const char *closed = *pattern == '[' ? bracketEnd(pattern, patternEnd) : NULL;
+            if (closed != NULL) {
+                if (bracketMatch(pattern, closed, *name) == TRUE) {
+                    pattern = closed;
+                    name++;
+                    continue;
+                }
+            } else if (*pattern == '?' || *pattern == *name) {
+                pattern++;
+                name++;
+                continue;
+            }
+        }
+        if (star == NULL) {    //mismatch with no star to stretch
+            return FALSE;
+        }
+        pattern = star;    //let the last star take one more character
+        name = ++starName;
+    }
+    while (pattern < patternEnd && *pattern == '*') {
+        pattern++;
+    }
+    return pattern == patternEnd;
+}
+
+
+/***********************************************************
+ * bracketEnd: finds the end of a bracket expression. a ]
+ * right after the [ or the ! or ^ that negates it is part
+ * of the set.
+ *
+ * parameters: pattern at the [, end of the component.
+ * returns: position after the ], or NULL if it isn't closed.
+ ***********************************************************/
+
+const char *bracketEnd(const char *pattern, const char *patternEnd) {
+    const char *pos = pattern + 1;
+
+    if (pos < patternEnd && (*pos == '!' || *pos == '^')) {
+        pos++;
+    }
+    if (pos < patternEnd && *pos == ']') {
+        pos++;
+    }
+    while (pos < patternEnd && *pos != ']' && *pos != '/') {
+        pos++;
+    }
+    return pos < patternEnd && *pos == ']' ? pos + 1 : NULL;
+}
+
+
+/***********************************************************
+ * bracketMatch: checks a character against a bracket
+ * expression of single characters and ranges.
+ *
+ * parameters: expression at the [, position after its ],
+ * character.
+ * returns: TRUE if the character is in the set.
+ ***********************************************************/
+
+int bracketMatch(const char *pattern, const char *end, unsigned char c) {
+    const char *pos = pattern + 1;
+    int negated = FALSE;
+    int found = FALSE;
+
+    end--;    //stop at the ]
+    if (*pos == '!' || *pos == '^') {
+        negated = TRUE;
+        pos++;
+    }
+    do {    //the first character is always part of the set, even a ]
+        unsigned char low = *pos;
+        if (pos + 2 < end && pos[1] == '-') {    //range
+            if (c >= low && c <= (unsigned char)pos[2]) {
+                found = TRUE;
+            }
+            pos += 3;
+        } else {
+            if (c == low) {
+                found = TRUE;
+            }
+            pos++;
+        }
+    } while (pos < end);
+    return found != negated;
+}
+
+
+/***********************************************************
+ * compareMatches: orders two matches by byte value for
+ * qsort.
+ *
+ * parameters: two string pointers.
+ * returns: negative, zero or positive.
+ ***********************************************************/
+
+int compareMatches(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+/***********************************************************
+ * listDirectory: gets the names in a directory. a cached
+ * listing is used as long as the directory's inode and mtime
+ * haven't changed since it was read, which costs one stat
+ * instead of reading the whole directory again. each
+ * directory is checked at most once per glob. a listing read
+ * within two seconds of the directory changing is read again
+ * next time, since a change in the same mtime tick wouldn't
+ * show.
+ *
+ * parameters: directory path.
+ * returns: listing, or NULL if it can't be read.
+ ***********************************************************/
+
+struct dirListing *listDirectory(const char *path) {
+    struct dirListing **bucket = &dirCache[hashLine(path, strlen(path)) % DIR_CACHE_BUCKETS];
+    struct dirListing *listing;
+    struct stat info;
+
+    for (listing = *bucket; listing != NULL; listing = listing->next) {
+        if (strcmp(listing->path, path) == 0) {
+            break;
+        }
+    }
+    if (listing != NULL && listing->checked == globGeneration) {    //already checked for this glob
+        return listing;
+    }
+    if (stat(path, &info) == -1 || !S_ISDIR(info.st_mode)) {
+        return NULL;
+    }
+    if (listing != NULL && listing->racy == FALSE && listing->device == info.st_dev && listing->inode == info.st_ino
+        && listing->modified.tv_sec == info.st_mtim.tv_sec && listing->modified.tv_nsec == info.st_mtim.tv_nsec) {
+        listing->checked = globGeneration;    //unchanged, keep using it
+        return listing;
+    }
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (listing == NULL) {    //first time for this directory
+        listing = calloc(1, sizeof(struct dirListing));
+        assert(listing != NULL);
+        listing->path = strdup(path);
+        listing->next = *bucket;
+        *bucket = listing;
+        dirCacheCount++;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    listing->device = info.st_dev;
+    listing->inode = info.st_ino;
+    listing->modified = info.st_mtim;
+    listing->racy = now.tv_sec - info.st_mtim.tv_sec < 2;
+    listing->checked = globGeneration;
+    int ok = readListing(listing, fd);
+    close(fd);
+    if (ok == FALSE) {    //make sure it's read again next time
+        listing->count = 0;
+        listing->racy = TRUE;
+    }
+    return listing;
+}
+
+
+/***********************************************************
+ * readListing: reads every name in a directory into a
+ * listing with getdents64, a large buffer at a time.
+ *
+ * parameters: listing, open directory.
+ * returns: TRUE if the whole directory was read.
+ ***********************************************************/
+
+int readListing(struct dirListing *listing, int fd) {
+    char *buffer = malloc(DIRENT_BUFFER);    //raw entries from the kernel
+    size_t namesUsed = 0;    //bytes of names so far
+    size_t namesRoom = DIRENT_BUFFER;    //size of the names buffer
+    int room = 256;    //size of the offset and type arrays
+    int ok = TRUE;
+    assert(buffer != NULL);
+
+    free(listing->names);
+    free(listing->offsets);
+    free(listing->types);
+    listing->names = malloc(namesRoom);
+    listing->offsets = malloc(room * sizeof(unsigned int));
+    listing->types = malloc(room);
+    assert(listing->names != NULL && listing->offsets != NULL && listing->types != NULL);
+    listing->count = 0;
+
+    while (1) {
+        long got = syscall(SYS_getdents64, fd, buffer, DIRENT_BUFFER);
+        if (got == -1 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            ok = got == 0;
+            break;
+        }
+        long pos;
+        for (pos = 0; pos < got; ) {
+            struct linuxDirent *entry = (struct linuxDirent *)(buffer + pos);
+            size_t size = strlen(entry->d_name) + 1;
+            pos += entry->d_reclen;
+            if (namesUsed + size > namesRoom) {
+                namesRoom *= 2;
+                listing->names = realloc(listing->names, namesRoom);
+                assert(listing->names != NULL);
+            }
+            if (listing->count == room) {
+                room *= 2;
+                listing->offsets = realloc(listing->offsets, room * sizeof(unsigned int));
+                listing->types = realloc(listing->types, room);
+                assert(listing->offsets != NULL && listing->types != NULL);
+            }
+            memcpy(listing->names + namesUsed, entry->d_name, size);
+            listing->offsets[listing->count] = namesUsed;
+            listing->types[listing->count++] = entry->d_type;
+            namesUsed += size;
+        }
+    }
+    free(buffer);
+    return ok;
+}
+
+
+/***********************************************************
+ * clearDirCache: forgets every cached directory listing.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void clearDirCache() {
+    int i;
+
+    for (i = 0; i < DIR_CACHE_BUCKETS; i++) {
+        while (dirCache[i] != NULL) {
+            struct dirListing *listing = dirCache[i];
+            dirCache[i] = listing->next;
+            free(listing->path);
+            free(listing->names);
+            free(listing->offsets);
+            free(listing->types);
+            free(listing);
+        }
+    }
+    dirCacheCount = 0;
+}
+
+
+/***********************************************************
+ * arenaNewBlock: allocates an empty arena block.
+ *
+ * parameters: block size.
+ * returns: arena block.
+ ***********************************************************/
+
+struct arenaBlock *arenaNewBlock(size_t size) {
+    struct arenaBlock *block = malloc(sizeof(struct arenaBlock) + size);
+    assert(block != NULL);    //make sure block exists
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+
+/***********************************************************
+ * arenaReset: releases everything in an arena for reuse. if
+ * the arena had to grow, its blocks are merged into one big
+ * enough to hold the same amount next time.
+ *
+ * parameters: arena.
+ * returns: none.
+ ***********************************************************/
+
+void arenaReset(struct arena *arena) {
+    struct arenaBlock *block = arena->block;
+    size_t total = 0;    //size of all blocks together
+
+    if (block == NULL) {    //never used, the first allocation makes its block
+        return;
+    }
+    if (block->next == NULL) {    //common case, a single block
+        block->used = 0;
+        return;
+    }
+    while (block != NULL) {    //free every block, adding up their sizes
+        struct arenaBlock *next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    arena->block = arenaNewBlock(total > ARENA_BLOCK ? total : ARENA_BLOCK);
+}
+
+
+/***********************************************************
+ * arenaAlloc: hands out aligned memory from an arena,
+ * starting a new block if the current one is full or the
+ * arena hasn't been used yet.
+ *
+ * parameters: arena, number of bytes.
+ * returns: pointer to memory.
+ ***********************************************************/
+
+void *arenaAlloc(struct arena *arena, size_t size) {
+    struct arenaBlock *block = arena->block;
+    size_t offset = block == NULL ? 0 : (block->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);    //align the allocation
+
+    if (block == NULL || offset + size > block->size) {    //if it doesn't fit, start a new block
+        size_t blockSize = block == NULL ? ARENA_BLOCK : block->size * 2;    //grow geometrically
+        if (blockSize < size) {
+            blockSize = size;
+        }
+        struct arenaBlock *bigger = arenaNewBlock(blockSize);
+        bigger->next = block;
+        arena->block = bigger;
+        block = bigger;
+        offset = 0;
+    }
+    block->used = offset + size;
+    return block->data + offset;
+}
+
+
+/***********************************************************
+ * arenaBeginWord: starts building a string at the top of the
+ * arena.
+ *
+ * parameters: arena.
+ * returns: none.
+ ***********************************************************/
+
+void arenaBeginWord(struct arena *arena) {
+    if (arena->block == NULL) {    //first use of the arena
+        arena->block = arenaNewBlock(ARENA_BLOCK);
+    }
+    arena->wordStart = arena->block->used;    //remember where the string starts
+}
+
+
+/***********************************************************
+ * arenaPutWord: appends characters to the string being
+ * built. if the block is full the partial string moves to a
+ * new, larger block.
+ *
+ * parameters: arena, characters, number of characters.
+ * returns: none.
+ ***********************************************************/
+
+void arenaPutWord(struct arena *arena, const char *chars, size_t count) {
+    struct arenaBlock *block = arena->block;
+
+    if (block->used + count + 1 > block->size) {    //leave room for the terminator
+        size_t wordLength = block->used - arena->wordStart;    //partial string so far
+        size_t size = block->size * 2;    //grow geometrically
+        if (size < wordLength + count + 1) {
+            size = wordLength + count + 1;
+        }
+        struct arenaBlock *bigger = arenaNewBlock(size);
+        memcpy(bigger->data, block->data + arena->wordStart, wordLength);    //move partial string over
+        block->used = arena->wordStart;    //partial string no longer lives in old block
+        bigger->used = wordLength;
+        bigger->next = block;
+        arena->block = bigger;
+        arena->wordStart = 0;
+        block = bigger;
+    }
+    memcpy(block->data + block->used, chars, count);    //append the characters
+    block->used += count;
+}
+
+
+/***********************************************************
+ * arenaEndWord: terminates the string being built.
+ *
+ * parameters: arena.
+ * returns: finished string.
+ ***********************************************************/
+
+char *arenaEndWord(struct arena *arena) {
+    struct arenaBlock *block = arena->block;
+
+    if (block->used + 1 > block->size) {    //make sure the terminator fits
+        arenaPutWord(arena, "", 0);
+        block = arena->block;
+    }
+    block->data[block->used++] = '\0';    //terminate the string
+    return block->data + arena->wordStart;
+}
+
+
+/***********************************************************
+ * indexBuiltins: puts every builtin in its hash slot. the
+ * hash constants were picked so the builtin names don't
+ * collide, but one that does goes in the next free slot and
+ * findBuiltin probes for it. a name too long for findBuiltin,
+ * or a full table, stops the shell in any build.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void indexBuiltins() {
+    int i;
+    for (i = 0; builtins[i].name != NULL; i++) {
+        size_t length = strlen(builtins[i].name);
+        if (length > BUILTIN_LONGEST || i >= BUILTIN_SLOTS - 1) {    //findBuiltin couldn't find it, or stop probing
+            fprintf(stderr, "builtin table can't hold %s\n", builtins[i].name);
+            abort();
+        }
+        unsigned slot = builtinHash(builtins[i].name, length);
+        while (builtinSlots[slot] != NULL) {    //collision, probe for a free slot
+            slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        }
+        builtinSlots[slot] = &builtins[i];
+    }
+}
+
+
+/***********************************************************
+ * builtinHash: hashes a name from its first two bytes and
+ * its length, constants picked so no two builtins collide.
+ *
+ * parameters: name, name length.
+ * returns: slot in the builtin table.
+ ***********************************************************/
+
+unsigned builtinHash(const char *name, size_t length) {
+    return ((unsigned char)name[0] + (unsigned char)name[1] * 26 + length * 7) & (BUILTIN_SLOTS - 1);
+}
+
+
+/***********************************************************
+ * findBuiltin: finds a built-in command by name with one
+ * hash, checking slots from there until an empty one. with
+ * no collisions that's a single string compare.
+ *
+ * parameters: command name.
+ * returns: builtin struct, or NULL if not built in.
+ ***********************************************************/
+
+struct builtin *findBuiltin(char *name) {
+    size_t length = strnlen(name, BUILTIN_LONGEST + 1);    //no builtin is longer, so don't scan further
+    if (length == 0 || length > BUILTIN_LONGEST) {
+        return NULL;
+    }
+    unsigned slot = builtinHash(name, length);
+    struct builtin *builtin;
+    for (; (builtin = builtinSlots[slot]) != NULL; slot = (slot + 1) & (BUILTIN_SLOTS - 1)) {
+        if (strcmp(builtin->name, name) == 0) {
+            return builtin;
+        }
+    }
+    return NULL;
+}
+
+
+/***********************************************************
+ * runBuiltin: runs a built-in command inside the shell. its
+ * < and > files are opened for it, its output goes to the >
+ * file or the shell's stdout, and its errors to errorFD.
+ *
+ * parameters: builtin struct, command struct.
+ * returns: exit status int.
+ ***********************************************************/
+
+int runBuiltin(struct builtin *builtin, struct command *curCommand) {
+    int fds[3] = { -1, -1, -1 };    //stdin, stdout and stderr for the builtin
+
+    fflush(stdout);    //keep earlier output ahead of the builtin's
+    profile.builtins++;
+    if (builtin->ownRedirects == TRUE) {    //it knows what its files mean
+        return builtin->run(curCommand, STDOUT_FILENO);
+    }
+    if (openRedirections(curCommand, fds) == FALSE) {    //open any files named on the command line
+        closeRedirections(fds);
+        return 1;
+    }
+    int outputFD = fds[1] >= 0 ? fds[1] : STDOUT_FILENO;    //where the builtin's output goes
+    errorFD = fds[2] == ERROR_TO_OUTPUT ? outputFD : fds[2] >= 0 ? fds[2] : STDERR_FILENO;
+    int status = builtin->run(curCommand, outputFD);
+    errorFD = STDERR_FILENO;
+    closeRedirections(fds);
+    return status;
+}
+
+
+/***********************************************************
+ * writeOutput: writes all of a buffer, retrying short writes.
+ *
+ * parameters: file descriptor, data, length.
+ * returns: 0 on success, 1 on error.
+ ***********************************************************/
+
+int writeOutput(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return 1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * exitShell: kills all processes runningand exits shell
+ *
+ * parameters: exit status.
+ * returns: none.
+ ***********************************************************/
+
+void exitShell(int status) {
+    int i;
+    if (inSubshell == TRUE) {    //a $(...) child leaves the shell's jobs alone
+        fflush(stdout);
+        traceFlush();
+        _exit(status);
+    }
+    reapChildren();    //report what finished before the rest are killed
+    drainNotices();
+    for (i = 0; i < backProcs.capacity && backProcs.count > 0; i++) {    //loop through background PIDs
+        if (backProcs.slots[i].active == TRUE) {    //if any are still running
+            if (backProcs.slots[i].host == NULL) {    //remote jobs go when their connection closes
+                kill(-backProcs.slots[i].group, SIGKILL);    //kill the whole job at once
+            }
+            removeProcess(i);    //and free the slot
+        }
+    }
+    while (remoteHosts != NULL) {    //agents kill their jobs and exit
+        dropRemote(remoteHosts);
+    }
+    stopZygote();    //let the spawn helper go
+    traceFlush();    //write what's left of the trace
+    profileDump();    //write the profile if one was asked for
+    exit(status);    //then exit the shell
+}
+
+
+/***********************************************************
+ * exitBuiltin: the exit command.
+ *
+ * parameters: command struct, output fd.
+ * returns: does not return.
+ ***********************************************************/
+
+int exitBuiltin(struct command *curCommand, int outputFD) {
+    int status = exitStatus;    //exit with no number keeps the last status
+    if (curCommand->argCount > 1) {
+        char *end;
+        status = strtol(curCommand->args[1], &end, 10);
+        if (*end != '\0' || end == curCommand->args[1]) {
+            dprintf(errorFD, "exit: %s: numeric argument required\n", curCommand->args[1]);
+            status = 2;
+        }
+    }
+    exitShell(status & 255);    //call to exit shell
+    return 0;
+}
+
+
+/***********************************************************
+ * changeDir: changes current directory.
+ *
+ * parameters: command struct (directory path), output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int changeDir(struct command *curCommand, int outputFD) {
+    int dir;    //check if successful
+    char *path = curCommand->args[1];    //directory to change to
+
+    if (path == NULL) {    //if path is null, command was just cd
+        char *home = findVariable("HOME", 4);
+        if (home == NULL) {
+            dprintf(errorFD, "cd: HOME not set\n");
+            return 1;
+        }
+        dir = chdir(home);    //cd goes to home directory
+
+        if (dir == -1) {     //make sure chdir was successful
+            dprintf(errorFD, "cd: %s: %s\n", home, strerror(errno));    //if not, print error
+            return 1;
+        }
+    } else {    //if path wasn't null
+        dir = chdir(path);    //change directory to path indicated
+
+        if (dir == -1) {    //make sure chdir was successful
+            dprintf(errorFD, "cd: %s: %s\n", path, strerror(errno));    //if not, print error
+            return 1;
+        }
+    }
+    if (zygote.fd != -1) {    //children of the zygote start in the new directory
+        close(zygote.cwdFD);
+        zygote.cwdFD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * printStatus: prints exit status of most recent process.
+ * with -v it also prints what the most recent foreground and
+ * background jobs used.
+ *
+ * parameters: command struct, output fd.
+ * returns: KEEP_STATUS, so the status isn't changed.
+ ***********************************************************/
+
+int printStatus(struct command *curCommand, int outputFD) {
+    if (exitSignal != 0) {    //print exit status from most recently terminated process
+        dprintf(outputFD, "terminated by signal %d\n", exitSignal);
+    } else {
+        dprintf(outputFD, "exit value %d\n", exitStatus);
+    }
+    if (curCommand->argCount > 1 && strcmp(curCommand->args[1], "-v") == 0) {
+        if (foreUsage.valid == TRUE) {
+            dprintf(outputFD, "foreground ");
+            printUsage(outputFD, &foreUsage);
+        }
+        if (backUsage.valid == TRUE) {
+            dprintf(outputFD, "background pid %d ", backUsage.pid);
+            printUsage(outputFD, &backUsage);
+        }
+    }
+    return KEEP_STATUS;
+}
+
+
+/***********************************************************
+ * echoBuiltin: prints its arguments separated by spaces,
+ * with a newline unless the first argument is -n.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int echoBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+    int first = 1;    //first argument to print
+    int newline = TRUE;    //whether to end with a newline
+    size_t length = 0;    //length of the output
+
+    if (curCommand->argCount > 1 && strcmp(curCommand->args[1], "-n") == 0) {
+        newline = FALSE;
+        first = 2;
+    }
+
+    arenaBeginWord(&lineArena);    //build the whole line so it's written at once
+    for (i = first; i < curCommand->argCount; i++) {
+        size_t argLength = strlen(curCommand->args[i]);
+        if (i > first) {
+            arenaPutWord(&lineArena, " ", 1);
+            length++;
+        }
+        arenaPutWord(&lineArena, curCommand->args[i], argLength);
+        length += argLength;
+    }
+    if (newline == TRUE) {
+        arenaPutWord(&lineArena, "\n", 1);
+        length++;
+    }
+    return writeOutput(outputFD, arenaEndWord(&lineArena), length);
+}
+
+
+/***********************************************************
+ * trueBuiltin: does nothing, successfully.
+ *
+ * parameters: command struct, output fd.
+ * returns: 0.
+ ***********************************************************/
+
+int trueBuiltin(struct command *curCommand, int outputFD) {
+    return 0;
+}
+
+
+/***********************************************************
+ * falseBuiltin: does nothing, unsuccessfully.
+ *
+ * parameters: command struct, output fd.
+ * returns: 1.
+ ***********************************************************/
+
+int falseBuiltin(struct command *curCommand, int outputFD) {
+    return 1;
+}
+
+
+/***********************************************************
+ * testBuiltin: evaluates a test like test(1). handles !,
+ * -n and -z, string = and !=, the integer comparisons, and
+ * the -e -f -d -r -w -x -s file tests. [ needs a closing ].
+ *
+ * parameters: command struct, output fd.
+ * returns: 0 if true, 1 if false, 2 on a bad expression.
+ ***********************************************************/
+
+int testBuiltin(struct command *curCommand, int outputFD) {
+    char **args = curCommand->args + 1;    //the expression
+    int count = curCommand->argCount - 1;    //number of words in the expression
+    int negate = FALSE;    //whether a ! came first
+    int result;
+
+    if (curCommand->args[0][0] == '[') {    //[ needs its closing ]
+        if (count == 0 || strcmp(args[count - 1], "]") != 0) {
+            dprintf(errorFD, "[: missing ]\n");
+            return 2;
+        }
+        count--;
+    }
+    if (count > 1 && strcmp(args[0], "!") == 0) {
+        negate = TRUE;
+        args++;
+        count--;
+    }
+
+    if (count == 0) {    //nothing is false
+        result = FALSE;
+    } else if (count == 1) {    //a lone string is true if it isn't empty
+        result = args[0][0] != '\0';
+    } else if (count == 2 && strcmp(args[0], "-n") == 0) {
+        result = args[1][0] != '\0';
+    } else if (count == 2 && strcmp(args[0], "-z") == 0) {
+        result = args[1][0] == '\0';
+    } else if (count == 2 && args[0][0] == '-' && args[0][1] != '\0' && args[0][2] == '\0'
+               && strchr("efdrwxs", args[0][1]) != NULL) {
+        result = testFile(args[0][1], args[1]);
+    } else if (count == 3 && strcmp(args[1], "=") == 0) {
+        result = strcmp(args[0], args[2]) == 0;
+    } else if (count == 3 && strcmp(args[1], "!=") == 0) {
+        result = strcmp(args[0], args[2]) != 0;
+    } else if (count == 3 && args[1][0] == '-') {    //integer comparison
+        char *end1;
+        char *end2;
+        long left = strtol(args[0], &end1, 10);
+        long right = strtol(args[2], &end2, 10);
+        if (*end1 != '\0' || *end2 != '\0' || args[0][0] == '\0' || args[2][0] == '\0') {
+            dprintf(errorFD, "test: integer expression expected\n");
+            return 2;
+        }
+        if (strcmp(args[1], "-eq") == 0) {
+            result = left == right;
+        } else if (strcmp(args[1], "-ne") == 0) {
+            result = left != right;
+        } else if (strcmp(args[1], "-lt") == 0) {
+            result = left < right;
+        } else if (strcmp(args[1], "-le") == 0) {
+            result = left <= right;
+        } else if (strcmp(args[1], "-gt") == 0) {
+            result = left > right;
+        } else if (strcmp(args[1], "-ge") == 0) {
+            result = left >= right;
+        } else {
+            dprintf(errorFD, "test: %s: unknown operator\n", args[1]);
+            return 2;
+        }
+    } else {
+        dprintf(errorFD, "test: bad expression\n");
+        return 2;
+    }
+
+    if (negate == TRUE) {
+        result = !result;
+    }
+    return result ? 0 : 1;
+}
+
+
+/***********************************************************
+ * testFile: evaluates a single file test.
+ *
+ * parameters: test letter, file path.
+ * returns: TRUE or FALSE.
+ ***********************************************************/
+
+int testFile(char op, char *path) {
+    struct stat info;    //file information
+
+    switch (op) {
+        case 'r':
+            return access(path, R_OK) == 0;
+        case 'w':
+            return access(path, W_OK) == 0;
+        case 'x':
+            return access(path, X_OK) == 0;
+    }
+    if (stat(path, &info) == -1) {    //the rest need the file to exist
+        return FALSE;
+    }
+    switch (op) {
+        case 'f':
+            return S_ISREG(info.st_mode);
+        case 'd':
+            return S_ISDIR(info.st_mode);
+        case 's':
+            return info.st_size > 0;
+    }
+    return TRUE;    //-e
+}
+
+
+/***********************************************************
+ * printfBuiltin: prints its arguments under a format like
+ * printf(1). handles %s %b %c %d %i %u %x %X %o and %% with
+ * flags, width and precision, and the \n \t \\ \NNN style
+ * escapes, which %b also expands in its argument, where \c
+ * ends the output. the format is reused until every argument
+ * has been printed.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int printfBuiltin(struct command *curCommand, int outputFD) {
+    if (curCommand->argCount < 2) {
+        dprintf(errorFD, "usage: printf format [arguments...]\n");
+        return 2;
+    }
+
+    char *format = curCommand->args[1];
+    int next = 2;    //next argument to use
+    size_t length = 0;    //length of the output
+    char piece[64];    //room to format one number
+
+    arenaBeginWord(&lineArena);    //build all of the output so it's written at once
+    do {
+        char *f = format;
+        while (*f != '\0') {
+            char escaped;    //character an escape stands for
+            size_t used;    //characters the escape takes up after the backslash
+
+            if (*f == '\\' && (used = readEscape(f + 1, &escaped, FALSE)) > 0) {    //escape sequence
+                arenaPutWord(&lineArena, &escaped, 1);
+                length++;
+                f += used + 1;
+            } else if (*f == '%' && f[1] == '%') {    //literal percent
+                arenaPutWord(&lineArena, "%", 1);
+                length++;
+                f += 2;
+            } else if (*f == '%') {    //conversion
+                char spec[32];    //conversion copied out for snprintf
+                size_t specLength = strspn(f + 1, "-+ #0123456789.");
+                char conversion = f[1 + specLength];
+                char *arg = next < curCommand->argCount ? curCommand->args[next++] : "";
+                int count;
+
+                if (conversion == '\0' || specLength + 3 > sizeof(spec)) {    //broken conversion, print as is
+                    arenaPutWord(&lineArena, f, strlen(f));
+                    length += strlen(f);
+                    break;
+                }
+                memcpy(spec, f, specLength + 1);
+                if (strchr("diuxXo", conversion) != NULL) {    //integer conversions take a long
+                    spec[specLength + 1] = 'l';
+                    spec[specLength + 2] = conversion;
+                    spec[specLength + 3] = '\0';
+                    long value = strtol(arg, NULL, 0);
+                    count = snprintf(piece, sizeof(piece), spec, value);
+                    arenaPutWord(&lineArena, piece, count < (int)sizeof(piece) ? count : (int)sizeof(piece) - 1);
+                    length += count < (int)sizeof(piece) ? count : sizeof(piece) - 1;
+                } else if (conversion == 'c') {
+                    if (arg[0] != '\0') {
+                        arenaPutWord(&lineArena, arg, 1);
+                        length++;
+                    }
+                } else if (conversion == 's' || conversion == 'b') {
+                    char *text = arg;    //string to print
+                    size_t textLength = strlen(arg);
+                    int stop = FALSE;    //whether a \c ended the output
+
+                    if (conversion == 'b') {    //expand the argument's escapes first
+                        char *a = arg;
+                        text = malloc(textLength + 1);
+                        if (text == NULL) {
+                            dprintf(errorFD, "printf: %s\n", strerror(errno));
+                            return 1;
+                        }
+                        textLength = 0;
+                        while (*a != '\0') {
+                            if (a[0] == '\\' && a[1] == 'c') {
+                                stop = TRUE;
+                                break;
+                            }
+                            if (a[0] == '\\' && (used = readEscape(a + 1, &text[textLength], TRUE)) > 0) {
+                                a += used + 1;
+                            } else {
+                                text[textLength] = *a++;
+                            }
+                            textLength++;
+                        }
+                        text[textLength] = '\0';
+                    }
+                    if (specLength == 0) {    //no padding, the string goes out as it is
+                        arenaPutWord(&lineArena, text, textLength);
+                        length += textLength;
+                    } else {
+                        spec[specLength + 1] = 's';
+                        spec[specLength + 2] = '\0';
+                        count = snprintf(NULL, 0, spec, text);    //strings can be any length
+                        char *padded = malloc(count + 1);
+                        if (padded == NULL) {
+                            dprintf(errorFD, "printf: %s\n", strerror(errno));
+                            if (text != arg) {
+                                free(text);
+                            }
+                            return 1;
+                        }
+                        snprintf(padded, count + 1, spec, text);
+                        arenaPutWord(&lineArena, padded, count);
+                        free(padded);
+                        length += count;
+                    }
+                    if (text != arg) {
+                        free(text);
+                    }
+                    if (stop == TRUE) {    //nothing more is printed, not even the rest of the format
+                        return writeOutput(outputFD, arenaEndWord(&lineArena), length);
+                    }
+                } else {
+                    dprintf(errorFD, "printf: %%%c: invalid conversion\n", conversion);
+                    return 1;
+                }
+                f += specLength + 2;
+            } else {    //plain text up to the next special character
+                size_t plain = strcspn(f, "\\%");
+                if (plain == 0) {
+                    plain = 1;
+                }
+                arenaPutWord(&lineArena, f, plain);
+                length += plain;
+                f += plain;
+            }
+        }
+    } while (next > 2 && next < curCommand->argCount);    //reuse the format for leftover arguments
+
+    return writeOutput(outputFD, arenaEndWord(&lineArena), length);
+}
+
+
+/***********************************************************
+ * readEscape: decodes the backslash escape at the start of
+ * some printf text. octal is written \NNN in a format and
+ * \0NNN in a %b argument.
+ *
+ * parameters: text just past the backslash, where to put the
+ * character, whether the text is a %b argument.
+ * returns: characters used after the backslash, 0 if it
+ * isn't an escape and the backslash is printed as is.
+ ***********************************************************/
+
+size_t readEscape(const char *text, char *escaped, int argument) {
+    const char *digits = argument == TRUE && text[0] == '0' ? text + 1 : text;    //where octal digits start
+    size_t count;
+
+    switch (text[0]) {
+        case 'a': *escaped = '\a'; return 1;
+        case 'b': *escaped = '\b'; return 1;
+        case 'f': *escaped = '\f'; return 1;
+        case 'n': *escaped = '\n'; return 1;
+        case 'r': *escaped = '\r'; return 1;
+        case 't': *escaped = '\t'; return 1;
+        case 'v': *escaped = '\v'; return 1;
+        case '\\': *escaped = '\\'; return 1;
+    }
+    if (digits == text && (text[0] < '0' || text[0] > '7')) {    //not an escape
+        return 0;
+    }
+    int value = 0;    //octal character code
+    for (count = 0; count < 3 && digits[count] >= '0' && digits[count] <= '7'; count++) {
+        value = value * 8 + digits[count] - '0';
+    }
+    *escaped = (char)value;
+    return (digits - text) + count;
+}
+
+
+/***********************************************************
+ * pwdBuiltin: prints the current directory.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int pwdBuiltin(struct command *curCommand, int outputFD) {
+    char *dir = getcwd(NULL, 0);    //current directory
+    if (dir == NULL) {
+        dprintf(errorFD, "pwd: %s\n", strerror(errno));
+        return 1;
+    }
+    dprintf(outputFD, "%s\n", dir);
+    free(dir);
+    return 0;
+}
+
+
+/***********************************************************
+ * sleepBuiltin: waits for a number of seconds, which may
+ * have a fraction. SIGINT ends the wait like it would end a
+ * foreground child.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int sleepBuiltin(struct command *curCommand, int outputFD) {
+    if (curCommand->argCount < 2) {
+        dprintf(errorFD, "sleep: missing operand\n");
+        return 1;
+    }
+
+    char *end;
+    double seconds = strtod(curCommand->args[1], &end);    //time to wait
+    if (*end != '\0' || seconds < 0) {
+        dprintf(errorFD, "sleep: invalid time interval '%s'\n", curCommand->args[1]);
+        return 1;
+    }
+
+    struct timespec wait;    //time left to wait
+    wait.tv_sec = (time_t)seconds;
+    wait.tv_nsec = (long)((seconds - wait.tv_sec) * 1e9);
+    interrupted = FALSE;
+    while (nanosleep(&wait, &wait) == -1 && errno == EINTR) {    //child exits also interrupt, keep going
+        if (interrupted == TRUE) {    //but SIGINT ends it
+            waitedUsage.status = SIGINT;    //report it like a child killed by the signal
+            fprintf(stdout, "terminated by signal %d\n", SIGINT);
+            fflush(stdout);
+            return 128 + SIGINT;
+        }
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * hashBuiltin: with no arguments lists the command table,
+ * with -r empties it, and otherwise looks up and remembers
+ * each named command.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int hashBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+    int status = 0;    //whether every command was found
+
+    if (curCommand->argCount == 1) {    //if just hash, print the table
+        int empty = TRUE;    //whether anything has been printed
+        for (i = 0; i < HASH_BUCKETS; i++) {
+            struct hashEntry *entry;
+            for (entry = commandHash[i]; entry != NULL; entry = entry->next) {
+                if (empty == TRUE) {
+                    dprintf(outputFD, "hits\tcommand\n");    //print heading before first entry
+                    empty = FALSE;
+                }
+                dprintf(outputFD, "%4d\t%s\n", entry->hits, entry->path);
+            }
+        }
+        if (empty == TRUE) {
+            dprintf(outputFD, "hash: hash table empty\n");
+        }
+    } else if (strcmp(curCommand->args[1], "-r") == 0) {    //if hash -r, forget everything
+        clearHash();
+    } else {    //otherwise remember each command given
+        for (i = 1; i < curCommand->argCount; i++) {
+            if (lookupCommand(curCommand->args[i]) == NULL) {
+                dprintf(errorFD, "hash: %s: not found\n", curCommand->args[i]);
+                status = 1;
+            }
+        }
+    }
+    return status;
+}
+
+
+/***********************************************************
+ * decodeStatus: turns a wait status into an exit value.
+ *
+ * parameters: wait status.
+ * returns: exit value, or 128 plus the signal number.
+ ***********************************************************/
+
+int decodeStatus(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+
+/***********************************************************
+ * printUsage: prints the time, memory and page faults a job
+ * used on one line.
+ *
+ * parameters: file descriptor, job usage.
+ * returns: none.
+ ***********************************************************/
+
+void printUsage(int fd, struct jobUsage *job) {
+    struct rusage *usage = &job->usage;
+    dprintf(fd, "real %.3fs user %.3fs sys %.3fs maxrss %ldkB faults %ld minor %ld major\n",
+            job->wall,
+            usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6,
+            usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6,
+            usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt);
+}
+
+
+/***********************************************************
+ * addUsage: adds one process's resource use to a total. the
+ * memory use is the largest of any one process.
+ *
+ * parameters: total, one process's usage.
+ * returns: none.
+ ***********************************************************/
+
+void addUsage(struct rusage *total, struct rusage *usage) {
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss) {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+}
+
+
+/***********************************************************
+ * elapsedSince: measures wall clock time.
+ *
+ * parameters: start time from the monotonic clock.
+ * returns: seconds since then.
+ ***********************************************************/
+
+double elapsedSince(struct timespec *started) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+}
+
+
+/***********************************************************
+ * lookupCommand: finds the file a command name refers to.
+ * names with a slash are used as is. anything else is looked
+ * for in the command table, then searched for on the PATH and
+ * remembered. the table is emptied whenever PATH changes.
+ *
+ * parameters: command name.
+ * returns: path to run, or NULL if not found.
+ ***********************************************************/
+
+char *lookupCommand(char *name) {
+    if (strchr(name, '/') != NULL) {    //if it's already a path, nothing to look up
+        return name;
+    }
+
+    char *path = findVariable("PATH", 4);    //current search path
+    if (path == NULL) {
+        path = DEFAULT_PATH;
+    }
+    if (hashedPath == NULL || strcmp(path, hashedPath) != 0) {    //if PATH changed, old locations are stale
+        clearHash();
+        hashedPath = strdup(path);
+        assert(hashedPath != NULL);    //make sure copy exists
+    }
+
+    unsigned int bucket = hashString(name) % HASH_BUCKETS;    //where the command would be stored
+    struct hashEntry *entry;
+    for (entry = commandHash[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {    //if it's been found before, use that
+            entry->hits++;
+            return entry->path;
+        }
+    }
+
+    size_t nameLength = strlen(name);
+    char *dir = path;    //start of the current PATH directory
+    while (1) {    //try each directory in turn
+        char *colon = strchr(dir, ':');    //end of the current directory
+        size_t dirLength = colon != NULL ? (size_t)(colon - dir) : strlen(dir);
+        char *candidate = malloc(dirLength + nameLength + 3);    //directory, slash, name, terminator
+        assert(candidate != NULL);    //make sure string exists
+
+        if (dirLength == 0) {    //empty entry means the current directory
+            candidate[0] = '.';
+            dirLength = 1;
+        } else {
+            memcpy(candidate, dir, dirLength);
+        }
+        candidate[dirLength] = '/';
+        memcpy(candidate + dirLength + 1, name, nameLength + 1);
+
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0) {
+            entry = malloc(sizeof(struct hashEntry));    //remember where it was found
+            assert(entry != NULL);    //make sure struct exists
+            entry->name = strdup(name);
+            assert(entry->name != NULL);
+            entry->path = candidate;
+            entry->hits = 1;
+            entry->next = commandHash[bucket];
+            commandHash[bucket] = entry;
+            return candidate;
+        }
+        free(candidate);
+
+        if (colon == NULL) {    //no directories left
+            return NULL;
+        }
+        dir = colon + 1;
+    }
+}
+
+
+/***********************************************************
+ * forgetCommand: removes a command from the command table so
+ * the next lookup searches the PATH again.
+ *
+ * parameters: command name.
+ * returns: none.
+ ***********************************************************/
+
+void forgetCommand(char *name) {
+    struct hashEntry **link = &commandHash[hashString(name) % HASH_BUCKETS];
+
+    while (*link != NULL) {
+        struct hashEntry *entry = *link;
+        if (strcmp(entry->name, name) == 0) {    //if found, unlink and free it
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+
+/***********************************************************
+ * clearHash: empties the command table.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void clearHash() {
+    int i;
+    for (i = 0; i < HASH_BUCKETS; i++) {
+        while (commandHash[i] != NULL) {    //free every entry in the bucket
+            struct hashEntry *entry = commandHash[i];
+            commandHash[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
+
+/***********************************************************
+ * hashString: FNV-1a hash of a string.
+ *
+ * parameters: string.
+ * returns: hash value.
+ ***********************************************************/
+
+unsigned int hashString(const char *string) {
+    unsigned int hash = 2166136261u;    //FNV offset basis
+    while (*string != '\0') {
+        hash ^= (unsigned char)*string++;
+        hash *= 16777619u;    //FNV prime
+    }
+    return hash;
+}
+
+
+/***********************************************************
+ * runCommand: spawns a child process to run a command. the
+ * redirection files are opened here so errors can be
+ * reported, then handed to the child as spawn file actions.
+ * a foreground cat of plain files is copied by the shell
+ * itself instead.
+ *
+ * parameters: command struct.
+ * returns: exit status int.
+ ***********************************************************/
+
+int runCommand(struct command *curCommand) {
+    int fds[3] = { -1, -1, -1 };    //stdin, stdout and stderr for the child, -1 to inherit
+
+    if (curCommand->background == TRUE) {    //background processes use the null device
+        fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        fds[1] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+        if (fds[0] == -1 || fds[1] == -1) {    //if it can't open
+            printf("error: cannot complete command\n");    //print error message
+            fflush(stdout);
+            closeRedirections(fds);
+            return 1;    //exit with status 1
+        }
+    }
+    if (openRedirections(curCommand, fds) == FALSE) {    //open any files named on the command line
+        closeRedirections(fds);
+        return 1;    //exit with status 1
+    }
+
+    if (curCommand->background == FALSE && canCatThrough(curCommand, fds[0]) == TRUE) {    //copy in the shell
+        int status = catThrough(curCommand, fds[0], fds[1]);
+        closeRedirections(fds);
+        return status;
+    }
+
+    pid_t spawnpid = spawnCommand(curCommand->args, fds, 0);    //start the child in a process group of its own
+    closeRedirections(fds);    //child has its own copies now
+    if (spawnpid == -1) {    //if the command couldn't be started
+        return 1;    //exit with status 1
+    }
+
+    if (curCommand->background == TRUE) {    //if child is a background process
+        saveProcess(&spawnpid, 1, curCommand);    //save the child's PID to array of background PIDs
+        profile.background++;
+        fprintf(stdout, "background pid is %d\n", spawnpid);    //print that the process has begun executing and PID
+        fflush(stdout);   //flush output
+        return 0;
+    }
+
+    int status = waitForeground(spawnpid, spawnpid);    //wait for child to end before the shell resumes
+
+    if (WIFSIGNALED(status)) {    //if it was killed, say so
+        fprintf(stdout, "terminated by signal %d\n", WTERMSIG(status));
+        fflush(stdout);
+    }
+    return decodeStatus(status);    //return the child's exit status
+}
+
+
+/***********************************************************
+ * openRedirections: opens the files a command redirects to,
+ * replacing whatever descriptors were there (pipe ends or the
+ * null device). error output can follow standard output.
+ *
+ * parameters: command struct, stdin/stdout/stderr fds.
+ * returns: TRUE if everything opened, FALSE otherwise.
+ ***********************************************************/
+
+int openRedirections(struct command *curCommand, int fds[3]) {
+    unsigned long long started = profileStart();
+
+    if (curCommand->inputFile != NULL) {    //if there's input redirection
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+        fds[0] = open(curCommand->inputFile, O_RDONLY | O_CLOEXEC);    //open an existing file to serve as stdin
+        if (fds[0] == -1) {    //if it can't open
+            printf("cannot open %s for input\n", curCommand->inputFile);    //print error message
+            fflush(stdout);
+            profileEnd(PHASE_REDIRECT, started);
+            return FALSE;
+        }
+    }
+
+    if (curCommand->outputFile != NULL) {    //if there's output redirection
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (curCommand->appendOutput == TRUE ? O_APPEND : O_TRUNC);
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        //open an existing file, truncate or append to it, or create a new one to serve as stdout
+        fds[1] = open(curCommand->outputFile, flags, 0777);
+        if (fds[1] == -1) {    //if it can't open
+            printf("cannot open %s for output\n", curCommand->outputFile);    //print error message
+            fflush(stdout);
+            profileEnd(PHASE_REDIRECT, started);
+            return FALSE;
+        }
+    }
+
+    if (curCommand->errorToOutput == TRUE) {    //if error output goes with output
+        fds[2] = ERROR_TO_OUTPUT;
+    } else if (curCommand->errorFile != NULL) {    //if there's error output redirection
+        fds[2] = open(curCommand->errorFile, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0777);
+        if (fds[2] == -1) {    //if it can't open
+            printf("cannot open %s for output\n", curCommand->errorFile);    //print error message
+            fflush(stdout);
+            profileEnd(PHASE_REDIRECT, started);
+            return FALSE;
+        }
+    }
+    profileEnd(PHASE_REDIRECT, started);
+    return TRUE;
+}
+
+
+/***********************************************************
+ * closeRedirections: closes the shell's copies of a child's
+ * descriptors.
+ *
+ * parameters: stdin/stdout/stderr fds.
+ * returns: none.
+ ***********************************************************/
+
+void closeRedirections(int fds[3]) {
+    int i;
+    for (i = 0; i < 3; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+        fds[i] = -1;
+    }
+}
+
+
+/***********************************************************
+ * canCatThrough: decides if a command is a plain cat the
+ * shell can do itself: no options, standard error left
+ * alone, and no reading from a terminal, which the shell
+ * couldn't interrupt.
+ *
+ * parameters: command struct, stdin fd or -1 to inherit.
+ * returns: TRUE if the shell can copy it in-process.
+ ***********************************************************/
+
+int canCatThrough(struct command *curCommand, int inputFD) {
+    int i;
+
+    if (strcmp(curCommand->args[0], "cat") != 0 || curCommand->errorFile != NULL || curCommand->errorToOutput == TRUE) {
+        return FALSE;
+    }
+    for (i = 1; i < curCommand->argCount; i++) {
+        if (curCommand->args[i][0] == '-') {    //options, or - for stdin, go to the real cat
+            return FALSE;
+        }
+    }
+    if (curCommand->argCount == 1 && isatty(inputFD >= 0 ? inputFD : STDIN_FILENO)) {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+
+/***********************************************************
+ * catThrough: does the work of cat inside the shell, copying
+ * each file (or stdin when none are named) to the output.
+ *
+ * parameters: command struct, input fd, output fd (-1 means
+ * the shell's own).
+ * returns: exit status int, 1 if any file couldn't be read.
+ ***********************************************************/
+
+int catThrough(struct command *curCommand, int inputFD, int outputFD) {
+    int i;
+    int status = 0;    //exit status like cat's
+
+    if (inputFD < 0) {
+        inputFD = STDIN_FILENO;
+    }
+    if (outputFD < 0) {
+        outputFD = STDOUT_FILENO;
+    }
+    fflush(stdout);    //keep shell output ahead of the copy
+
+    if (curCommand->argCount == 1) {    //no files, copy stdin
+        return copyThrough(inputFD, outputFD) == 0 ? 0 : 1;
+    }
+    for (i = 1; i < curCommand->argCount; i++) {    //copy each file in order
+        int fileFD = open(curCommand->args[i], O_RDONLY | O_CLOEXEC);
+        if (fileFD == -1) {    //if it can't open
+            fprintf(stderr, "cat: %s: %s\n", curCommand->args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        int result = copyThrough(fileFD, outputFD);
+        close(fileFD);
+        if (result == EPIPE) {    //nobody is reading anymore
+            return 1;
+        }
+        if (result != 0) {
+            fprintf(stderr, "cat: %s: %s\n", curCommand->args[i], strerror(result));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+
+/***********************************************************
+ * copyThrough: copies everything from one descriptor to
+ * another without passing the bytes through user space when
+ * the kernel allows it: copy_file_range between files,
+ * splice when either end is a pipe, sendfile from a file,
+ * and plain read and write otherwise.
+ *
+ * parameters: input fd, output fd.
+ * returns: 0 on success, otherwise an errno value.
+ ***********************************************************/
+
+int copyThrough(int inputFD, int outputFD) {
+    struct stat inInfo;    //file information for each end
+    struct stat outInfo;
+    ssize_t count;
+
+    if (fstat(inputFD, &inInfo) == -1 || fstat(outputFD, &outInfo) == -1) {
+        return errno;
+    }
+    int outAppends = (fcntl(outputFD, F_GETFL) & O_APPEND) != 0;    //copy_file_range won't append
+
+    if (S_ISREG(inInfo.st_mode) && S_ISREG(outInfo.st_mode) && outAppends == FALSE) {    //file to file
+        while ((count = copy_file_range(inputFD, NULL, outputFD, NULL, COPY_CHUNK, 0)) > 0) {
+        }
+        if (count == 0) {
+            return 0;
+        }
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) {
+            return errno;
+        }
+    }
+    if (S_ISFIFO(inInfo.st_mode) || S_ISFIFO(outInfo.st_mode)) {    //pipe at either end
+        while ((count = splice(inputFD, NULL, outputFD, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+        }
+        if (count == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return errno;
+        }
+    }
+    if (S_ISREG(inInfo.st_mode)) {    //file to anything
+        while ((count = sendfile(outputFD, inputFD, NULL, COPY_CHUNK)) > 0) {
+        }
+        if (count == 0) {
+            return 0;
+        }
+        if (errno != EINVAL && errno != ENOSYS) {
+            return errno;
+        }
+    }
+
+    char buffer[INPUT_BLOCK];    //last resort, copy through the shell
+    while ((count = read(inputFD, buffer, sizeof(buffer))) != 0) {
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        char *next = buffer;
+        while (count > 0) {    //write all of what was read
+            ssize_t written = write(outputFD, next, count);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return errno;
+            }
+            next += written;
+            count -= written;
+        }
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * spawnCommand: starts a child running a command without
+ * waiting for it. the given file descriptors, if not -1,
+ * become the child's stdin, stdout and stderr, and stderr can
+ * also be ERROR_TO_OUTPUT. a group of 0 puts the child in a
+ * new process group of its own, a positive group adds it to
+ * that group, and -1 leaves it in the shell's.
+ *
+ * parameters: argument array, stdin/stdout/stderr fds, group.
+ * returns: child PID, or -1 if it couldn't be started.
+ ***********************************************************/
+
+pid_t spawnCommand(char **args, int fds[3], pid_t group) {
+    unsigned long long started = profileStart();
+    posix_spawn_file_actions_t actions;    //redirections performed in the child
+    posix_spawn_file_actions_init(&actions);
+    if (fds[0] >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);    //copy file descriptor to stdin
+    }
+    if (fds[1] >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);    //copy file descriptor to stdout
+    }
+    if (fds[2] == ERROR_TO_OUTPUT) {
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);    //stderr follows stdout
+    } else if (fds[2] >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, fds[2], STDERR_FILENO);    //copy file descriptor to stderr
+    }
+
+    posix_spawnattr_t attributes;    //signal and group setup for the child
+    sigset_t noSignals;    //child starts with nothing blocked
+    sigset_t defaults;    //signals the shell ignores but the child shouldn't
+    short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+    sigemptyset(&noSignals);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &noSignals);
+    posix_spawnattr_setsigdefault(&attributes, &defaults);
+    if (group != -1) {    //if the child belongs in a process group
+        posix_spawnattr_setpgroup(&attributes, group);
+        flags |= POSIX_SPAWN_SETPGROUP;
+    }
+    posix_spawnattr_setflags(&attributes, flags);
+
+    fflush(stdout);    //keep shell output ahead of the child's
+    pid_t spawnpid;    //PID of the new child
+    int error = ENOENT;    //result of starting the child
+    char *path = lookupCommand(args[0]);    //where the command lives
+    if (placement.active == TRUE) {    //the child starts wherever the shell is
+        enterPlacement();
+    }
+    if (path != NULL) {
+        error = launchCommand(&spawnpid, path, args, fds, group, &actions, &attributes);
+        if (error == ENOENT && path != args[0] && placement.joinFailed == FALSE) {    //if it moved since it was found, look again
+            forgetCommand(args[0]);
+            path = lookupCommand(args[0]);
+            if (path != NULL) {
+                error = launchCommand(&spawnpid, path, args, fds, group, &actions, &attributes);
+            }
+        }
+    }
+    if (placement.active == TRUE) {
+        leavePlacement();
+    }
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+
+    if (error != 0) {    //if the command couldn't be started
+        if (placement.joinFailed == TRUE) {    //placeSpawn has said why
+            placement.joinFailed = FALSE;
+        } else if (error == ENOENT) {
+            printf("%s: no such file or directory\n", args[0]);    //print error message if not a file
+        } else {
+            printf("%s: %s\n", args[0], strerror(error));
+        }
+        fflush(stdout);
+        profileEnd(PHASE_SPAWN, started);
+        return -1;
+    }
+    profile.spawns++;
+    profileEnd(PHASE_SPAWN, started);
+    return spawnpid;
+}
+
+
+/***********************************************************
+ * launchCommand: starts a child with the zygote if there is
+ * one, or with posix_spawn from the shell itself. a request
+ * the zygote can't take falls back to posix_spawn, and a
+ * child that goes in a cgroup is started by placeSpawn.
+ *
+ * parameters: PID result, program path, argument array,
+ * stdin/stdout/stderr fds, group, spawn actions and
+ * attributes for posix_spawn.
+ * returns: 0, or an errno value if it couldn't be started.
+ ***********************************************************/
+
+int launchCommand(pid_t *spawnpid, char *path, char **args, int fds[3], pid_t group,
+                  posix_spawn_file_actions_t *actions, posix_spawnattr_t *attributes) {
+    if (zygote.fd != -1 && placement.active == FALSE) {    //placed children inherit from the shell itself
+        int error = zygoteSpawn(spawnpid, path, args, fds, group);
+        if (error != -1) {    //the zygote handled it
+            return error;
+        }
+    }
+    if (placement.active == TRUE && placement.leaf != NULL) {
+        return placeSpawn(spawnpid, path, args, fds, group);
+    }
+    return posix_spawn(spawnpid, path, actions, attributes, args, currentEnvironment());
+}
+
+
+/***********************************************************
+ * startPlacement: handles a line starting with place, which
+ * decides where the children it starts run:
+ *     -c LIST    only on these CPUs, like 0-3,8
+ *     -s         each child on the next of them, by itself
+ *     -n NODE    on the CPUs and memory of one NUMA node
+ *     -m SIZE    in a cgroup with memory.max SIZE (K, M, G)
+ *     -q PERCENT in a cgroup with cpu.max PERCENT of a CPU
+ *     -w WEIGHT  in a cgroup with cpu.weight WEIGHT
+ * the cgroup is a new cgroup v2 leaf under $SMALLSH_CGROUP,
+ * made for the line and removed once its job is done. that
+ * has to be a cgroup delegated to the user that the shell
+ * isn't in, since a cgroup with processes of its own can't
+ * enable controllers for its children. place and its options
+ * are taken off the line, which then runs as usual.
+ *
+ * parameters: command struct, place first.
+ * returns: TRUE, or FALSE after printing why it can't be done.
+ ***********************************************************/
+
+int startPlacement(struct command *curCommand) {
+    int used = 1;    //arguments taken by place
+    char *end;
+
+    memset(&placement, 0, sizeof(placement));
+    placement.node = -1;
+    while (used < curCommand->argCount && curCommand->args[used][0] == '-' && curCommand->args[used][1] != '\0'
+           && curCommand->args[used][2] == '\0') {
+        char option = curCommand->args[used][1];
+        char *value = used + 1 < curCommand->argCount ? curCommand->args[used + 1] : NULL;
+        if (option == 's') {
+            placement.spread = TRUE;
+            used++;
+            continue;
+        }
+        if (value == NULL) {
+            fprintf(stderr, "place: -%c needs a value\n", option);
+            return FALSE;
+        }
+        if (option == 'c') {
+            if (parseCPUList(value, &placement.cpus) == FALSE) {
+                fprintf(stderr, "place: %s: not a CPU list\n", value);
+                return FALSE;
+            }
+            placement.hasCPUs = TRUE;
+        } else if (option == 'n') {
+            char path[64];
+            char list[1024];
+            placement.node = strtol(value, &end, 10);
+            snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", placement.node);
+            int fd = open(path, O_RDONLY | O_CLOEXEC);
+            ssize_t count = fd == -1 ? -1 : read(fd, list, sizeof(list) - 1);
+            if (fd != -1) {
+                close(fd);
+            }
+            if (*end != '\0' || placement.node < 0 || count <= 0) {
+                fprintf(stderr, "place: %s: no such NUMA node\n", value);
+                return FALSE;
+            }
+            list[count] = '\0';
+            list[strcspn(list, "\n")] = '\0';
+            cpu_set_t nodeCPUs;
+            if (parseCPUList(list, &nodeCPUs) == FALSE) {
+                fprintf(stderr, "place: node %d has no CPUs\n", placement.node);
+                return FALSE;
+            }
+            if (placement.hasCPUs == TRUE) {    //both given, the CPUs of the list on that node
+                CPU_AND(&placement.cpus, &placement.cpus, &nodeCPUs);
+            } else {
+                placement.cpus = nodeCPUs;
+            }
+            placement.hasCPUs = TRUE;
+        } else if (option == 'm') {
+            placement.memoryMax = strtoll(value, &end, 10);
+            switch (*end) {
+                case 'G': case 'g': placement.memoryMax <<= 10;    //fall through
+                case 'M': case 'm': placement.memoryMax <<= 10;    //fall through
+                case 'K': case 'k': placement.memoryMax <<= 10; end++; break;
+            }
+            if (*end != '\0' || placement.memoryMax <= 0) {
+                fprintf(stderr, "place: %s: not a size\n", value);
+                return FALSE;
+            }
+        } else if (option == 'q') {
+            placement.cpuQuota = strtol(value, &end, 10);
+            if (*end != '\0' || placement.cpuQuota <= 0) {
+                fprintf(stderr, "place: %s: not a percentage\n", value);
+                return FALSE;
+            }
+        } else if (option == 'w') {
+            placement.cpuWeight = strtol(value, &end, 10);
+            if (*end != '\0' || placement.cpuWeight < 1 || placement.cpuWeight > 10000) {
+                fprintf(stderr, "place: %s: weight must be 1 to 10000\n", value);
+                return FALSE;
+            }
+        } else {
+            fprintf(stderr, "place: -%c: invalid option\n", option);
+            return FALSE;
+        }
+        used += 2;
+    }
+    if (used == curCommand->argCount) {
+        fprintf(stderr, "usage: place [-c cpus] [-s] [-n node] [-m size] [-q percent] [-w weight] command\n");
+        return FALSE;
+    }
+    if (placement.hasCPUs == TRUE) {    //only the CPUs the shell may use itself
+        cpu_set_t allowed;
+        sched_getaffinity(0, sizeof(allowed), &allowed);
+        CPU_AND(&placement.cpus, &placement.cpus, &allowed);
+        if (CPU_COUNT(&placement.cpus) == 0) {
+            fprintf(stderr, "place: no CPUs left to run on\n");
+            return FALSE;
+        }
+    }
+
+    if (placement.memoryMax > 0 || placement.cpuQuota > 0 || placement.cpuWeight > 0) {    //limits need a cgroup
+        char value[64];
+        if (homeCgroup == NULL) {    //find the shell's own, 0::/path in cgroup v2
+            char line[4096];
+            FILE *file = fopen("/proc/self/cgroup", "re");
+            while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+                if (strncmp(line, "0::", 3) == 0) {
+                    line[strcspn(line, "\n")] = '\0';
+                    homeCgroup = malloc(strlen(CGROUP_ROOT) + strlen(line));
+                    assert(homeCgroup != NULL);
+                    sprintf(homeCgroup, "%s%s", CGROUP_ROOT, strcmp(line + 3, "/") == 0 ? "" : line + 3);
+                }
+            }
+            if (file != NULL) {
+                fclose(file);
+            }
+            if (homeCgroup == NULL) {
+                fprintf(stderr, "place: cgroup v2 isn't mounted\n");
+                return FALSE;
+            }
+        }
+        char *parent = findVariable("SMALLSH_CGROUP", 14);
+        if (parent == NULL || parent[0] == '\0' || (strcmp(parent, homeCgroup) == 0 && strcmp(parent, CGROUP_ROOT) != 0)) {
+            fprintf(stderr, "place: limits need SMALLSH_CGROUP set to a delegated cgroup v2 directory the shell isn't in\n");
+            return FALSE;
+        }
+        char procs[PATH_MAX];
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", parent);
+        if (access(procs, F_OK) == -1) {
+            fprintf(stderr, "place: %s isn't a cgroup v2 directory\n", parent);
+            return FALSE;
+        }
+        writeCgroup(parent, "cgroup.subtree_control", "+cpu +memory");    //may already be on, or delegated as is
+
+        placement.leaf = malloc(strlen(parent) + 64);
+        assert(placement.leaf != NULL);
+        sprintf(placement.leaf, "%s/smallsh-%s-%d", parent, pidString, ++leafCount);
+        if (mkdir(placement.leaf, 0755) == -1) {
+            fprintf(stderr, "place: %s: %s\n", placement.leaf, strerror(errno));
+            free(placement.leaf);
+            placement.leaf = NULL;
+            return FALSE;
+        }
+        int ok = TRUE;
+        if (placement.memoryMax > 0) {
+            snprintf(value, sizeof(value), "%lld", placement.memoryMax);
+            ok = writeCgroup(placement.leaf, "memory.max", value);
+        }
+        if (ok == TRUE && placement.cpuQuota > 0) {
+            snprintf(value, sizeof(value), "%d %d", placement.cpuQuota * (CPU_PERIOD / 100), CPU_PERIOD);
+            ok = writeCgroup(placement.leaf, "cpu.max", value);
+        }
+        if (ok == TRUE && placement.cpuWeight > 0) {
+            snprintf(value, sizeof(value), "%d", placement.cpuWeight);
+            ok = writeCgroup(placement.leaf, "cpu.weight", value);
+        }
+        if (ok == FALSE) {
+            endPlacement();
+            return FALSE;
+        }
+    }
+
+    curCommand->args += used;    //the rest runs as if place weren't there
+    curCommand->argCount -= used;
+    placement.active = TRUE;
+    return TRUE;
+}
+
+
+/***********************************************************
+ * endPlacement: finishes a placed line. its cgroup is
+ * removed unless a background job took it.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void endPlacement() {
+    if (placement.leaf != NULL) {
+        rmdir(placement.leaf);
+        free(placement.leaf);
+        placement.leaf = NULL;
+    }
+    placement.active = FALSE;
+}
+
+
+/***********************************************************
+ * enterPlacement: moves the shell onto the placement's CPUs
+ * and NUMA node just before a child is started, so the child
+ * has them from its first instruction. posix_spawn can't set
+ * either itself. the shell stays in its own cgroup; the child
+ * moves itself into the line's in placeSpawn.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void enterPlacement() {
+    sched_getaffinity(0, sizeof(placement.saved), &placement.saved);
+    if (placement.hasCPUs == TRUE && placement.spread == TRUE) {    //the next CPU of the set to itself
+        cpu_set_t one;
+        int cpu = placement.nextCPU;
+        while (CPU_ISSET(cpu % CPU_SETSIZE, &placement.cpus) == 0) {
+            cpu++;
+        }
+        cpu %= CPU_SETSIZE;
+        placement.nextCPU = cpu + 1;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        sched_setaffinity(0, sizeof(one), &one);
+    } else if (placement.hasCPUs == TRUE) {
+        sched_setaffinity(0, sizeof(placement.cpus), &placement.cpus);
+    }
+    if (placement.node >= 0) {    //memory from that node only
+        unsigned long nodes[16] = { 0 };
+        nodes[placement.node / (8 * sizeof(long)) % 16] |= 1UL << (placement.node % (8 * sizeof(long)));
+        syscall(SYS_set_mempolicy, MPOL_BIND, nodes, sizeof(nodes) * 8);
+    }
+}
+
+
+/***********************************************************
+ * leavePlacement: moves the shell back after a placed child
+ * has started.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void leavePlacement() {
+    if (placement.node >= 0) {
+        syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+    if (placement.hasCPUs == TRUE) {
+        sched_setaffinity(0, sizeof(placement.saved), &placement.saved);
+    }
+}
+
+
+/***********************************************************
+ * placeSpawn: starts a child that writes itself into the
+ * line's cgroup.procs before it execs, so the command and
+ * everything it starts are inside the limits from its first
+ * instruction. only the child moves, so the shell never has
+ * to get back out. posix_spawn can't do that step, so the
+ * child is forked and set up the way posix_spawn would.
+ *
+ * parameters: PID result, program path, argument array,
+ * stdin/stdout/stderr fds, group.
+ * returns: 0, or an errno value if the child couldn't join
+ * the cgroup, which is reported here, or couldn't exec.
+ ***********************************************************/
+
+int placeSpawn(pid_t *spawnpid, char *path, char **args, int fds[3], pid_t group) {
+    int report[2];    //whether joining the cgroup failed, and the errno
+    int errorPipe[2];    //child reports a failure here
+    char procs[PATH_MAX];    //cgroup.procs of the leaf
+    char **environment = currentEnvironment();    //built before the fork, it may allocate
+
+    snprintf(procs, sizeof(procs), "%s/cgroup.procs", placement.leaf);
+    if (pipe2(errorPipe, O_CLOEXEC) == -1) {
+        return errno;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        int error = errno;
+        close(errorPipe[0]);
+        close(errorPipe[1]);
+        return error;
+    }
+    if (pid == 0) {
+        sigset_t noSignals;    //child starts with nothing blocked
+        int fd = open(procs, O_WRONLY | O_CLOEXEC);
+        report[0] = TRUE;
+        if (fd == -1 || write(fd, "0", 1) == -1) {    //0 is whoever writes it
+            report[1] = errno;
+            write(errorPipe[1], report, sizeof(report));
+            _exit(127);
+        }
+        close(fd);
+        if (group != -1) {    //if the child belongs in a process group
+            setpgid(0, group);
+        }
+        if (fds[0] >= 0) {
+            dup2(fds[0], STDIN_FILENO);
+        }
+        if (fds[1] >= 0) {
+            dup2(fds[1], STDOUT_FILENO);
+        }
+        if (fds[2] == ERROR_TO_OUTPUT) {
+            dup2(STDOUT_FILENO, STDERR_FILENO);
+        } else if (fds[2] >= 0) {
+            dup2(fds[2], STDERR_FILENO);
+        }
+        signal(SIGTTOU, SIG_DFL);
+        signal(SIGPIPE, SIG_DFL);
+        sigemptyset(&noSignals);
+        sigprocmask(SIG_SETMASK, &noSignals, NULL);
+
+        execve(path, args, environment);
+        report[0] = FALSE;
+        report[1] = errno;
+        write(errorPipe[1], report, sizeof(report));
+        _exit(127);
+    }
+
+    ssize_t got;
+    close(errorPipe[1]);
+    while ((got = read(errorPipe[0], report, sizeof(report))) == -1 && errno == EINTR) {
+    }
+    close(errorPipe[0]);
+    if (got != sizeof(report)) {    //the pipe closed on exec
+        *spawnpid = pid;
+        return 0;
+    }
+    while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {    //nothing ran, nothing to report later
+    }
+    if (report[0] == TRUE) {
+        fprintf(stderr, "place: %s: %s\n", procs, strerror(report[1]));
+        placement.joinFailed = TRUE;
+    }
+    return report[1];
+}
+
+
+/***********************************************************
+ * parseCPUList: reads a list of CPUs and ranges, like
+ * 0-3,8,10-11, as used by taskset and the kernel.
+ *
+ * parameters: list, set to fill in.
+ * returns: TRUE, or FALSE if it isn't a list.
+ ***********************************************************/
+
+int parseCPUList(char *text, cpu_set_t *cpus) {
+    char *pos = text;
+
+    CPU_ZERO(cpus);
+    while (*pos != '\0') {
+        char *end;
+        long first = strtol(pos, &end, 10);
+        long last = first;
+        if (end == pos) {
+            return FALSE;
+        }
+        pos = end;
+        if (*pos == '-') {
+            last = strtol(pos + 1, &end, 10);
+            if (end == pos + 1) {
+                return FALSE;
+            }
+            pos = end;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return FALSE;
+        }
+        for (; first <= last; first++) {
+            CPU_SET(first, cpus);
+        }
+        if (*pos == ',') {
+            pos++;
+        } else if (*pos != '\0') {
+            return FALSE;
+        }
+    }
+    return CPU_COUNT(cpus) > 0;
+}
+
+
+/***********************************************************
+ * writeCgroup: writes a value to a cgroup's control file.
+ *
+ * parameters: cgroup directory, file name, value.
+ * returns: TRUE, or FALSE after printing the error.
+ ***********************************************************/
+
+int writeCgroup(char *dir, char *file, char *value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, value, strlen(value)) == -1) {
+        if (strcmp(file, "cgroup.subtree_control") != 0) {    //that one is only a best effort
+            fprintf(stderr, "place: %s: %s\n", path, strerror(errno));
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        return FALSE;
+    }
+    close(fd);
+    return TRUE;
+}
+
+
+/***********************************************************
+ * startZygote: forks the zygote, a helper that starts
+ * children on the shell's behalf. it's forked before the
+ * shell grows, so starting a child from it stays cheap no
+ * matter how much memory the shell uses later. children are
+ * created with CLONE_PARENT, which makes them the shell's
+ * own, so the shell waits for them, gets their rusage and
+ * SIGCHLD, and does job control exactly as if it had
+ * spawned them. if the zygote can't be started the shell
+ * spawns children itself.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void startZygote() {
+    int sockets[2];    //shell's end, zygote's end
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1) {
+        perror("zygote");
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("zygote");
+        close(sockets[0]);
+        close(sockets[1]);
+        return;
+    }
+    if (pid == 0) {    //zygote serves requests until the shell goes away
+        close(sockets[0]);
+        runZygote(sockets[1]);
+    }
+    close(sockets[1]);
+    zygote.fd = sockets[0];
+    zygote.cwdFD = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+
+/***********************************************************
+ * runZygote: the zygote's loop. each request carries the
+ * path and arguments, and the environment when it has
+ * changed, with stdin, stdout, stderr and the working
+ * directory passed as descriptors. the reply is sent
+ * once the child has run exec, or with the errno if it
+ * couldn't.
+ *
+ * parameters: zygote's socket.
+ * returns: does not return, exits when the shell closes its
+ * end.
+ ***********************************************************/
+
+void runZygote(int socketFD) {
+    signal(SIGINT, SIG_IGN);    //the shell forwards signals to children itself
+    signal(SIGTSTP, SIG_IGN);
+
+    while (1) {
+        struct zygoteRequest request;
+        char control[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];    //descriptors that came with it
+        struct iovec parts[2] = {
+            { &request, sizeof(request) },
+            { zygote.buffer, ZYGOTE_MAX }
+        };
+        struct msghdr message = { NULL, 0, parts, 2, control, sizeof(control), 0 };
+        ssize_t received = recvmsg(socketFD, &message, MSG_CMSG_CLOEXEC);
+        if (received == -1 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {    //shell is gone
+            _exit(EXIT_SUCCESS);
+        }
+
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        int fds[ZYGOTE_FDS];
+        if (received != (ssize_t)sizeof(request) + request.length || header == NULL || header->cmsg_type != SCM_RIGHTS
+            || header->cmsg_len != CMSG_LEN(ZYGOTE_FDS * sizeof(int))) {    //shell always sends all of them
+            _exit(EXIT_FAILURE);
+        }
+        memcpy(fds, CMSG_DATA(header), sizeof(fds));
+
+        char *args[request.argCount + 2];    //path, then arguments, then NULL
+        char *next = zygote.buffer;
+        int i;
+        for (i = 0; i <= request.argCount; i++) {    //split the strings back apart
+            args[i] = next;
+            next += strlen(next) + 1;
+        }
+        args[i] = NULL;
+        if (request.environmentCount != 0) {    //new environment, keep a copy for later children
+            int count = request.environmentCount == -1 ? 0 : request.environmentCount;
+            size_t size = zygote.buffer + request.length - next;
+            free(zygote.environment);
+            free(zygote.environmentText);
+            zygote.environmentText = malloc(size + 1);
+            zygote.environment = malloc((count + 1) * sizeof(char *));
+            assert(zygote.environmentText != NULL && zygote.environment != NULL);
+            memcpy(zygote.environmentText, next, size);
+            next = zygote.environmentText;
+            for (i = 0; i < count; i++) {
+                zygote.environment[i] = next;
+                next += strlen(next) + 1;
+            }
+            zygote.environment[i] = NULL;
+        }
+
+        struct zygoteReply reply = { -1, 0 };
+        int errorPipe[2];    //child writes its errno here if exec fails
+        if (pipe2(errorPipe, O_CLOEXEC) == -1) {
+            reply.error = errno;
+        } else {
+            pid_t pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);    //child belongs to the shell
+            if (pid == 0) {
+                close(errorPipe[0]);
+                zygoteChild(&request, args + 1, fds, errorPipe[1]);
+            }
+            close(errorPipe[1]);
+            if (pid == -1) {
+                reply.error = errno;
+            } else {
+                int error;
+                ssize_t got;
+                while ((got = read(errorPipe[0], &error, sizeof(error))) == -1 && errno == EINTR) {
+                }
+                reply.pid = pid;
+                if (got == sizeof(error)) {    //exec failed, the shell reaps what's left
+                    reply.pid = -1;
+                    reply.error = error;
+                }
+            }
+            close(errorPipe[0]);
+        }
+        for (i = 0; i < ZYGOTE_FDS; i++) {
+            close(fds[i]);
+        }
+        while (send(socketFD, &reply, sizeof(reply), MSG_NOSIGNAL) == -1 && errno == EINTR) {
+        }
+    }
+}
+
+
+/***********************************************************
+ * zygoteChild: sets up a child of the zygote the way
+ * posix_spawn would and runs the command.
+ *
+ * parameters: request, argument array with the path before
+ * it, stdin/stdout/stderr/directory fds, pipe to report an
+ * exec failure on.
+ * returns: does not return.
+ ***********************************************************/
+
+void zygoteChild(struct zygoteRequest *request, char **args, int *fds, int errorFD) {
+    int i;
+    sigset_t noSignals;    //child starts with nothing blocked
+    int defaults[] = { SIGINT, SIGTSTP, SIGTTOU, SIGPIPE };    //signals the zygote ignores but the child shouldn't
+
+    if (request->group != -1) {    //if the child belongs in a process group
+        setpgid(0, request->group);
+    }
+    for (i = 0; i < 3; i++) {
+        dup2(fds[i], i);    //copy file descriptors to stdin, stdout and stderr
+    }
+    if (fchdir(fds[3]) == -1) {
+        _exit(127);
+    }
+    for (i = 0; i < (int)(sizeof(defaults) / sizeof(defaults[0])); i++) {
+        signal(defaults[i], SIG_DFL);
+    }
+    sigemptyset(&noSignals);
+    sigprocmask(SIG_SETMASK, &noSignals, NULL);
+
+    execve(args[-1], args, zygote.environment != NULL ? zygote.environment : environ);
+    int error = errno;
+    write(errorFD, &error, sizeof(error));    //the zygote reports it
+    _exit(127);
+}
+
+
+/***********************************************************
+ * zygoteSpawn: asks the zygote to start a child. if the
+ * zygote has died the shell stops using it.
+ *
+ * parameters: PID result, program path, argument array,
+ * stdin/stdout/stderr fds, group.
+ * returns: 0, an errno value if the child couldn't be
+ * started, or -1 if the zygote can't take the request.
+ ***********************************************************/
+
+int zygoteSpawn(pid_t *spawnpid, char *path, char **args, int fds[3], pid_t group) {
+    int i;
+    struct zygoteRequest request = { group, 0, 0, 0 };
+    int sent[ZYGOTE_FDS];    //descriptors the child gets
+
+    size_t length = strlen(path) + 1;
+    if (length > ZYGOTE_MAX) {
+        return -1;
+    }
+    memcpy(zygote.buffer, path, length);
+    for (i = 0; args[i] != NULL; i++) {    //pack the arguments after the path
+        size_t size = strlen(args[i]) + 1;
+        if (length + size > ZYGOTE_MAX) {    //too big for one message
+            return -1;
+        }
+        memcpy(zygote.buffer + length, args[i], size);
+        length += size;
+    }
+    request.argCount = i;
+
+    char **current = currentEnvironment();
+    if (zygote.environmentSent != environmentGeneration) {    //the zygote only hears about a changed environment
+        for (i = 0; current[i] != NULL; i++) {
+            size_t size = strlen(current[i]) + 1;
+            if (length + size > ZYGOTE_MAX) {
+                return -1;
+            }
+            memcpy(zygote.buffer + length, current[i], size);
+            length += size;
+        }
+        request.environmentCount = i == 0 ? -1 : i;    //an empty environment still replaces the old one
+    }
+    request.length = length;
+
+    sent[0] = fds[0] >= 0 ? fds[0] : STDIN_FILENO;
+    sent[1] = fds[1] >= 0 ? fds[1] : STDOUT_FILENO;
+    sent[2] = fds[2] == ERROR_TO_OUTPUT ? sent[1] : fds[2] >= 0 ? fds[2] : STDERR_FILENO;
+    sent[3] = zygote.cwdFD;
+
+    char control[CMSG_SPACE(sizeof(sent))];    //descriptors going with the request
+    memset(control, 0, sizeof(control));
+    struct iovec parts[2] = {
+        { &request, sizeof(request) },
+        { zygote.buffer, length }
+    };
+    struct msghdr message = { NULL, 0, parts, 2, control, sizeof(control), 0 };
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(sent));
+    memcpy(CMSG_DATA(header), sent, sizeof(sent));
+
+    struct zygoteReply reply;
+    ssize_t result;
+    while ((result = sendmsg(zygote.fd, &message, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    if (result != -1) {
+        while ((result = recv(zygote.fd, &reply, sizeof(reply), 0)) == -1 && errno == EINTR) {
+        }
+    }
+    if (result != sizeof(reply)) {    //zygote is gone, spawn from the shell from now on
+        stopZygote();
+        return -1;
+    }
+    zygote.environmentSent = environmentGeneration;
+    *spawnpid = reply.pid;
+    return reply.error;
+}
+
+
+/***********************************************************
+ * stopZygote: closes the shell's end of the zygote's socket,
+ * which makes it exit.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void stopZygote() {
+    if (zygote.fd != -1) {
+        close(zygote.fd);
+        close(zygote.cwdFD);
+        zygote.fd = -1;
+        zygote.cwdFD = -1;
+    }
+}
+
+
+/***********************************************************
+ * runRemote: sends a background job to the agent on the host
+ * named after @, over a connection that stays open for every
+ * job sent there. the job goes in the job table under a
+ * number past any PID and is reported like a local one when
+ * the agent says it's done. redirections name files on that
+ * host, and the exported variables go along.
+ *
+ * parameters: command struct, @host first.
+ * returns: exit status int.
+ ***********************************************************/
+
+int runRemote(struct command *curCommand) {
+    int i;
+
+    if (curCommand->background == FALSE || curCommand->argCount < 2) {
+        fprintf(stderr, "%s: remote commands run in the background, use %s command &\n",
+                curCommand->args[0], curCommand->args[0]);
+        return 1;
+    }
+    struct remoteHost *host = connectRemote(curCommand->args[0] + 1);
+    if (host == NULL) {
+        return 1;
+    }
+
+    char *names[3] = { curCommand->inputFile, curCommand->outputFile, curCommand->errorFile };
+    char **current = currentEnvironment();
+    int sendEnvironment = host->environmentSent != environmentGeneration;    //the agent only hears about a change
+    size_t length = 0;
+    for (i = 0; i < 3; i++) {    //measure the payload first
+        length += (names[i] != NULL ? strlen(names[i]) : 0) + 1;
+    }
+    for (i = 1; i < curCommand->argCount; i++) {
+        length += strlen(curCommand->args[i]) + 1;
+    }
+    for (i = 0; sendEnvironment == TRUE && current[i] != NULL; i++) {
+        length += strlen(current[i]) + 1;
+    }
+    if (length > REMOTE_MAX) {
+        fprintf(stderr, "%s: command too long\n", curCommand->args[0]);
+        return 1;
+    }
+
+    char *payload = arenaAlloc(&lineArena, length);
+    char *pos = payload;
+    for (i = 0; i < 3; i++) {    //redirections, empty for none
+        pos = stpcpy(pos, names[i] != NULL ? names[i] : "") + 1;
+    }
+    for (i = 1; i < curCommand->argCount; i++) {
+        pos = stpcpy(pos, curCommand->args[i]) + 1;
+    }
+    int environmentCount = 0;
+    for (i = 0; sendEnvironment == TRUE && current[i] != NULL; i++) {
+        pos = stpcpy(pos, current[i]) + 1;
+        environmentCount++;
+    }
+
+    struct remoteRequest request;
+    request.id = nextRemoteID;
+    request.argCount = curCommand->argCount - 1;
+    request.environmentCount = environmentCount;
+    request.flags = (curCommand->appendOutput == TRUE ? REMOTE_APPEND : 0)
+                    | (curCommand->errorToOutput == TRUE ? REMOTE_ERROR_TO_OUTPUT : 0);
+    request.length = length;
+    if (writeOutput(host->fd, (char *)&request, sizeof(request)) != 0 || writeOutput(host->fd, payload, length) != 0) {
+        fprintf(stderr, "%s: connection lost\n", curCommand->args[0]);
+        dropRemote(host);
+        return 1;
+    }
+    host->environmentSent = environmentGeneration;
+
+    pid_t id = nextRemoteID++;
+    saveProcess(&id, 1, curCommand);    //the agent's reply takes it out again
+    backProcs.slots[findProcess(id)].host = host;
+    profile.background++;
+    fprintf(stdout, "background pid is %d\n", id);
+    fflush(stdout);
+    return 0;
+}
+
+
+/***********************************************************
+ * connectRemote: finds the connection to a host, or starts
+ * one by running $SMALLSH_REMOTE (ssh -T by default) with
+ * the host name and $SMALLSH_AGENT (smallsh --agent) on a
+ * socket. the socket signals SIGIO when replies arrive, which
+ * wakes the main loop like SIGCHLD does.
+ *
+ * parameters: host name.
+ * returns: connection, or NULL if it couldn't be started.
+ ***********************************************************/
+
+struct remoteHost *connectRemote(char *name) {
+    struct remoteHost *host;
+    int sockets[2];    //shell's end, transport's end
+
+    for (host = remoteHosts; host != NULL; host = host->next) {
+        if (strcmp(host->name, name) == 0) {
+            return host;
+        }
+    }
+
+    char *transport = findVariable("SMALLSH_REMOTE", 14);
+    char *agent = findVariable("SMALLSH_AGENT", 13);
+    char *words[2] = { transport != NULL ? transport : DEFAULT_TRANSPORT, agent != NULL ? agent : DEFAULT_AGENT };
+    size_t total = strlen(words[0]) + strlen(words[1]) + 2;
+    char *copy = arenaAlloc(&lineArena, total);
+    char **args = arenaAlloc(&lineArena, (total + 2) * sizeof(char *));    //a word per two bytes at most, and the host
+    int count = 0;
+    int i;
+    sprintf(copy, "%s", words[0]);
+    sprintf(copy + strlen(words[0]) + 1, "%s", words[1]);
+    for (i = 0; i < 2; i++) {    //the transport's words, the host, then the agent's words
+        char *word;
+        for (word = strtok(i == 0 ? copy : copy + strlen(words[0]) + 1, " \t"); word != NULL; word = strtok(NULL, " \t")) {
+            args[count++] = word;
+        }
+        if (i == 0) {
+            args[count++] = name;
+        }
+    }
+    args[count] = NULL;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) == -1) {
+        perror("@");
+        return NULL;
+    }
+    int fds[3] = { sockets[1], sockets[1], -1 };    //the agent talks on its stdin and stdout
+    pid_t pid = spawnCommand(args, fds, 0);    //its own group, so ^C at the prompt leaves it alone
+    close(sockets[1]);
+    if (pid == -1) {
+        close(sockets[0]);
+        return NULL;
+    }
+    fcntl(sockets[0], F_SETOWN, getpid());
+    fcntl(sockets[0], F_SETFL, O_ASYNC);
+
+    host = malloc(sizeof(struct remoteHost));
+    assert(host != NULL);
+    host->name = strdup(name);
+    assert(host->name != NULL);
+    host->fd = sockets[0];
+    host->pid = pid;
+    host->environmentSent = environmentGeneration - 1;    //nothing sent yet
+    host->received = 0;
+    host->next = remoteHosts;
+    remoteHosts = host;
+    return host;
+}
+
+
+/***********************************************************
+ * readRemote: takes in whatever replies have arrived from a
+ * host without blocking, reporting each job as if it had
+ * been reaped. a reply for a job that wasn't sent to that
+ * host is ignored. if the connection has closed it's
+ * dropped.
+ *
+ * parameters: connection.
+ * returns: none.
+ ***********************************************************/
+
+void readRemote(struct remoteHost *host) {
+    while (1) {
+        ssize_t count = recv(host->fd, host->reply + host->received, sizeof(host->reply) - host->received, MSG_DONTWAIT);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {    //nothing more for now
+            return;
+        }
+        if (count <= 0) {    //agent or transport is gone
+            dropRemote(host);
+            return;
+        }
+        host->received += count;
+        if (host->received == sizeof(host->reply)) {    //a whole reply
+            struct remoteReply reply;
+            struct rusage usage;
+            memcpy(&reply, host->reply, sizeof(reply));
+            host->received = 0;
+            int slot = reply.id >= REMOTE_ID_BASE ? findProcess(reply.id) : -1;
+            if (slot == -1 || backProcs.slots[slot].host != host) {    //not a job sent there, ignore it
+                continue;
+            }
+            memset(&usage, 0, sizeof(usage));
+            usage.ru_utime.tv_sec = reply.userMicros / 1000000;
+            usage.ru_utime.tv_usec = reply.userMicros % 1000000;
+            usage.ru_stime.tv_sec = reply.systemMicros / 1000000;
+            usage.ru_stime.tv_usec = reply.systemMicros % 1000000;
+            usage.ru_maxrss = reply.maxResident;
+            reportChild(reply.id, reply.status, &usage);
+        }
+    }
+}
+
+
+/***********************************************************
+ * dropRemote: closes a connection, which makes the agent
+ * kill its jobs and exit. the jobs still out there are
+ * reported with exit value 255, as ssh does when it loses
+ * the connection. the transport is reaped like any child.
+ *
+ * parameters: connection.
+ * returns: none.
+ ***********************************************************/
+
+void dropRemote(struct remoteHost *host) {
+    struct remoteHost **link;
+    struct rusage usage;
+    int i;
+
+    memset(&usage, 0, sizeof(usage));
+    for (i = 0; i < backProcs.capacity; i++) {
+        struct backProcess *job = &backProcs.slots[i];
+        if (job->active == TRUE && job->host == host) {
+            reportChild(job->backPID, 255 << 8, &usage);    //exit value 255
+        }
+    }
+    for (link = &remoteHosts; *link != host; link = &(*link)->next) {
+    }
+    *link = host->next;
+    close(host->fd);
+    free(host->name);
+    free(host);
+}
+
+
+/***********************************************************
+ * runAgent: the other end of @host. reads jobs from stdin,
+ * starts each in a process group of its own with its
+ * redirections and the shell's exported variables, and
+ * writes a reply to stdout when it's done. everything else
+ * the agent prints goes to stderr. when stdin closes, the
+ * jobs still running are killed.
+ *
+ * parameters: none.
+ * returns: does not return.
+ ***********************************************************/
+
+void runAgent() {
+    int i;
+    pid_t pid;
+    int status;
+    struct rusage usage;
+    pid_t *pids = NULL;    //jobs running
+    int32_t *ids = NULL;    //their job numbers in the shell
+    int count = 0;    //jobs running
+    int capacity = 0;    //room in the arrays
+    char *buffer = NULL;    //requests read so far
+    size_t length = 0;    //bytes in the buffer
+    size_t size = 0;    //room in the buffer
+
+    int replyFD = dup(STDOUT_FILENO);    //stdout is only for replies
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    fcntl(replyFD, F_SETFD, FD_CLOEXEC);
+    signal(SIGPIPE, SIG_IGN);
+    importEnvironment();
+    lineArena.block = arenaNewBlock(ARENA_BLOCK);
+
+    sigset_t childSignals;    //SIGCHLD is read from a signalfd instead of handled
+    sigemptyset(&childSignals);
+    sigaddset(&childSignals, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &childSignals, NULL);
+    int signalFD = signalfd(-1, &childSignals, SFD_CLOEXEC);
+
+    while (1) {
+        struct pollfd watched[2] = { { STDIN_FILENO, POLLIN, 0 }, { signalFD, POLLIN, 0 } };
+        if (poll(watched, 2, -1) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        if ((watched[1].revents & POLLIN) != 0) {    //jobs are done, tell the shell
+            struct signalfd_siginfo info;
+            read(signalFD, &info, sizeof(info));
+            while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {
+                for (i = 0; i < count && pids[i] != pid; i++) {
+                }
+                if (i == count) {
+                    continue;
+                }
+                struct remoteReply reply;
+                reply.id = ids[i];
+                reply.status = status;
+                reply.userMicros = usage.ru_utime.tv_sec * 1000000LL + usage.ru_utime.tv_usec;
+                reply.systemMicros = usage.ru_stime.tv_sec * 1000000LL + usage.ru_stime.tv_usec;
+                reply.maxResident = usage.ru_maxrss;
+                writeOutput(replyFD, (char *)&reply, sizeof(reply));
+                pids[i] = pids[--count];    //fill the gap with the last one
+                ids[i] = ids[count];
+            }
+        }
+
+        if ((watched[0].revents & (POLLIN | POLLHUP)) != 0) {    //more requests from the shell
+            if (size - length < INPUT_BLOCK) {
+                size = size == 0 ? INPUT_BLOCK * 2 : size * 2;
+                buffer = realloc(buffer, size);
+                assert(buffer != NULL);
+            }
+            ssize_t got = read(STDIN_FILENO, buffer + length, size - length);
+            if (got == -1 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {    //the shell is gone
+                break;
+            }
+            length += got;
+
+            size_t used = 0;    //bytes of whole requests handled
+            struct remoteRequest request;
+            while (length - used >= sizeof(request)) {
+                memcpy(&request, buffer + used, sizeof(request));
+                if (request.length > REMOTE_MAX) {    //not a shell on the other end
+                    length = used;
+                    goto done;
+                }
+                if (length - used < sizeof(request) + request.length) {    //rest hasn't arrived
+                    break;
+                }
+                arenaReset(&lineArena);
+                pid = agentSpawn(&request, buffer + used + sizeof(request));
+                if (pid == -1) {    //couldn't be started, it's done already
+                    struct remoteReply reply = { request.id, 1 << 8, 0, 0, 0 };    //exit value 1
+                    writeOutput(replyFD, (char *)&reply, sizeof(reply));
+                } else {
+                    if (count == capacity) {
+                        capacity = capacity == 0 ? JOBS_START : capacity * 2;
+                        pids = realloc(pids, capacity * sizeof(pid_t));
+                        ids = realloc(ids, capacity * sizeof(int32_t));
+                        assert(pids != NULL && ids != NULL);
+                    }
+                    pids[count] = pid;
+                    ids[count++] = request.id;
+                }
+                used += sizeof(request) + request.length;
+            }
+            memmove(buffer, buffer + used, length - used);
+            length -= used;
+        }
+    }
+done:
+    for (i = 0; i < count; i++) {    //nobody is left to hear about them
+        kill(-pids[i], SIGKILL);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+
+/***********************************************************
+ * agentSpawn: starts one job the agent was sent, taking in
+ * any environment that came with it first. input and output
+ * default to the null device, as for a background job.
+ *
+ * parameters: request header, its redirections, arguments
+ * and environment.
+ * returns: PID of the job, or -1 if it couldn't be started.
+ ***********************************************************/
+
+pid_t agentSpawn(struct remoteRequest *request, char *payload) {
+    struct command job;
+    char *names[3];
+    int i;
+
+    memset(&job, 0, sizeof(job));
+    for (i = 0; i < 3; i++) {
+        names[i] = payload[0] != '\0' ? payload : NULL;
+        payload += strlen(payload) + 1;
+    }
+    job.inputFile = names[0];
+    job.outputFile = names[1];
+    job.errorFile = names[2];
+    job.appendOutput = (request->flags & REMOTE_APPEND) != 0;
+    job.errorToOutput = (request->flags & REMOTE_ERROR_TO_OUTPUT) != 0;
+    job.background = TRUE;
+    job.args = arenaAlloc(&lineArena, (request->argCount + 1) * sizeof(char *));
+    for (i = 0; i < request->argCount; i++) {
+        job.args[i] = payload;
+        payload += strlen(payload) + 1;
+    }
+    job.args[i] = NULL;
+    job.argCount = request->argCount;
+    if (job.argCount == 0) {
+        return -1;
+    }
+
+    for (i = 0; i < request->environmentCount; i++) {    //the shell's exported variables
+        char *equals = strchr(payload, '=');
+        if (equals != NULL) {
+            *equals = '\0';
+            setVariable(payload, equals + 1)->exported = TRUE;
+            *equals = '=';
+        }
+        payload += strlen(payload) + 1;
+    }
+    environmentDirty = TRUE;
+
+    int fds[3] = { -1, -1, -1 };
+    fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    fds[1] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (fds[0] == -1 || fds[1] == -1 || openRedirections(&job, fds) == FALSE) {
+        closeRedirections(fds);
+        return -1;
+    }
+    pid_t pid = spawnCommand(job.args, fds, 0);
+    closeRedirections(fds);
+    return pid;
+}
+
+
+/***********************************************************
+ * runPipeline: starts every stage of a pipeline at once in a
+ * new process group, each stage's stdout feeding the next
+ * stage's stdin through a pipe. a stage's own redirection
+ * files take the place of its pipes. one plain cat stage in
+ * a foreground pipeline is copied by the shell after the
+ * other stages start. in the foreground the shell waits for
+ * the whole group; in the background the last stage is saved
+ * as the job.
+ *
+ * parameters: first command struct of the pipeline.
+ * returns: exit status int of the last stage.
+ ***********************************************************/
+
+int runPipeline(struct command *pipeline) {
+    struct command *stage;
+    pid_t group = 0;    //process group of the pipeline, set by the first stage
+    pid_t lastPID = -1;    //PID of the last stage
+    int readFD = -1;    //read end of the pipe from the previous stage
+    struct command *catStage = NULL;    //stage the shell copies itself
+    int catFDs[3] = { -1, -1, -1 };    //descriptors of that stage
+    int catStatus = 0;    //exit status of that stage
+    int stages = 0;    //number of stages
+    int started = 0;    //number of stages running as children
+
+    for (stage = pipeline; stage != NULL; stage = stage->next) {    //make sure there's no empty stage
+        stages++;
+        if (stage->argCount == 0) {
+            printf("error: missing command in pipeline\n");    //print error message
+            fflush(stdout);
+            return 1;
+        }
+    }
+    profile.pipelines++;
+    pid_t *pids = arenaAlloc(&lineArena, stages * sizeof(pid_t));    //PIDs of the stages, for the job table
+
+    for (stage = pipeline; stage != NULL; stage = stage->next) {    //start each stage
+        int fds[3] = { readFD, -1, -1 };    //stage stdin defaults to the previous pipe
+        int pipeFDs[2] = { -1, -1 };
+
+        if (stage->next != NULL) {    //if there's another stage, connect them
+            if (pipe2(pipeFDs, O_CLOEXEC) == -1) {
+                perror("Error");
+                closeRedirections(fds);
+                break;
+            }
+            fds[1] = pipeFDs[1];    //stage stdout defaults to the next pipe
+        }
+        readFD = pipeFDs[0];
+
+        if (pipeline->background == TRUE) {    //background ends of the pipeline use the null device
+            if (stage == pipeline) {
+                fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            }
+            if (stage->next == NULL) {
+                fds[1] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+            }
+        }
+
+        pid_t spawnpid = -1;    //PID of this stage
+        if (openRedirections(stage, fds) == TRUE) {    //open any files named for this stage
+            if (catStage == NULL && pipeline->background == FALSE && canCatThrough(stage, fds[0]) == TRUE) {
+                catStage = stage;    //copy this stage in the shell once the rest are going
+                memcpy(catFDs, fds, sizeof(catFDs));
+                fds[0] = fds[1] = fds[2] = -1;
+            } else {
+                spawnpid = spawnCommand(stage->args, fds, group);    //start the stage
+            }
+        }
+        if (spawnpid != -1 && group == 0) {    //first stage leads the group
+            group = spawnpid;
+            if (pipeline->background == FALSE) {
+                foreGroup = group;    //SIGINT goes to the pipeline from now on
+                if (ownsTerminal == TRUE) {
+                    tcsetpgrp(STDIN_FILENO, group);    //give the terminal to the pipeline
+                }
+            }
+        }
+        if (spawnpid != -1) {
+            pids[started++] = spawnpid;
+        }
+        lastPID = spawnpid;
+        closeRedirections(fds);    //children have their own copies now
+    }
+
+    if (catStage != NULL) {    //do the shell's stage now that the others are reading and writing
+        catStatus = catThrough(catStage, catFDs[0], catFDs[1]);
+        closeRedirections(catFDs);    //let the next stage see the end of input
+    }
+
+    if (group == 0) {    //no child started at all
+        return catStage != NULL && catStage->next == NULL ? catStatus : 1;
+    }
+    if (pipeline->background == TRUE) {    //if it's a background pipeline
+        if (lastPID == -1) {
+            return 1;
+        }
+        saveProcess(pids, started, pipeline);    //save the stages to the job table under the last one
+        profile.background++;
+        fprintf(stdout, "background pid is %d\n", lastPID);    //print that the pipeline has begun
+        fflush(stdout);   //flush output
+        return 0;
+    }
+
+    int lastStatus = waitForeground(group, lastPID);    //wait for every stage to end
+    if (catStage != NULL && catStage->next == NULL) {    //the shell ran the last stage
+        return catStatus;
+    }
+    if (lastPID == -1) {    //last stage never started
+        return 1;
+    }
+    if (WIFSIGNALED(lastStatus)) {    //if the last stage was killed, say so
+        fprintf(stdout, "terminated by signal %d\n", WTERMSIG(lastStatus));
+        fflush(stdout);
+    }
+    return decodeStatus(lastStatus);    //return the last stage's exit status
+}
+
+
+/***********************************************************
+ * waitGroup: waits until every process in a group has ended.
+ * a stage stopped by the terminal is continued; SIGTSTP also
+ * toggles foreground-only mode just like it does for the
+ * shell itself.
+ *
+ * parameters: process group, PID of the last stage, total
+ * resource use of the stages.
+ * returns: wait status of the last stage.
+ ***********************************************************/
+
+int waitGroup(pid_t group, pid_t lastPID, struct rusage *usage) {
+    int status;    //how a stage finished
+    int lastStatus = 0;    //how the last stage finished
+    struct rusage stageUsage;    //resources one stage used
+    pid_t pid;
+
+    while (1) {
+        pid = wait4(-group, &status, WUNTRACED, &stageUsage);    //wait for any stage
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;    //no stages left
+        }
+        if (WIFSTOPPED(status)) {    //if a stage was stopped, start it again
+            if (WSTOPSIG(status) == SIGTSTP) {
+                disableBackground(SIGTSTP);
+            }
+            kill(-group, SIGCONT);
+            continue;
+        }
+        addUsage(usage, &stageUsage);
+        if (pid == lastPID) {
+            lastStatus = status;
+        }
+    }
+    return lastStatus;
+}
+
+
+/***********************************************************
+ * waitForeground: waits for a foreground job's process group
+ * with the terminal handed to it, then takes the terminal
+ * back. that happens whenever the shell's stdin is a
+ * terminal it has in the foreground, running a script or
+ * not, or a job reading the terminal would stop on SIGTTIN.
+ *
+ * parameters: process group, PID whose status counts.
+ * returns: wait status of that PID.
+ ***********************************************************/
+
+int waitForeground(pid_t group, pid_t lastPID) {
+    foreGroup = group;    //save the job's group
+    if (ownsTerminal == TRUE) {
+        tcsetpgrp(STDIN_FILENO, group);    //give the terminal to the job
+    }
+    unsigned long long started = profileStart();
+    int status = waitGroup(group, lastPID, &waitedUsage.usage);
+    profileEnd(PHASE_WAIT, started);
+    foreGroup = -1;    //nothing in the foreground anymore
+    if (ownsTerminal == TRUE) {
+        tcsetpgrp(STDIN_FILENO, getpgrp());    //take the terminal back
+    }
+    waitedUsage.pid = lastPID;
+    waitedUsage.status = status;
+    return status;
+}
+
+
+/***********************************************************
+ * waitBuiltin: waits until every background job, or the jobs
+ * of the PIDs given, are done, reporting them as they finish.
+ * the shell sleeps on the SIGCHLD self-pipe instead of
+ * polling, and SIGINT stops the wait. a job that finished
+ * before the wait still has its status kept, once.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit value of the last PID given, 0 when waiting
+ * for everything, 127 if it isn't a job.
+ ***********************************************************/
+
+int waitBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+    int result = 0;    //exit value to hand back
+    pid_t *pids = arenaAlloc(&lineArena, curCommand->argCount * sizeof(pid_t));    //PIDs being waited for
+    int status;
+
+    for (i = 1; i < curCommand->argCount; i++) {
+        char *end;
+        pids[i] = strtol(curCommand->args[i], &end, 10);
+        if (*end != '\0' || pids[i] <= 0
+                || (findProcess(pids[i]) == -1 && findStatus(pids[i]) == -1)) {    //only jobs can be waited for
+            dprintf(errorFD, "wait: pid %s is not a child of this shell\n", curCommand->args[i]);
+            pids[i] = -1;
+        }
+    }
+
+    sigset_t blocked;    //signals held off while deciding whether to sleep
+    sigset_t previous;    //signal mask to sleep with
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGIO);
+    sigprocmask(SIG_BLOCK, &blocked, &previous);
+    interrupted = FALSE;
+
+    while (1) {
+        int waiting = FALSE;    //whether anything asked for is still running
+        reapChildren();    //report whatever is done
+        drainNotices();
+        if (curCommand->argCount == 1) {
+            waiting = backProcs.count > 0;
+        }
+        for (i = 1; i < curCommand->argCount && waiting == FALSE; i++) {
+            waiting = pids[i] != -1 && findProcess(pids[i]) != -1;
+        }
+        if (waiting == FALSE) {
+            break;
+        }
+        if (interrupted == TRUE) {    //SIGINT gives up
+            result = 128 + SIGINT;
+            break;
+        }
+        struct pollfd wake = { childPipe[0], POLLIN, 0 };    //self-pipe the SIGCHLD handler writes
+        ppoll(&wake, 1, NULL, &previous);    //sleep with signals let through, any of them wakes it
+    }
+    sigprocmask(SIG_SETMASK, &previous, NULL);
+    if (result != 0) {    //interrupted, nothing counts as waited for
+        return result;
+    }
+
+    if (curCommand->argCount == 1) {    //everything has been waited for
+        memset(finished, 0, sizeof(finished));
+    }
+    for (i = 1; i < curCommand->argCount; i++) {    //each PID's status is used up, the last one's is returned
+        if (pids[i] == -1) {
+            result = 127;
+        } else if (takeStatus(pids[i], &status) == TRUE) {
+            result = decodeStatus(status);
+        } else {    //a process of a pipeline, whose job has the status
+            result = 0;
+        }
+    }
+    return result;
+}
+
+
+/***********************************************************
+ * keepStatus: keeps the status of a finished background job
+ * for a wait on its PID, which may come long after the job
+ * was reaped and reported. only the newest FINISHED_KEPT are
+ * kept.
+ *
+ * parameters: background PID, raw wait status.
+ * returns: none.
+ ***********************************************************/
+
+void keepStatus(pid_t pid, int status) {
+    finished[finishedNext].pid = pid;
+    finished[finishedNext].status = status;
+    finishedNext = (finishedNext + 1) % FINISHED_KEPT;
+}
+
+
+/***********************************************************
+ * findStatus: finds the kept status of a finished job, the
+ * newest first in case the PID was reused.
+ *
+ * parameters: background PID.
+ * returns: entry in finished, or -1 if there isn't one.
+ ***********************************************************/
+
+int findStatus(pid_t pid) {
+    int i;
+    for (i = 1; i <= FINISHED_KEPT; i++) {
+        int entry = (finishedNext - i + FINISHED_KEPT) % FINISHED_KEPT;
+        if (finished[entry].pid == pid) {
+            return entry;
+        }
+    }
+    return -1;
+}
+
+
+/***********************************************************
+ * takeStatus: hands over a finished job's kept status and
+ * forgets it, since a PID is only waited for once.
+ *
+ * parameters: background PID, where to store the status.
+ * returns: TRUE, or FALSE if none was kept.
+ ***********************************************************/
+
+int takeStatus(pid_t pid, int *status) {
+    int entry = findStatus(pid);
+    if (entry == -1) {
+        return FALSE;
+    }
+    *status = finished[entry].status;
+    finished[entry].pid = 0;
+    return TRUE;
+}
+
+
+/***********************************************************
+ * parallelBuiltin: runs a command once per item, keeping up
+ * to N children going at a time (N defaults to the number of
+ * cores). items come after ::: or one per line from the input
+ * redirection or stdin, and each is added as the last
+ * argument. jobs read from the null device and share the
+ * shell's output or the output redirection.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit value of the last failed job, or 0.
+ ***********************************************************/
+
+int parallelBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+    int limit = sysconf(_SC_NPROCESSORS_ONLN);    //number of jobs allowed at once
+    int first = 1;    //first argument of the command to run
+    int separator = -1;    //position of :::, if any
+
+    if (curCommand->argCount > 2 && strcmp(curCommand->args[1], "-j") == 0) {    //if a limit was given, use it
+        limit = atoi(curCommand->args[2]);
+        first = 3;
+    }
+    if (limit < 1) {
+        limit = 1;
+    }
+    for (i = first; i < curCommand->argCount; i++) {    //find where the items start
+        if (strcmp(curCommand->args[i], ":::") == 0) {
+            separator = i;
+            break;
+        }
+    }
+    int baseCount = (separator == -1 ? curCommand->argCount : separator) - first;    //arguments before the item
+    if (baseCount == 0) {    //if there's no command, print usage
+        printf("usage: parallel [-j N] command [args...] [::: items...]\n");
+        fflush(stdout);
+        return 1;
+    }
+    if (separator == -1 && curCommand->inputFile == NULL && shellInput.interactive == FALSE && shellInput.fd == STDIN_FILENO) {
+        printf("parallel: no items, stdin is the script\n");    //reading stdin would eat the script
+        fflush(stdout);
+        return 1;
+    }
+
+    char **jobArgs = arenaAlloc(&lineArena, (baseCount + 2) * sizeof(char *));    //command plus item
+    memcpy(jobArgs, &curCommand->args[first], baseCount * sizeof(char *));
+    jobArgs[baseCount + 1] = NULL;
+
+    int nullFD = open("/dev/null", O_RDONLY | O_CLOEXEC);    //jobs don't read the item stream
+    int jobOutput = -1;    //shared output file for all jobs
+    int itemFD = STDIN_FILENO;    //where items are read from
+    if (curCommand->outputFile != NULL) {    //if there's output redirection
+        int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (curCommand->appendOutput == TRUE ? O_APPEND : O_TRUNC);
+        jobOutput = open(curCommand->outputFile, flags, 0777);
+        if (jobOutput == -1) {    //if it can't open
+            printf("cannot open %s for output\n", curCommand->outputFile);    //print error message
+            fflush(stdout);
+            close(nullFD);
+            return 1;
+        }
+    }
+    if (separator == -1 && curCommand->inputFile != NULL) {    //if there's input redirection, items come from it
+        itemFD = open(curCommand->inputFile, O_RDONLY | O_CLOEXEC);
+        if (itemFD == -1) {    //if it can't open
+            printf("cannot open %s for input\n", curCommand->inputFile);    //print error message
+            fflush(stdout);
+            close(nullFD);
+            if (jobOutput != -1) {
+                close(jobOutput);
+            }
+            return 1;
+        }
+    }
+
+    struct input items;    //item lines when not given after :::
+    if (separator == -1) {
+        attachInput(&items, itemFD, itemFD == STDIN_FILENO ? lseek(itemFD, 0, SEEK_CUR) : 0);
+    }
+    char *item = NULL;    //current item as a string
+    size_t itemSize = 0;    //size of the item string buffer
+
+    pid_t *running = malloc(limit * sizeof(pid_t));    //jobs currently going
+    assert(running != NULL);    //make sure array exists
+    int inFlight = 0;    //number of jobs currently going
+    int result = 0;    //exit value of the last failed job
+    int next = separator + 1;    //next item after :::
+
+    while (1) {
+        if (separator != -1) {    //take the next item after :::
+            if (next >= curCommand->argCount) {
+                break;
+            }
+            jobArgs[baseCount] = curCommand->args[next++];
+        } else {    //or the next line of input
+            size_t length;
+            char *line = readLine(&items, &length);
+            if (line == NULL) {
+                break;
+            }
+            if (length == 0) {    //skip blank lines
+                continue;
+            }
+            if (length + 1 > itemSize) {    //make sure the item fits
+                itemSize = (length + 1) * 2;
+                item = realloc(item, itemSize);
+                assert(item != NULL);    //make sure string exists
+            }
+            memcpy(item, line, length);
+            item[length] = '\0';
+            jobArgs[baseCount] = item;
+        }
+
+        while (inFlight == limit) {    //wait for a free slot
+            inFlight -= waitParallel(running, inFlight, &result);
+        }
+        int fds[3] = { nullFD, jobOutput, -1 };    //null input, shared output
+        pid_t spawnpid = spawnCommand(jobArgs, fds, -1);    //start the job
+        if (spawnpid == -1) {
+            result = 1;
+        } else {
+            running[inFlight++] = spawnpid;
+        }
+    }
+    while (inFlight > 0) {    //wait for the rest to finish
+        inFlight -= waitParallel(running, inFlight, &result);
+    }
+
+    free(running);
+    free(item);
+    if (separator == -1) {
+        closeInput(&items);
+        if (itemFD != STDIN_FILENO) {
+            close(itemFD);
+        }
+    }
+    close(nullFD);
+    if (jobOutput != -1) {
+        close(jobOutput);
+    }
+    return result;
+}
+
+
+/***********************************************************
+ * waitParallel: waits for a child to finish. if it's one of
+ * the parallel jobs it's taken off the running list, and if
+ * it's a background process it's reported as usual.
+ *
+ * parameters: running job PIDs, number running, place to
+ * store a failed job's exit value.
+ * returns: number of parallel jobs that finished (0 or 1).
+ ***********************************************************/
+
+int waitParallel(pid_t *running, int inFlight, int *result) {
+    int i;
+    int status;    //how the child finished
+    struct rusage usage;    //resources the child used
+    unsigned long long started = profileStart();
+    pid_t pid = wait4(-1, &status, 0, &usage);    //wait for any child
+    profileEnd(PHASE_WAIT, started);
+
+    if (pid == -1) {
+        if (errno == ECHILD) {    //no children left at all, so the list is stale
+            return inFlight;
+        }
+        return 0;    //interrupted, try again
+    }
+    for (i = 0; i < inFlight; i++) {
+        if (running[i] == pid) {    //if it's a parallel job, free its slot
+            running[i] = running[inFlight - 1];
+            if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+                *result = WEXITSTATUS(status);
+            } else if (WIFSIGNALED(status)) {
+                *result = 128 + WTERMSIG(status);
+            }
+            return 1;
+        }
+    }
+    reportChild(pid, status, &usage);    //otherwise it belongs to the background
+    return 0;
+}
+
+
+/***********************************************************
+ * interruptSignal: passes the interrupt on to the foreground
+ * process. whoever waits for it reports the signal.
+ *
+ * parameters: signal number int.
+ * returns: none.
+ ***********************************************************/
+
+void interruptSignal(int sigNum) {
+    interrupted = TRUE;    //let a waiting builtin know
+    if (foreGroup > 0) {    //if a job is in the foreground, interrupt all of it
+        kill(-foreGroup, sigNum);    //the wait reports how it ended
+    }
+}
+
+
+/***********************************************************
+ * childTerminates: executes when child process terminates.
+ * only notes that something exited and wakes the self-pipe;
+ * the main loop does the reaping in reapChildren.
+ *
+ * parameters: signal number int.
+ * returns: none.
+ ***********************************************************/
+
+void childTerminates(int sigNum) {
+    int savedErrno = errno;    //don't disturb whatever was interrupted
+
+    childExited = TRUE;    //tell the main loop there's work
+    write(childPipe[1], "", 1);    //wake the main loop, a full pipe already has a wake up pending
+    errno = savedErrno;
+}
+
+
+/***********************************************************
+ * reapChildren: reaps every child that has finished since the
+ * last call, and every remote job the agents say is done,
+ * queueing the background ones to be reported and freeing
+ * their job table slots.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void reapChildren() {
+    char drain[64];    //scratch space for emptying the self-pipe
+    pid_t pid;    //PID of a finished child
+    int status;    //how the child finished
+    struct rusage usage;    //resources the child used
+
+    if (childExited == FALSE) {    //nothing has exited, nothing to do
+        return;
+    }
+    childExited = FALSE;
+    while (read(childPipe[0], drain, sizeof(drain)) > 0) {    //empty the self-pipe
+    }
+
+    while ((pid = wait4(-1, &status, WNOHANG, &usage)) > 0) {    //reap each child that has finished
+        reportChild(pid, status, &usage);
+    }
+
+    struct remoteHost *host = remoteHosts;
+    while (host != NULL) {    //and take in what the agents have sent
+        struct remoteHost *next = host->next;    //reading can drop the connection
+        readRemote(host);
+        host = next;
+    }
+}
+
+
+/***********************************************************
+ * reportChild: takes a reaped process out of its background
+ * job. once every process of the job is done, records what
+ * it used, queues it to be reported, and frees its job table
+ * slot. other children are ignored.
+ *
+ * parameters: child pid, wait status, resources it used.
+ * returns: none.
+ ***********************************************************/
+
+void reportChild(pid_t pid, int status, struct rusage *usage) {
+    int slot = findProcess(pid);    //look it up in the job table
+    if (slot == -1) {    //not a background process
+        return;
+    }
+    struct backProcess *job = &backProcs.slots[slot];
+    addUsage(&job->usage, usage);
+    if (pid == job->backPID) {    //the job's status is the last stage's
+        job->lastStatus = status;
+    } else {
+        forgetProcess(pid);    //the job stays findable by its background PID until it's done
+    }
+    if (--job->members > 0) {    //rest of the job is still going
+        return;
+    }
+
+    backUsage.pid = job->backPID;    //remember it for status -v
+    backUsage.status = job->lastStatus;
+    backUsage.wall = elapsedSince(&job->started);
+    backUsage.usage = job->usage;
+    backUsage.valid = TRUE;
+    keepStatus(job->backPID, job->lastStatus);    //for a wait that comes after it's gone
+    if (job->trace != NULL) {
+        traceEntry(job->trace, job->backPID, TRUE, WIFEXITED(job->lastStatus) ? WEXITSTATUS(job->lastStatus) : 0,
+                   WIFSIGNALED(job->lastStatus) ? WTERMSIG(job->lastStatus) : 0, &backUsage);
+    }
+
+    if (notices.count == notices.capacity) {    //queue it, it's reported before the next prompt
+        notices.capacity = notices.capacity == 0 ? JOBS_START : notices.capacity * 2;
+        notices.items = realloc(notices.items, notices.capacity * sizeof(struct notice));
+        notices.usage = realloc(notices.usage, notices.capacity * sizeof(struct jobUsage));
+        assert(notices.items != NULL && notices.usage != NULL);
+    }
+    struct notice *notice = &notices.items[notices.count];
+    notice->slot = slot;
+    notice->timed = job->timed;
+    notice->text = job->text;
+    notices.usage[notices.count++] = backUsage;
+    job->text = NULL;    //the notice has it now
+    removeProcess(slot);    //free the slot for use by another
+}
+
+
+/***********************************************************
+ * drainNotices: prints the exit status of every background
+ * job that has finished since the last time, oldest first,
+ * and what it used if it was timed.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void drainNotices() {
+    int i;
+
+    for (i = 0; i < notices.count; i++) {
+        struct jobUsage *done = &notices.usage[i];
+        if (WIFSIGNALED(done->status)) {    //if exit status was a signal, print signal
+            fprintf(stdout, "background pid %d is done: terminated by signal %d\n", done->pid, WTERMSIG(done->status));
+        } else {    //if exit status wasn't signal, print exit status
+            fprintf(stdout, "background pid %d is done: exit value %d\n", done->pid, WEXITSTATUS(done->status));
+        }
+        fflush(stdout);    //flush output
+        if (notices.items[i].timed == TRUE) {    //time prefix, report what it used
+            printUsage(STDERR_FILENO, done);
+        }
+        free(notices.items[i].text);
+    }
+    notices.count = 0;
+}
+
+
+/***********************************************************
+ * jobsBuiltin: lists the background jobs still running, with
+ * how long they've run, then the ones that have finished but
+ * haven't been reported, with how they ended. those count as
+ * reported.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int jobsBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+
+    reapChildren();    //bring the table up to date
+    for (i = 0; i < backProcs.capacity; i++) {
+        struct backProcess *job = &backProcs.slots[i];
+        if (job->active == TRUE) {
+            dprintf(outputFD, "[%d] %d running %.3fs %s\n", i + 1, job->backPID, elapsedSince(&job->started), job->text);
+        }
+    }
+    for (i = 0; i < notices.count; i++) {
+        struct jobUsage *done = &notices.usage[i];
+        if (WIFSIGNALED(done->status)) {
+            dprintf(outputFD, "[%d] %d terminated by signal %d %.3fs %s\n", notices.items[i].slot + 1, done->pid,
+                    WTERMSIG(done->status), done->wall, notices.items[i].text);
+        } else {
+            dprintf(outputFD, "[%d] %d exit value %d %.3fs %s\n", notices.items[i].slot + 1, done->pid,
+                    WEXITSTATUS(done->status), done->wall, notices.items[i].text);
+        }
+        free(notices.items[i].text);
+    }
+    notices.count = 0;
+    return 0;
+}
+
+
+/***********************************************************
+ * setBuiltin: sets shell options. set -b, or set -o notify,
+ * reports background jobs as soon as they finish, even while
+ * a line is being typed, and +b turns that off. with no
+ * options it prints the shell variables.
+ *
+ * parameters: command struct, output fd.
+ * returns: exit status int.
+ ***********************************************************/
+
+int setBuiltin(struct command *curCommand, int outputFD) {
+    int i;
+
+    if (curCommand->argCount == 1) {    //list the variables, sorted
+        importEnvironment();
+        char **sorted = arenaAlloc(&lineArena, (variableCount + 1) * sizeof(char *));
+        int count = 0;
+        for (i = 0; i < VARIABLE_BUCKETS; i++) {
+            struct variable *variable;
+            for (variable = variables[i]; variable != NULL; variable = variable->next) {
+                sorted[count++] = variable->entry;
+            }
+        }
+        qsort(sorted, count, sizeof(char *), compareMatches);
+        for (i = 0; i < count; i++) {
+            dprintf(outputFD, "%s\n", sorted[i]);
+        }
+        return 0;
+    }
+    for (i = 1; i < curCommand->argCount; i++) {
+        char *option = curCommand->args[i];
+        int on = option[0] == '-';    //- turns an option on, + turns it off
+        if ((option[0] == '-' || option[0] == '+') && strcmp(option + 1, "b") == 0) {
+            notifyNow = on;
+        } else if ((option[0] == '-' || option[0] == '+') && strcmp(option + 1, "o") == 0
+                   && i + 1 < curCommand->argCount && strcmp(curCommand->args[i + 1], "notify") == 0) {
+            notifyNow = on;
+            i++;
+        } else {
+            dprintf(errorFD, "set: %s: invalid option\n", option);
+            return 2;
+        }
+    }
+    return 0;
+}
+
+
+/***********************************************************
+ * disableBackground: keeps track of whether background
+ * processes are enabled or not
+ *
+ * parameters: signal number int.
+ * returns: none.
+ ***********************************************************/
+
+void disableBackground(int sigNum) {
+    if (backgroundDisabled) {    //if background is disabled
+        fprintf(stdout, "Exiting foreground-only mode\n");    //let user know background is enabled
+        fflush(stdout);    //flush output
+        backgroundDisabled = FALSE;    //set background as enabled
+    } else {    //if background is enabled
+        fprintf(stdout, "Entering foreground-only mode (& is now ignored)\n");    //let user know background is disabled
+        fflush(stdout);    //flush output
+        backgroundDisabled = TRUE;    //set background as disabled
+    }
+}
+
+
+/***********************************************************
+ * saveProcess: saves a background job in the job table to
+ * keep track of what has completed. the first process leads
+ * the job's process group and the last is the one reported.
+ *
+ * parameters: PIDs of the job's processes, number of them,
+ * the command line.
+ * returns: none.
+ ***********************************************************/
+
+void saveProcess(pid_t *pids, int count, struct command *pipeline) {
+    int i;
+
+    if (backProcs.freeList == -1) {    //if there's no empty spot, make more
+        growJobs();
+    }
+    int slot = backProcs.freeList;    //take the first empty spot
+    struct backProcess *job = &backProcs.slots[slot];
+    backProcs.freeList = job->nextFree;
+    job->backPID = pids[count - 1];    //set PID to process' PID
+    lastBackground = job->backPID;
+    job->group = pids[0];
+    job->members = count;
+    job->lastStatus = 0;
+    memset(&job->usage, 0, sizeof(job->usage));
+    job->active = TRUE;    //set process as active
+    job->timed = pipeline->timed;
+    job->text = commandText(pipeline);
+    job->host = NULL;
+    job->cgroup = placement.leaf;    //the job's cgroup goes when it does
+    placement.leaf = NULL;
+    job->trace = trace.enabled == TRUE ? strdup(traceCommand(pipeline)) : NULL;
+    trace.saved++;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);    //start the clock for its wall time
+    backProcs.count++;
+
+    for (i = 0; i < count; i++) {    //map every PID to the slot
+        indexProcess(pids[i], slot);
+    }
+}
+
+
+/***********************************************************
+ * commandText: spells out a command line from its arguments,
+ * with the stages of a pipeline joined by |.
+ *
+ * parameters: first command of the line.
+ * returns: malloced string.
+ ***********************************************************/
+
+char *commandText(struct command *pipeline) {
+    struct command *stage;
+    size_t length = 1;    //room for the terminator
+    int i;
+
+    for (stage = pipeline; stage != NULL; stage = stage->next) {    //measure it first
+        for (i = 0; i < stage->argCount; i++) {
+            length += strlen(stage->args[i]) + 1;
+        }
+        length += 2;
+    }
+    char *text = malloc(length);
+    assert(text != NULL);
+    char *pos = text;
+    for (stage = pipeline; stage != NULL; stage = stage->next) {
+        if (stage != pipeline) {
+            pos = stpcpy(pos, "| ");
+        }
+        for (i = 0; i < stage->argCount; i++) {
+            pos = stpcpy(pos, stage->args[i]);
+            *pos++ = ' ';
+        }
+    }
+    if (pos > text) {    //no trailing space
+        pos--;
+    }
+    *pos = '\0';
+    return text;
+}
+
+
+/***********************************************************
+ * findProcess: finds the job table slot of a background
+ * process.
+ *
+ * parameters: process pid.
+ * returns: slot number, or -1 if not a background process.
+ ***********************************************************/
+
+int findProcess(pid_t pid) {
+    if (backProcs.indexCount == 0) {    //nothing in the background
+        return -1;
+    }
+
+    int i = jobIndexStart(pid);
+    while (backProcs.index[i].pid != -1) {    //search until an empty position
+        if (backProcs.index[i].pid == pid) {
+            return backProcs.index[i].slot;
+        }
+        i = (i + 1) & backProcs.indexMask;
+    }
+    return -1;
+}
+
+
+/***********************************************************
+ * removeProcess: removes a background job from the job table
+ * and puts its slot on the free list. PIDs still in the index
+ * are dropped along with it.
+ *
+ * parameters: slot number.
+ * returns: none.
+ ***********************************************************/
+
+void removeProcess(int slot) {
+    int i;
+
+    if (backProcs.slots[slot].members > 0) {    //job is being thrown away, not finished
+        for (i = 0; i <= backProcs.indexMask; i++) {
+            if (backProcs.index[i].pid != -1 && backProcs.index[i].slot == slot) {
+                forgetProcess(backProcs.index[i].pid);
+                i = -1;    //entries shift around, start over
+            }
+        }
+    } else {
+        forgetProcess(backProcs.slots[slot].backPID);
+    }
+    free(backProcs.slots[slot].text);
+    backProcs.slots[slot].text = NULL;
+    free(backProcs.slots[slot].trace);
+    backProcs.slots[slot].trace = NULL;
+    if (backProcs.slots[slot].cgroup != NULL) {    //empty now, unless something it started is still in it
+        rmdir(backProcs.slots[slot].cgroup);
+        free(backProcs.slots[slot].cgroup);
+        backProcs.slots[slot].cgroup = NULL;
+    }
+    backProcs.slots[slot].active = FALSE;    //indicate that the process is no longer running
+    backProcs.slots[slot].nextFree = backProcs.freeList;    //slot can be used by another
+    backProcs.freeList = slot;
+    backProcs.count--;
+}
+
+
+/***********************************************************
+ * indexProcess: maps a PID to its job table slot, growing
+ * the index to keep it at most half full.
+ *
+ * parameters: process pid, slot number.
+ * returns: none.
+ ***********************************************************/
+
+void indexProcess(pid_t pid, int slot) {
+    if ((backProcs.indexCount + 1) * 2 > backProcs.indexMask + 1) {
+        growJobIndex();
+    }
+    int i = jobIndexStart(pid);
+    while (backProcs.index[i].pid != -1) {    //find an empty index position
+        i = (i + 1) & backProcs.indexMask;
+    }
+    backProcs.index[i].pid = pid;    //map the PID to its slot
+    backProcs.index[i].slot = slot;
+    backProcs.indexCount++;
+}
+
+
+/***********************************************************
+ * forgetProcess: removes a PID from the job index. later
+ * index entries are shifted back so searches never stop
+ * early.
+ *
+ * parameters: process pid.
+ * returns: none.
+ ***********************************************************/
+
+void forgetProcess(pid_t pid) {
+    int i = jobIndexStart(pid);
+    while (backProcs.index[i].pid != pid) {    //find the PID's index position
+        if (backProcs.index[i].pid == -1) {    //not there
+            return;
+        }
+        i = (i + 1) & backProcs.indexMask;
+    }
+
+    int j = i;
+    while (1) {    //close the gap left behind
+        j = (j + 1) & backProcs.indexMask;
+        if (backProcs.index[j].pid == -1) {
+            break;
+        }
+        int start = jobIndexStart(backProcs.index[j].pid);    //where this entry wants to be
+        if ((j > i && (start <= i || start > j)) || (j < i && start <= i && start > j)) {
+            backProcs.index[i] = backProcs.index[j];    //move it back into the gap
+            i = j;
+        }
+    }
+    backProcs.index[i].pid = -1;
+    backProcs.indexCount--;
+}
+
+
+/***********************************************************
+ * growJobs: doubles the size of the job table.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void growJobs() {
+    int i;
+    int capacity = backProcs.capacity == 0 ? JOBS_START : backProcs.capacity * 2;
+
+    backProcs.slots = realloc(backProcs.slots, capacity * sizeof(struct backProcess));
+    assert(backProcs.slots != NULL);    //make sure array exists
+    for (i = capacity - 1; i >= backProcs.capacity; i--) {    //put new slots on the free list
+        backProcs.slots[i].active = FALSE;
+        backProcs.slots[i].nextFree = backProcs.freeList;
+        backProcs.freeList = i;
+    }
+    backProcs.capacity = capacity;
+}
+
+
+/***********************************************************
+ * growJobIndex: doubles the size of the PID index and puts
+ * every PID back in.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void growJobIndex() {
+    int i;
+    struct jobEntry *old = backProcs.index;    //index being replaced
+    int oldSize = old == NULL ? 0 : backProcs.indexMask + 1;
+    int size = oldSize == 0 ? JOBS_START * 2 : oldSize * 2;
+
+    backProcs.index = malloc(size * sizeof(struct jobEntry));
+    assert(backProcs.index != NULL);    //make sure array exists
+    backProcs.indexMask = size - 1;
+    backProcs.indexCount = 0;
+    for (i = 0; i < size; i++) {
+        backProcs.index[i].pid = -1;
+    }
+    for (i = 0; i < oldSize; i++) {    //re-add the processes already running
+        if (old[i].pid != -1) {
+            indexProcess(old[i].pid, old[i].slot);
+        }
+    }
+    free(old);
+}
+
+
+/***********************************************************
+ * jobIndexStart: index position where the search for a PID
+ * begins.
+ *
+ * parameters: process pid.
+ * returns: index position.
+ ***********************************************************/
+
+int jobIndexStart(pid_t pid) {
+    return ((unsigned int)pid * 2654435761u) & backProcs.indexMask;    //spread nearby PIDs apart
+}
+
+
+/***********************************************************
+ * profileStart: starts timing a phase if profiling is on.
+ *
+ * parameters: none.
+ * returns: monotonic time in nanoseconds, 0 if not profiling.
+ ***********************************************************/
+
+unsigned long long profileStart() {
+    struct timespec now;
+
+    if (profile.enabled == FALSE) {    //costs one branch when off
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+
+/***********************************************************
+ * profileEnd: adds the time since profileStart to a phase's
+ * histogram.
+ *
+ * parameters: phase, start time from profileStart.
+ * returns: none.
+ ***********************************************************/
+
+void profileEnd(enum profilePhase phase, unsigned long long started) {
+    if (profile.enabled == FALSE) {
+        return;
+    }
+    struct phaseStats *stats = &profile.phases[phase];
+    unsigned long long elapsed = profileStart() - started;
+
+    stats->count++;
+    stats->total += elapsed;
+    if (elapsed > stats->max) {
+        stats->max = elapsed;
+    }
+    stats->buckets[profileBucket(elapsed)]++;
+}
+
+
+/***********************************************************
+ * profileBucket: finds the histogram bucket for a time. each
+ * power of two is split into four buckets, so a bucket is
+ * within 25% of any time in it.
+ *
+ * parameters: time in nanoseconds.
+ * returns: bucket number.
+ ***********************************************************/
+
+int profileBucket(unsigned long long nanoseconds) {
+    if (nanoseconds < 4) {    //small times get a bucket each
+        return nanoseconds;
+    }
+    int top = 63 - __builtin_clzll(nanoseconds);    //highest set bit, at least 2
+    return top * 4 + ((nanoseconds >> (top - 2)) & 3) - 4;
+}
+
+
+/***********************************************************
+ * profilePercentile: estimates a percentile from a phase's
+ * histogram as the top of the bucket it falls in, but never
+ * more than the longest time seen.
+ *
+ * parameters: phase stats, fraction between 0 and 1.
+ * returns: time in nanoseconds.
+ ***********************************************************/
+
+unsigned long long profilePercentile(struct phaseStats *stats, double fraction) {
+    int i;
+    unsigned long seen = 0;    //times in buckets so far
+    unsigned long long rank = (unsigned long long)(fraction * stats->count);    //times that come before it
+
+    if (stats->count == 0) {
+        return 0;
+    }
+    if (rank >= stats->count) {
+        rank = stats->count - 1;
+    }
+    for (i = 0; i < PROFILE_BUCKETS; i++) {
+        seen += stats->buckets[i];
+        if (seen > rank) {
+            break;
+        }
+    }
+
+    unsigned long long top;    //largest time in the bucket
+    if (i < 4) {
+        top = i;
+    } else {
+        int shift = i / 4 - 1;    //power of two of the bucket, less two
+        top = ((unsigned long long)(4 + i % 4 + 1) << shift) - 1;
+    }
+    return top < stats->max ? top : stats->max;
+}
+
+
+/***********************************************************
+ * profileDump: writes the phase histograms and counters as
+ * JSON, to the profile file or to stderr.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void profileDump() {
+    int i;
+
+    if (profile.enabled == FALSE) {
+        return;
+    }
+    FILE *out = stderr;    //where the JSON goes
+    if (profile.file != NULL) {
+        out = fopen(profile.file, "we");
+        if (out == NULL) {    //if it can't open
+            fprintf(stderr, "cannot open %s for profile\n", profile.file);
+            return;
+        }
+    }
+
+    fprintf(out, "{\n  \"phases\": {\n");
+    for (i = 0; i < PHASE_COUNT; i++) {
+        struct phaseStats *stats = &profile.phases[i];
+        fprintf(out, "    \"%s\": { \"count\": %lu, \"total_ns\": %llu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu }%s\n",
+                stats->name, stats->count, stats->total, profilePercentile(stats, 0.50),
+                profilePercentile(stats, 0.99), stats->max, i + 1 < PHASE_COUNT ? "," : "");
+    }
+    fprintf(out, "  },\n  \"counters\": { \"lines\": %lu, \"cache_hits\": %lu, \"builtins\": %lu, \"spawns\": %lu, \"pipelines\": %lu, \"background\": %lu }\n}\n",
+            profile.lines, profile.cacheHits, profile.builtins, profile.spawns, profile.pipelines, profile.background);
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+
+/***********************************************************
+ * traceCommand: describes the stages of a line for the trace,
+ * each with its arguments and redirections, in a scratch
+ * buffer reused from line to line.
+ *
+ * parameters: first command of the line.
+ * returns: JSON array, good until the next call.
+ ***********************************************************/
+
+char *traceCommand(struct command *pipeline) {
+    struct command *stage;
+    int i;
+
+    trace.used = 0;
+    traceText("[", 1);
+    for (stage = pipeline; stage != NULL; stage = stage->next) {
+        traceText(stage == pipeline ? "{\"argv\":[" : ",{\"argv\":[", stage == pipeline ? 9 : 10);
+        for (i = 0; i < stage->argCount; i++) {
+            if (i > 0) {
+                traceText(",", 1);
+            }
+            traceString(stage->args[i]);
+        }
+        traceText("],\"stdin\":", 10);
+        traceString(stage->inputFile);
+        traceText(",\"stdout\":", 10);
+        traceString(stage->outputFile);
+        traceText(",\"stderr\":", 10);
+        traceString(stage->errorToOutput == TRUE ? "&1" : stage->errorFile);
+        traceText(stage->appendOutput == TRUE ? ",\"append\":true}" : ",\"append\":false}", stage->appendOutput == TRUE ? 15 : 16);
+    }
+    traceText("]", 2);    //and the terminator
+    return trace.scratch;
+}
+
+
+/***********************************************************
+ * traceString: adds a string to the scratch buffer as JSON,
+ * escaping quotes, backslashes and control characters.
+ *
+ * parameters: string, or NULL for null.
+ * returns: none.
+ ***********************************************************/
+
+void traceString(char *text) {
+    char *pos;
+    char *start;
+
+    if (text == NULL) {
+        traceText("null", 4);
+        return;
+    }
+    traceText("\"", 1);
+    for (pos = start = text; *pos != '\0'; pos++) {
+        if (*pos == '"' || *pos == '\\' || (unsigned char)*pos < 0x20) {
+            char escaped[8];
+            traceText(start, pos - start);    //the plain run before it
+            traceText(escaped, sprintf(escaped, *pos == '"' || *pos == '\\' ? "\\%c" : "\\u%04x", *pos));
+            start = pos + 1;
+        }
+    }
+    traceText(start, pos - start);
+    traceText("\"", 1);
+}
+
+
+/***********************************************************
+ * traceText: adds bytes to the scratch buffer, growing it.
+ *
+ * parameters: bytes, count.
+ * returns: none.
+ ***********************************************************/
+
+void traceText(const char *text, size_t length) {
+    if (trace.used + length > trace.size) {
+        trace.size = (trace.used + length) * 2;
+        trace.scratch = realloc(trace.scratch, trace.size);
+        assert(trace.scratch != NULL);
+    }
+    memcpy(trace.scratch + trace.used, text, length);
+    trace.used += length;
+}
+
+
+/***********************************************************
+ * traceEntry: adds one finished job to the trace: its stages,
+ * PID (0 when the shell did the work), when it started and
+ * ended, how it ended, and what it used.
+ *
+ * parameters: stages from traceCommand, PID, whether it ran
+ * in the background, exit value, signal or 0, usage.
+ * returns: none.
+ ***********************************************************/
+
+void traceEntry(char *stages, pid_t pid, int background, int exitValue, int signal, struct jobUsage *done) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long end = now.tv_sec * 1000000LL + now.tv_nsec / 1000;    //microseconds, printf is much faster on integers
+    long long start = end - (long long)(done->wall * 1e6);
+
+    traceAppend("{\"start\":%lld.%06lld,\"end\":%lld.%06lld,\"pid\":%d,\"background\":%s,", start / 1000000,
+                start % 1000000, end / 1000000, end % 1000000, pid, background == TRUE ? "true" : "false");
+    if (signal != 0) {
+        traceAppend("\"status\":null,\"signal\":%d,", signal);
+    } else {
+        traceAppend("\"status\":%d,\"signal\":null,", exitValue);
+    }
+    traceAppend("\"user_s\":%ld.%06ld,\"system_s\":%ld.%06ld,\"maxrss_kb\":%ld,\"minflt\":%ld,\"majflt\":%ld,\"stages\":",
+                (long)done->usage.ru_utime.tv_sec, (long)done->usage.ru_utime.tv_usec,
+                (long)done->usage.ru_stime.tv_sec, (long)done->usage.ru_stime.tv_usec,
+                done->usage.ru_maxrss, done->usage.ru_minflt, done->usage.ru_majflt);
+    size_t length = strlen(stages);
+    while (length > 0) {    //stages can be longer than the buffer
+        size_t room = TRACE_BUFFER - trace.length;
+        if (room == 0) {
+            traceFlush();
+            continue;
+        }
+        size_t part = length < room ? length : room;
+        memcpy(trace.buffer + trace.length, stages, part);
+        trace.length += part;
+        stages += part;
+        length -= part;
+    }
+    traceAppend("}\n");
+}
+
+
+/***********************************************************
+ * traceAppend: formats text onto the end of the trace
+ * buffer, writing the buffer out first if it won't fit.
+ *
+ * parameters: printf format and its arguments.
+ * returns: none.
+ ***********************************************************/
+
+void traceAppend(const char *format, ...) {
+    va_list arguments;
+    char text[512];    //longest piece traceEntry formats
+
+    va_start(arguments, format);
+    int length = vsnprintf(text, sizeof(text), format, arguments);
+    va_end(arguments);
+    if (length >= (int)sizeof(text)) {
+        length = sizeof(text) - 1;
+    }
+    if (trace.length + length > TRACE_BUFFER) {
+        traceFlush();
+    }
+    memcpy(trace.buffer + trace.length, text, length);
+    trace.length += length;
+}
+
+
+/***********************************************************
+ * traceFlush: writes out whatever is in the trace buffer,
+ * opening the trace file the first time. it's called when
+ * the buffer fills, before reading more input could block,
+ * and at exit, so running a command never waits on the
+ * trace.
+ *
+ * parameters: none.
+ * returns: none.
+ ***********************************************************/
+
+void traceFlush() {
+    if (trace.length == 0) {
+        return;
+    }
+    if (trace.fd == -1) {
+        trace.fd = open(trace.file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (trace.fd == -1) {
+            fprintf(stderr, "cannot open %s for trace\n", trace.file);
+            trace.enabled = FALSE;
+            trace.length = 0;
+            return;
+        }
+    }
+    writeOutput(trace.fd, trace.buffer, trace.length);
+    trace.length = 0;
+}